@@ -3,11 +3,14 @@
 nsec_t max_fps = 240;
 double simulation_speed = 1;
 int steps_per_frame = 100;
+double frame_budget = 0.5;
+int min_steps_per_frame = 10, max_steps_per_frame = 100000;
 bool frame_skip = true;
 
 #include "../src/render.h"
 #include "../src/linked_list.h"
 #include "../src/util.h"
+#include "../src/metrics.h"
 #include <math.h>
 #include <inttypes.h>
 
@@ -17,12 +20,12 @@ struct display_data init_display(void) {
 	};
 }
 
-struct sim_simulation *init_simulation(void) {
+struct sim_simulation *init_simulation(bool interactive) {
 	struct sim_simulation *sim;
 	CWRAPPER_OUTPUT_TYPE sym_error = 0;
 	bool res = false;
 
-	basic_struct *temp = NULL, *vx = NULL, *vy = NULL, *vlx = NULL, *vly = NULL, *height = NULL, *half = NULL, *one = NULL;
+	basic_struct *temp = NULL, *vx = NULL, *vy = NULL, *vlx = NULL, *vly = NULL, *height = NULL, *half = NULL, *one = NULL, *px = NULL, *py = NULL;
 
 	ASSERT(sim = sim_new(NULL, 1));
 	sim->in_variables[0] = 9.81; // gravity
@@ -49,7 +52,11 @@ struct sim_simulation *init_simulation(void) {
 	BASIC_NEW(height);
 	BASIC_NEW(half);
 	BASIC_NEW(one);
+	BASIC_NEW(px);
+	BASIC_NEW(py);
 
+	basic_const_zero(px);
+	basic_const_zero(py);
 	basic_const_zero(vx);
 	basic_const_zero(vy);
 	basic_const_zero(height);
@@ -94,8 +101,27 @@ struct sim_simulation *init_simulation(void) {
 
 		// set potential energy, GPE=mgh
 		ASSERT_SYM(basic_assign(body->sym_potential, temp));
+
+		// position of the end of the pendulum, used for rendering
+		ASSERT_SYM(basic_sin(temp, body->sym_coordinates[0].position));
+		ASSERT_SYM(basic_mul(temp, temp, body->sym_variables[1]));
+		ASSERT_SYM(basic_add(px, px, temp));
+		ASSERT_SYM(basic_cos(temp, body->sym_coordinates[0].position));
+		ASSERT_SYM(basic_mul(temp, temp, body->sym_variables[1]));
+		ASSERT_SYM(basic_add(py, py, temp));
+		ASSERT(sim_new_observable(NULL, sim, body, "x", px));
+		ASSERT(sim_new_observable(NULL, sim, body, "y", py));
+
+		// count each time the arm swings through the bottom, sin(θ/2) is only zero there, unlike sin(θ) which is also zero at the top
+		ASSERT_SYM(basic_mul(temp, body->sym_coordinates[0].position, half));
+		ASSERT_SYM(basic_sin(temp, temp));
+		ASSERT(sim_new_event(NULL, sim, "bottom", temp, 0, NULL, NULL));
 	}
 
+	sim->integrator = SIM_INTEGRATOR_RK4; // SIM_INTEGRATOR_RADAU suits stiff models, e.g. with stiff springs or very light bodies
+	sim->multirate = SIM_MULTIRATE_OFF;   // SIM_MULTIRATE_AUTO sub-cycles bodies much faster than the rest, e.g. short light arms
+	// interactively, step with the lambda backend while the LLVM kernels compile, so the first frame isn't held up
+	sim->tiered = interactive;
 	ASSERT(sim_compile(NULL, sim));
 
 	res = true;
@@ -108,6 +134,8 @@ fail:
 	BASIC_FREE(height);
 	BASIC_FREE(half);
 	BASIC_FREE(one);
+	BASIC_FREE(px);
+	BASIC_FREE(py);
 	if (res) return sim;
 	sim_remove(sim);
 	return NULL;
@@ -117,36 +145,107 @@ void free_simulation(struct sim_simulation *sim) {
 	sim_remove(sim);
 }
 
-bool render_func(struct display_screen screen, struct sim_simulation *sim) {
-	static const struct posf stretch = {2, 1};
+// maps the reach of the pendulum, letter-boxed, onto the screen
+static void get_render_rects(struct display_screen screen, struct sim_simulation *sim, struct rectf *rect_from, struct rectf *rect_to) {
+	// terminal characters are about twice as tall as wide, so cells are only square in the colour mode's 1x2 blocks, or as pixels
+	bool square = screen.mode == DISPLAY_COLOR || screen.mode == DISPLAY_COVERAGE || screen.graphics != DISPLAY_TEXT;
+	struct posf stretch = square ? POSF(1, 1) : POSF(2, 1);
 
 	float total_length = 0;
 	LL_LOOP(struct sim_body *, body, sim->bodies) {
 		total_length += body->in_variables[1];
 	}
 
-	struct rectf
-	        rect_from = RECTF(-total_length, -total_length, total_length * 2, total_length * 2), // max distance the pendulum can reach
-	        rect_stretched = RECTF2(POSF2(0), stretch),
-	        rect_to = get_fit_rectf(rect_stretched.size, RECTF2(POSF2(0), poss2f(screen.size))); // letter-box rect to the display screen size
+	*rect_from = RECTF(-total_length, -total_length, total_length * 2, total_length * 2); // max distance the pendulum can reach
+	*rect_to = get_fit_rectf(stretch, RECTF2(POSF2(0), poss2f(screen.size)));         // letter-box rect to the display screen size
+}
+
+bool render_func(struct display_screen screen, struct sim_simulation *sim) {
+	struct rectf rect_from, rect_to;
+	get_render_rects(screen, sim, &rect_from, &rect_to);
 
 	struct posf pend_t = POSF(0, 0);
 	LL_LOOP(struct sim_body *, body, sim->bodies) {
-		double angle = body->coordinates[0].position, length = body->in_variables[1];
 		struct posf pend_f = pend_t;
-		pend_t.x += sin(angle) * length;
-		pend_t.y += cos(angle) * length;
+		struct sim_observable *x = sim_find_observable(sim, body, "x"), *y = sim_find_observable(sim, body, "y");
+		if (sim->out_observables && x && y) {
+			// evaluated by the compiled kernel alongside the energy
+			pend_t.x = sim->out_observables[x->index];
+			pend_t.y = sim->out_observables[y->index];
+		} else {
+			// not compiled, e.g. when viewing a published simulation
+			double angle = body->coordinates[0].position, length = body->in_variables[1];
+			pend_t.x += sin(angle) * length;
+			pend_t.y += cos(angle) * length;
+		}
 
 		// draw line
 		struct posf cell_f = map_rectf(pend_f, rect_from, rect_to),
 		            cell_t = map_rectf(pend_t, rect_from, rect_to);
 
-		draw_line(cell_f, cell_t, 1, screen);
+		if (screen.mode == DISPLAY_BLOCKS)
+			draw_line(cell_f, cell_t, 1, screen);
+		else
+			draw_lines_density((struct posf[]) {cell_f, cell_t}, 1, screen, 1);
 	}
 
 	return true;
 }
 
+struct ensemble_raster {
+	const struct posf *points;
+	size_t segments_len;
+	struct display_screen screen;
+};
+
+static void render_ensemble_band(void *data, unsigned band, unsigned bands) {
+	const struct ensemble_raster *raster = data;
+	draw_lines_density_band(raster->points, raster->segments_len, raster->screen, band, bands);
+}
+
+bool render_ensemble_func(struct display_screen screen, struct sim_simulation *sim, struct ensemble *ensemble) {
+	if (screen.mode == DISPLAY_BLOCKS) return false;
+	struct rectf rect_from, rect_to;
+	get_render_rects(screen, sim, &rect_from, &rect_to);
+
+	// a segment from the pivot (or the previous tip) to each tip, for every member
+	size_t bodies_len = sim->internal_bodies_len, segments_len = ensemble->members * bodies_len;
+	if (ensemble->points_cap < segments_len * 2) {
+		struct posf *points = realloc(ensemble->points, segments_len * 2 * sizeof(*points));
+		if (!points) return false;
+		ensemble->points = points;
+		ensemble->points_cap = segments_len * 2;
+	}
+
+	// where each body's tip is among the observables, the same for every member
+	size_t x_index[bodies_len], y_index[bodies_len], body_i = 0;
+	LL_LOOP(struct sim_body *, body, sim->bodies) {
+		struct sim_observable *x = sim_find_observable(sim, body, "x"), *y = sim_find_observable(sim, body, "y");
+		if (!x || !y) return false;
+		x_index[body_i] = x->index;
+		y_index[body_i++] = y->index;
+	}
+
+	struct posf *points = ensemble->points;
+	size_t energy_len = SIM_ENERGY_LEN(sim), segment = 0;
+	for (size_t member = 0; member < ensemble->members; ++member) {
+		const double *observables = ensemble->outputs + member * energy_len + 2 * bodies_len;
+		struct posf pend_t = POSF(0, 0);
+		for (size_t i = 0; i < bodies_len; ++i) {
+			struct posf pend_f = pend_t;
+			pend_t = POSF(observables[x_index[i]], observables[y_index[i]]);
+			points[segment * 2] = map_rectf(pend_f, rect_from, rect_to);
+			points[segment * 2 + 1] = map_rectf(pend_t, rect_from, rect_to);
+			++segment;
+		}
+	}
+
+	// in bands on the ensemble's threads, which are already waiting from stepping it, unless there are fewer rows than threads
+	if (screen.h < ensemble->threads) return draw_lines_density(points, segments_len, screen, 1);
+	ensemble_parallel(ensemble, render_ensemble_band, &(struct ensemble_raster) {points, segments_len, screen});
+	return true;
+}
+
 bool update_display_func(struct sim_simulation *sim, struct display_data *display, const struct timing_info *timing) {
 	static char str[2048];
 	display->info = str;
@@ -158,19 +257,43 @@ bool update_display_func(struct sim_simulation *sim, struct display_data *displa
 	}
 	double total = kinetic + potential;
 
+	char crossings_str[64] = "";
+	size_t crossings_len = 0;
+	LL_LOOP(struct sim_event *, event, sim->events) {
+		int printed = snprintf(crossings_str + crossings_len, LENGTHOF(crossings_str) - crossings_len, " %6lu", event->count);
+		if (printed < 0 || (crossings_len += printed) >= LENGTHOF(crossings_str)) break;
+	}
+
+	char metrics_str[256] = "";
+	if (metrics_enabled)
+		snprintf(metrics_str, LENGTHOF(metrics_str),
+		         "   Frame latency: %10" PRIu64 " ns p50, %10" PRIu64 " ns p99\n"
+		         "  Sim/render p50: %10" PRIu64 " ns / %" PRIu64 " ns\n",
+		         metrics_percentile(METRICS_FRAME_NS, 0.5), metrics_percentile(METRICS_FRAME_NS, 0.99),
+		         metrics_percentile(METRICS_SIM_NS, 0.5), metrics_percentile(METRICS_RENDER_NS, 0.5));
+
 	int printf_res = snprintf(str, LENGTHOF(str),
 	                          "             FPS: %10.3f Hz%s%s%s\n"
-	                          " Simulation time: %10" PRIuMAX " ns\n"
+	                          "           Speed: %10.3fx%s\n"
+	                          " Simulation time: %10" PRIuMAX " ns%s\n"
+	                          " Steps per frame: %10d, %3.0f%% of budget\n"
 	                          "     Render time: %10" PRIuMAX " ns\n"
 	                          "  Kinetic energy: %10.3f J\n"
 	                          "Potential energy: %10.3f J\n"
-	                          "    Total energy: %10.3f J\n",
+	                          "    Total energy: %10.3f J\n"
+	                          "   Bottom swings:%s\n"
+	                          "%s%s%s%s",
 	                          SEC / (double) timing->frame_time,
 	                          timing->show_lag ? " (" : "",
 	                          timing->show_lag ? (frame_skip ? "frame skipping" : "lagging") : "",
 	                          timing->show_lag ? ")" : "",
-	                          timing->sim_time, timing->render_time,
-	                          kinetic, potential, total);
+	                          simulation_speed, timing->paused ? " (paused)" : "",
+	                          timing->sim_time, sim_tiering(sim) ? " (compiling kernels)" : "",
+	                          timing->steps, 100 * timing->utilisation, timing->render_time,
+	                          kinetic, potential, total,
+	                          crossings_str,
+	                          timing->warning ? "         Warning: " : "", timing->warning ? timing->warning : "", timing->warning ? "\n" : "",
+	                          metrics_str);
 
 	return printf_res > 0 && printf_res <= LENGTHOF(str);
 }
@@ -11,7 +11,7 @@
           (symengine.overrideAttrs (prev: {
             buildInputs = prev.buildInputs ++ [ libllvm ];
             cmakeFlags = prev.cmakeFlags
-              ++ [ (lib.cmakeBool "WITH_LLVM" true) ];
+              ++ [ (lib.cmakeBool "WITH_LLVM" true) (lib.cmakeBool "WITH_SYMENGINE_THREAD_SAFE" true) ];
           }))
           gmp
           mpfr
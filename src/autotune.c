@@ -0,0 +1,209 @@
+#include "autotune.h"
+#include "metrics.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <math.h>
+
+#define AUTOTUNE_SAMPLES 8         // states the kernels are timed at, the current one and perturbations of it
+#define AUTOTUNE_MIN_CALLS 64      // calls timed of each kernel, at least
+#define AUTOTUNE_MIN_NS 2000000    // nanoseconds each kernel is timed for, at least
+#define AUTOTUNE_AGREEMENT 1e-6    // relative difference from the reference kernel beyond which a kernel is taken to be wrong
+#define AUTOTUNE_LLVM_LEVELS 4     // optimisation levels 0 to 3
+
+struct autotune_candidate {
+	struct sim_kernel kernel;
+	bool measured;
+	double compile_time, call_time; // seconds, call_time is infinite if its results were wrong
+	struct sim_visitor *visitor;    // compiled in this run, or NULL
+};
+
+static const char *autotune_backend_name(enum sim_backend backend) {
+	return backend == SIM_BACKEND_LLVM ? "llvm" : "lambda";
+}
+
+static uint64_t fnv1a(const unsigned char *data, size_t len, uint64_t hash) {
+	for (size_t i = 0; i < len; ++i) hash = (hash ^ data[i]) * 0x100000001b3;
+	return hash;
+}
+
+// hash of the outputs at arguments spread over [0.5, 1.5), rounded to float so the last bits of the evaluation don't matter
+static uint64_t autotune_fingerprint(const struct sim_visitor *visitor, size_t args_len, size_t outs_len) {
+	double args[args_len], outs[outs_len];
+	for (size_t i = 0; i < args_len; ++i) args[i] = 0.5 + fmod(i * 0.6180339887498949, 1);
+	sim_visitor_call(visitor, outs, args);
+	uint64_t hash = 0xcbf29ce484222325;
+	uint32_t lens[2] = {args_len, outs_len};
+	hash = fnv1a((const unsigned char *) lens, sizeof(lens), hash);
+	for (size_t i = 0; i < outs_len; ++i) {
+		float out = outs[i];
+		hash = fnv1a((const unsigned char *) &out, sizeof(out), hash);
+	}
+	return hash;
+}
+
+static bool autotune_load(FILE *file, uint64_t fingerprint, struct autotune_candidate *candidates, size_t candidates_len, FILE *others) {
+	char line[256], backend[16];
+	while (fgets(line, sizeof(line), file)) {
+		uint64_t line_fingerprint;
+		int opt_level, cse;
+		double compile_time, call_time;
+		if (sscanf(line, "%" SCNx64 " %15s %d %d %lf %lf", &line_fingerprint, backend, &opt_level, &cse, &compile_time, &call_time) != 6) continue;
+		if (line_fingerprint != fingerprint) {
+			// other models' lines are written back as they were
+			if (fputs(line, others) == EOF) return false;
+			continue;
+		}
+		for (size_t i = 0; i < candidates_len; ++i) {
+			struct autotune_candidate *candidate = &candidates[i];
+			if (strcmp(backend, autotune_backend_name(candidate->kernel.backend)) || candidate->kernel.cse != (cse != 0)) continue;
+			if (candidate->kernel.backend == SIM_BACKEND_LLVM && candidate->kernel.opt_level != opt_level) continue;
+			candidate->measured = true;
+			candidate->compile_time = compile_time;
+			candidate->call_time = call_time;
+		}
+	}
+	return !ferror(file);
+}
+
+// rewritten whole through a temporary file, so concurrent runs at worst lose each other's measurements
+static bool autotune_save(const char *path, uint64_t fingerprint, const struct autotune_candidate *candidates, size_t candidates_len, const char *others, size_t others_len) {
+	bool res = false;
+	char *temp_path = malloc(strlen(path) + 5);
+	if (!temp_path) return false;
+	sprintf(temp_path, "%s.tmp", path);
+	FILE *file = fopen(temp_path, "w");
+	ASSERT(file);
+	bool written = fwrite(others, 1, others_len, file) == others_len;
+	for (size_t i = 0; written && i < candidates_len; ++i) {
+		const struct autotune_candidate *candidate = &candidates[i];
+		if (!candidate->measured) continue;
+		written = fprintf(file, "%016" PRIx64 " %s %d %d %.9g %.9g\n", fingerprint, autotune_backend_name(candidate->kernel.backend),
+		                  candidate->kernel.opt_level, candidate->kernel.cse, candidate->compile_time, candidate->call_time) > 0;
+	}
+	if (fclose(file)) written = false;
+	ASSERT(written && !rename(temp_path, path));
+	res = true;
+fail:
+	free(temp_path);
+	return res;
+}
+
+static bool autotune_compile(struct autotune_candidate *candidate, const CVecBasic *args, const CVecBasic *exprs) {
+	uint64_t start = metrics_now();
+	if (!(candidate->visitor = sim_visitor_new(&candidate->kernel, args, exprs))) return false;
+	candidate->compile_time = (metrics_now() - start) * 1e-9;
+	return true;
+}
+
+// times calls of the candidate over the samples, checking its outputs against those of the reference kernel at the first one
+static void autotune_time(struct autotune_candidate *candidate, const double *samples, size_t args_len, const double *reference, size_t outs_len) {
+	double outs[outs_len];
+	sim_visitor_call(candidate->visitor, outs, samples);
+	candidate->measured = true;
+	for (size_t i = 0; i < outs_len; ++i)
+		if (!(fabs(outs[i] - reference[i]) <= AUTOTUNE_AGREEMENT * (1 + fabs(reference[i])))) {
+			candidate->call_time = INFINITY;
+			return;
+		}
+
+	uint64_t start = metrics_now(), elapsed;
+	size_t calls = 0;
+	do {
+		for (size_t i = 0; i < AUTOTUNE_SAMPLES; ++i) sim_visitor_call(candidate->visitor, outs, samples + i * args_len);
+		calls += AUTOTUNE_SAMPLES;
+	} while ((elapsed = metrics_now() - start) < AUTOTUNE_MIN_NS || calls < AUTOTUNE_MIN_CALLS);
+	candidate->call_time = elapsed * 1e-9 / calls;
+}
+
+// what choosing the candidate costs from here, as a compiled one has already paid for compiling
+static double autotune_cost(const struct sim_simulation *sim, const struct autotune_candidate *candidate) {
+	return (candidate->visitor ? 0 : candidate->compile_time) + sim->autotune_calls * candidate->call_time;
+}
+
+bool autotune_dydt(struct sim_simulation *sim, const CVecBasic *args, const CVecBasic *exprs) {
+	bool res = false, changed = false;
+	size_t args_len = sim->internal_args_len, outs_len = SIM_STATE_LEN(sim);
+	char *others = NULL;
+	size_t others_len = 0;
+	FILE *others_file = NULL;
+	double *samples = NULL, reference[outs_len];
+
+	// in order of compile time within each backend, the lambda backend with CSE first as it is also the reference
+	struct autotune_candidate candidates[2 + 2 * AUTOTUNE_LLVM_LEVELS];
+	size_t candidates_len = 0;
+	for (int cse = 1; cse >= 0; --cse) candidates[candidates_len++] = (struct autotune_candidate) {.kernel = {SIM_BACKEND_LAMBDA, sim->kernel.opt_level, cse}};
+#ifdef HAVE_SYMENGINE_LLVM
+	for (int opt_level = 0; opt_level < AUTOTUNE_LLVM_LEVELS; ++opt_level)
+		for (int cse = 1; cse >= 0; --cse) candidates[candidates_len++] = (struct autotune_candidate) {.kernel = {SIM_BACKEND_LLVM, opt_level, cse}};
+#endif
+
+	struct autotune_candidate *reference_candidate = &candidates[0];
+	ASSERT(autotune_compile(reference_candidate, args, exprs));
+	uint64_t fingerprint = autotune_fingerprint(reference_candidate->visitor, args_len, outs_len);
+	double reference_compile_time = reference_candidate->compile_time;
+
+	ASSERT(others_file = open_memstream(&others, &others_len));
+	FILE *cache = sim->autotune_cache ? fopen(sim->autotune_cache, "r") : NULL;
+	if (cache) {
+		bool loaded = autotune_load(cache, fingerprint, candidates, candidates_len, others_file);
+		fclose(cache);
+		ASSERT(loaded);
+	}
+	ASSERT(!fclose(others_file));
+	others_file = NULL;
+	if (!reference_candidate->measured) reference_candidate->compile_time = reference_compile_time;
+
+	// the current state and perturbations of its coordinates
+	ASSERT(samples = malloc(AUTOTUNE_SAMPLES * args_len * sizeof(*samples)));
+	sim_pack_args(sim, samples);
+	for (size_t i = 1; i < AUTOTUNE_SAMPLES; ++i) {
+		double *sample = samples + i * args_len;
+		memcpy(sample, samples, args_len * sizeof(*sample));
+		for (size_t j = sim->internal_coordinates_start; j < args_len; ++j) sample[j] += 0.01 * i * (j & 1 ? -1 : 1);
+	}
+	sim_visitor_call(reference_candidate->visitor, reference, samples);
+
+	if (!reference_candidate->measured) {
+		autotune_time(reference_candidate, samples, args_len, reference, outs_len);
+		changed = true;
+	}
+	for (size_t i = 1; i < candidates_len; ++i) {
+		struct autotune_candidate *candidate = &candidates[i];
+		if (candidate->measured) continue;
+
+		double best = INFINITY, least_compile = 0;
+		for (size_t j = 0; j < candidates_len; ++j) {
+			if (candidates[j].measured) best = fmin(best, autotune_cost(sim, &candidates[j]));
+			// a higher optimisation level of the same backend takes at least as long to compile
+			if (j < i && candidates[j].measured && candidates[j].kernel.backend == candidate->kernel.backend && candidates[j].kernel.cse == candidate->kernel.cse)
+				least_compile = fmax(least_compile, candidates[j].compile_time);
+		}
+		if (least_compile >= best) continue;
+
+		ASSERT(autotune_compile(candidate, args, exprs));
+		autotune_time(candidate, samples, args_len, reference, outs_len);
+		changed = true;
+	}
+
+	struct autotune_candidate *chosen = reference_candidate;
+	for (size_t i = 0; i < candidates_len; ++i)
+		if (candidates[i].measured && autotune_cost(sim, &candidates[i]) < autotune_cost(sim, chosen)) chosen = &candidates[i];
+	if (!chosen->visitor) ASSERT(chosen->visitor = sim_visitor_new(&chosen->kernel, args, exprs));
+
+	if (changed && sim->autotune_cache) ASSERT(autotune_save(sim->autotune_cache, fingerprint, candidates, candidates_len, others, others_len));
+
+	sim->internal_model->dydt_func = chosen->visitor;
+	chosen->visitor = NULL;
+	sim->kernel = chosen->kernel;
+	res = true;
+fail:
+	if (others_file) fclose(others_file);
+	for (size_t i = 0; i < candidates_len; ++i) sim_visitor_free(candidates[i].visitor);
+	free(samples);
+	free(others);
+	return res;
+}
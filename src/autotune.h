@@ -0,0 +1,15 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+#include "sim.h"
+#include <stdbool.h>
+
+// the cache is text, one line per kernel measured for a model:
+// <fingerprint of the model, 16 hex digits> <lambda|llvm> <optimisation level> <CSE, 0 or 1> <compile seconds> <seconds per call, inf if it was wrong>
+// the fingerprint hashes the kernel's outputs at fixed arguments, as the symbol names (and so the printed expressions) differ between runs
+
+// compiles exprs, the time derivative, with each backend, optimisation level and CSE setting, timing the compile and calls at states
+// around the current one, then sets the dydt_func of sim->internal_model to the one taking the least time over sim->autotune_calls calls including
+// what is left of its compile time, and sim->kernel to its settings
+// kernels measured for the model in sim->autotune_cache aren't compiled again unless chosen, and new measurements are added to it
+bool autotune_dydt(struct sim_simulation *sim, const CVecBasic *args, const CVecBasic *exprs);
+#endif
@@ -0,0 +1,471 @@
+#include "basin.h"
+#include "image.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define BASIN_KEY_SCALE 40                 // samples are memoised by their parameters rounded to multiples of 2^-40
+#define BASIN_MEMO_INITIAL 4096            // samples the memo has room for before growing
+#define BASIN_LIVE_INTERVAL 33333333       // nanoseconds between live frames
+#define BASIN_PROGRESS_INTERVAL 250000000  // nanoseconds between progress updates
+#define BASIN_DISPLAY_LEVELS 1000          // counts the flip times are scaled to for the display
+
+struct basin_sample {
+	int64_t x, y;
+	double value;
+	bool used;
+};
+
+// every sample taken, by its rounded parameters, with open addressing and linear probing
+struct basin_memo {
+	pthread_mutex_t lock;
+	struct basin_sample *samples;
+	size_t cap, len;
+};
+
+// square of the finest grid, by its lower corner and side, which is a power of two
+struct basin_cell {
+	size_t x, y, size;
+};
+
+// cells waiting to be sampled, each worker taking the latest from its own (depth first, so the samples it shares stay hot)
+// and stealing the oldest, largest ones from the others once it runs out
+struct basin_deque {
+	pthread_mutex_t lock;
+	struct basin_cell *cells;
+	size_t cap, head, len; // ring buffer
+};
+
+struct basin_context {
+	const struct sim_simulation *sim;
+	const struct basin_spec *spec;
+	volatile sig_atomic_t *cancel;
+	const double *base_args;
+	size_t param_args[2];
+	size_t width, height; // cells of the finest grid
+
+	struct basin_memo memo;
+	float *values; // flip time of each cell of the finest grid, bottom row first, NAN where not yet known
+
+	unsigned threads;
+	struct basin_deque *deques;
+	atomic_size_t pending, computed, lookups;
+	atomic_uint running;
+	atomic_bool failed;
+	size_t loaded;
+
+	// idle workers wait on this until cells are pushed (pushes counting them), pending reaches 0, or it fails or is cancelled
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	size_t pushes;
+
+	char info[256];
+};
+
+struct basin_worker {
+	pthread_t thread;
+	struct basin_context *ctx;
+	unsigned index;
+	double *args;
+	struct sweep_flip_buffers buffers;
+};
+
+static uint64_t basin_hash(int64_t x, int64_t y) {
+	uint64_t h = (uint64_t) x * 0x9e3779b97f4a7c15 ^ (uint64_t) y * 0xc2b2ae3d27d4eb4f;
+	return h ^ h >> 31;
+}
+
+// finds the sample at x, y, or the empty slot for it
+static struct basin_sample *basin_memo_slot(struct basin_sample *samples, size_t cap, int64_t x, int64_t y) {
+	for (size_t i = basin_hash(x, y) & (cap - 1);; i = (i + 1) & (cap - 1))
+		if (!samples[i].used || (samples[i].x == x && samples[i].y == y)) return &samples[i];
+}
+
+static bool basin_memo_get(struct basin_memo *memo, int64_t x, int64_t y, double *value) {
+	pthread_mutex_lock(&memo->lock);
+	struct basin_sample *sample = basin_memo_slot(memo->samples, memo->cap, x, y);
+	bool found = sample->used;
+	if (found) *value = sample->value;
+	pthread_mutex_unlock(&memo->lock);
+	return found;
+}
+
+static bool basin_memo_put(struct basin_memo *memo, int64_t x, int64_t y, double value) {
+	bool res = false;
+	pthread_mutex_lock(&memo->lock);
+	if (2 * (memo->len + 1) > memo->cap) {
+		// at most half full, so probes stay short
+		size_t cap = 2 * memo->cap;
+		struct basin_sample *samples = calloc(cap, sizeof(*samples));
+		ASSERT(samples);
+		for (size_t i = 0; i < memo->cap; ++i)
+			if (memo->samples[i].used) *basin_memo_slot(samples, cap, memo->samples[i].x, memo->samples[i].y) = memo->samples[i];
+		free(memo->samples);
+		memo->samples = samples;
+		memo->cap = cap;
+	}
+	struct basin_sample *sample = basin_memo_slot(memo->samples, memo->cap, x, y);
+	if (!sample->used) ++memo->len; // another thread may have sampled it meanwhile, with the same result
+	*sample = (struct basin_sample) {.x = x, .y = y, .value = value, .used = true};
+	res = true;
+fail:
+	pthread_mutex_unlock(&memo->lock);
+	return res;
+}
+
+static bool basin_deque_push(struct basin_deque *deque, struct basin_cell cell) {
+	bool res = false;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->len == deque->cap) {
+		size_t cap = deque->cap ? 2 * deque->cap : 64;
+		struct basin_cell *cells = malloc(cap * sizeof(*cells));
+		ASSERT(cells);
+		for (size_t i = 0; i < deque->len; ++i) cells[i] = deque->cells[(deque->head + i) % deque->cap];
+		free(deque->cells);
+		deque->cells = cells;
+		deque->cap = cap;
+		deque->head = 0;
+	}
+	deque->cells[(deque->head + deque->len++) % deque->cap] = cell;
+	res = true;
+fail:
+	pthread_mutex_unlock(&deque->lock);
+	return res;
+}
+
+static bool basin_deque_take(struct basin_deque *deque, bool steal, struct basin_cell *cell) {
+	pthread_mutex_lock(&deque->lock);
+	bool found = deque->len > 0;
+	if (found) {
+		if (steal) {
+			*cell = deque->cells[deque->head];
+			deque->head = (deque->head + 1) % deque->cap;
+		} else
+			*cell = deque->cells[(deque->head + deque->len - 1) % deque->cap];
+		--deque->len;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return found;
+}
+
+// parameter value at a point of the finest grid along an axis
+static double basin_coordinate(const struct basin_context *ctx, int axis, size_t i) {
+	const struct sweep_parameter *param = &ctx->spec->samples->parameters[axis];
+	return param->min + (param->max - param->min) * i / (axis ? ctx->height : ctx->width);
+}
+
+// wakes the idle workers to look for cells again, or to stop
+static void basin_wake(struct basin_context *ctx) {
+	pthread_mutex_lock(&ctx->idle_lock);
+	++ctx->pushes;
+	pthread_cond_broadcast(&ctx->idle_cond);
+	pthread_mutex_unlock(&ctx->idle_lock);
+}
+
+static bool basin_sample(struct basin_worker *worker, size_t i, size_t j, double *value) {
+	struct basin_context *ctx = worker->ctx;
+	const struct sim_simulation *sim = ctx->sim;
+	double x = basin_coordinate(ctx, 0, i), y = basin_coordinate(ctx, 1, j);
+	int64_t key_x = llround(ldexp(x, BASIN_KEY_SCALE)), key_y = llround(ldexp(y, BASIN_KEY_SCALE));
+	atomic_fetch_add_explicit(&ctx->lookups, 1, memory_order_relaxed);
+	if (basin_memo_get(&ctx->memo, key_x, key_y, value)) return true;
+
+	memcpy(worker->args, ctx->base_args, sim->internal_args_len * sizeof(*worker->args));
+	worker->args[ctx->param_args[0]] = x;
+	worker->args[ctx->param_args[1]] = y;
+	// it only needs the flip time, so stops once it flips, and never flipping counts as the whole time span
+	const struct sweep_spec *samples = ctx->spec->samples;
+	if (!sweep_flip_time(sim, worker->args, &worker->buffers, SIM_PRECISION_DOUBLE, samples->steps, samples->time_span, true, value)) return false;
+	if (isnan(*value)) *value = samples->time_span;
+	atomic_fetch_add_explicit(&ctx->computed, 1, memory_order_relaxed);
+	return basin_memo_put(&ctx->memo, key_x, key_y, *value);
+}
+
+// samples the corners of the cell, then either splits it or fills it in by interpolating them
+static bool basin_cell(struct basin_worker *worker, struct basin_cell cell) {
+	struct basin_context *ctx = worker->ctx;
+	const struct basin_spec *spec = ctx->spec;
+	double corners[4]; // (x, y), (x + size, y), (x, y + size), (x + size, y + size)
+	for (int k = 0; k < 4; ++k)
+		if (!basin_sample(worker, cell.x + (k & 1) * cell.size, cell.y + (k >> 1) * cell.size, &corners[k])) return false;
+
+	double low = fmin(fmin(corners[0], corners[1]), fmin(corners[2], corners[3]));
+	double high = fmax(fmax(corners[0], corners[1]), fmax(corners[2], corners[3]));
+	bool within_budget = !spec->budget || atomic_load_explicit(&ctx->computed, memory_order_relaxed) < spec->budget;
+	if (cell.size > 1 && high - low > spec->threshold && within_budget && !*ctx->cancel) {
+		size_t half = cell.size / 2;
+		atomic_fetch_add(&ctx->pending, 4);
+		for (int k = 0; k < 4; ++k)
+			if (!basin_deque_push(&ctx->deques[worker->index], (struct basin_cell) {cell.x + (k & 1) * half, cell.y + (k >> 1) * half, half})) return false;
+		basin_wake(ctx);
+		return true;
+	}
+
+	for (size_t y = 0; y < cell.size; ++y)
+		for (size_t x = 0; x < cell.size; ++x) {
+			double u = (x + 0.5) / cell.size, v = (y + 0.5) / cell.size;
+			ctx->values[(cell.y + y) * ctx->width + cell.x + x] =
+			        (1 - v) * ((1 - u) * corners[0] + u * corners[1]) + v * ((1 - u) * corners[2] + u * corners[3]);
+		}
+	return true;
+}
+
+static void *basin_worker_func(void *data) {
+	struct basin_worker *worker = data;
+	struct basin_context *ctx = worker->ctx;
+	while (!atomic_load_explicit(&ctx->failed, memory_order_relaxed) && !*ctx->cancel) {
+		// read before looking, so cells pushed after a deque was found empty are never slept through
+		pthread_mutex_lock(&ctx->idle_lock);
+		size_t pushes = ctx->pushes;
+		pthread_mutex_unlock(&ctx->idle_lock);
+
+		struct basin_cell cell;
+		bool found = basin_deque_take(&ctx->deques[worker->index], false, &cell);
+		for (unsigned k = 1; !found && k < ctx->threads; ++k) found = basin_deque_take(&ctx->deques[(worker->index + k) % ctx->threads], true, &cell);
+		if (!found) {
+			// the other workers may still split their cells
+			if (!atomic_load(&ctx->pending)) break;
+			pthread_mutex_lock(&ctx->idle_lock);
+			while (ctx->pushes == pushes && atomic_load(&ctx->pending) && !atomic_load(&ctx->failed) && !*ctx->cancel)
+				pthread_cond_wait(&ctx->idle_cond, &ctx->idle_lock);
+			pthread_mutex_unlock(&ctx->idle_lock);
+			continue;
+		}
+		if (!basin_cell(worker, cell)) {
+			atomic_store(&ctx->failed, true);
+			basin_wake(ctx);
+		}
+		if (atomic_fetch_sub(&ctx->pending, 1) == 1) basin_wake(ctx);
+	}
+	atomic_fetch_sub(&ctx->running, 1);
+	return NULL;
+}
+
+static bool basin_render(struct display_screen screen, void *data) {
+	struct basin_context *ctx = data;
+	double time_span = ctx->spec->samples->time_span;
+	struct poss cell;
+	for (cell.y = 0; cell.y < screen.h; ++cell.y)
+		for (cell.x = 0; cell.x < screen.w; ++cell.x) {
+			// the values are written by the workers meanwhile, so this may show a cell half filled in
+			float value = ctx->values[(ctx->height - 1 - cell.y * ctx->height / screen.h) * ctx->width + cell.x * ctx->width / screen.w];
+			if (isnan(value)) continue;
+			if (screen.mode == DISPLAY_BLOCKS) {
+				DISPLAY_SET_CELL(cell, value < time_span, screen);
+			} else {
+				DISPLAY_SET_CELL_TYPE(cell, BASIN_DISPLAY_LEVELS * (1 - value / time_span), screen, uint32_t);
+			}
+		}
+	snprintf(ctx->info, sizeof(ctx->info), "Basin map %zux%zu: %zu samples computed, %zu loaded, %zu cells pending",
+	         ctx->width, ctx->height, atomic_load(&ctx->computed), ctx->loaded, atomic_load(&ctx->pending));
+	return true;
+}
+
+struct basin_cache_header {
+	char magic[8];
+	uint64_t model; // hash of the integrator, its tolerance and the args other than the two axes
+	double time_span;
+	int32_t steps;
+	char names[2][32];
+};
+
+static uint64_t fnv1a(const void *data, size_t len, uint64_t hash) {
+	for (size_t i = 0; i < len; ++i) hash = (hash ^ ((const unsigned char *) data)[i]) * 0x100000001b3;
+	return hash;
+}
+
+// the values at the two axes are replaced by every sample, so they don't change the model
+static uint64_t basin_model_hash(const struct basin_context *ctx) {
+	const struct sim_simulation *sim = ctx->sim;
+	uint64_t hash = 0xcbf29ce484222325;
+	int32_t integrator = sim->integrator;
+	hash = fnv1a(&integrator, sizeof(integrator), hash);
+	hash = fnv1a(&sim->tolerance, sizeof(sim->tolerance), hash);
+	for (size_t i = 0; i < sim->internal_args_len; ++i)
+		if (i != ctx->param_args[0] && i != ctx->param_args[1]) hash = fnv1a(&ctx->base_args[i], sizeof(ctx->base_args[i]), hash);
+	return hash;
+}
+
+static void basin_cache_header(const struct basin_context *ctx, struct basin_cache_header *header) {
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, BASIN_CACHE_MAGIC, 8);
+	header->model = basin_model_hash(ctx);
+	header->time_span = ctx->spec->samples->time_span;
+	header->steps = ctx->spec->samples->steps;
+	for (int k = 0; k < 2; ++k) memcpy(header->names[k], ctx->spec->samples->parameters[k].name, sizeof(header->names[k]));
+}
+
+// a missing cache is empty, one of other axes or integration is an error rather than being overwritten
+static bool basin_cache_load(struct basin_context *ctx, const char *path) {
+	bool res = false;
+	FILE *file = fopen(path, "rb");
+	if (!file) return true;
+	struct basin_cache_header expected, header;
+	basin_cache_header(ctx, &expected);
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(&header, &expected, sizeof(header))) {
+		fprintf(stderr, "Basin cache %s is of a different model, axes, time span or steps\n", path);
+		goto fail;
+	}
+	struct basin_sample sample;
+	while (fread(&sample.x, sizeof(sample.x), 1, file) == 1) {
+		ASSERT(fread(&sample.y, sizeof(sample.y), 1, file) == 1 && fread(&sample.value, sizeof(sample.value), 1, file) == 1);
+		ASSERT(basin_memo_put(&ctx->memo, sample.x, sample.y, sample.value));
+		++ctx->loaded;
+	}
+	res = !ferror(file);
+fail:
+	fclose(file);
+	return res;
+}
+
+// rewritten whole through a temporary file, so an interrupted run leaves the old cache
+static bool basin_cache_save(struct basin_context *ctx, const char *path) {
+	bool res = false;
+	char *temp_path = malloc(strlen(path) + 5);
+	if (!temp_path) return false;
+	sprintf(temp_path, "%s.tmp", path);
+	FILE *file = fopen(temp_path, "wb");
+	ASSERT(file);
+	struct basin_cache_header header;
+	basin_cache_header(ctx, &header);
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+	for (size_t i = 0; written && i < ctx->memo.cap; ++i) {
+		const struct basin_sample *sample = &ctx->memo.samples[i];
+		if (!sample->used) continue;
+		written = fwrite(&sample->x, sizeof(sample->x), 1, file) == 1 && fwrite(&sample->y, sizeof(sample->y), 1, file) == 1 &&
+		          fwrite(&sample->value, sizeof(sample->value), 1, file) == 1;
+	}
+	if (fclose(file)) written = false;
+	ASSERT(written && !rename(temp_path, path));
+	res = true;
+fail:
+	free(temp_path);
+	return res;
+}
+
+static bool basin_write_image(const struct basin_context *ctx, const char *path) {
+	double time_span = ctx->spec->samples->time_span;
+	struct image image = {.w = ctx->width, .h = ctx->height, .rgb = malloc(ctx->width * ctx->height * 3)};
+	if (!image.rgb) return false;
+	for (size_t y = 0; y < ctx->height; ++y)
+		for (size_t x = 0; x < ctx->width; ++x) {
+			float value = ctx->values[(ctx->height - 1 - y) * ctx->width + x];
+			memset(image.rgb + (y * ctx->width + x) * 3, isnan(value) ? 0 : (int) (255 * (1 - value / time_span) + 0.5), 3);
+		}
+	bool res = image_write(&image, path);
+	free(image.rgb);
+	return res;
+}
+
+bool basin_run(const struct sim_simulation *sim, const struct basin_spec *spec, struct display_data *display, volatile sig_atomic_t *cancel) {
+	bool res = false, memo_lock = false, idle_lock = false, idle_cond = false;
+	const struct sweep_spec *samples = spec->samples;
+	struct basin_context ctx = {.sim = sim, .spec = spec, .cancel = cancel};
+	struct basin_worker *workers = NULL;
+	double *base_args = NULL;
+	unsigned threads = samples->threads ? samples->threads : 1, started = 0, deques = 0;
+	size_t state_len = SIM_STATE_LEN(sim);
+
+	if (samples->steps < 1 || samples->time_span <= 0 || !sim->internal_model) return false;
+	if (samples->parameters_len != 2 || samples->parameters[0].count < 2 || samples->parameters[1].count < 2) {
+		fprintf(stderr, "Basin maps need two sweep parameters, with at least 2 points each\n");
+		return false;
+	}
+	if (spec->max_depth < 0 || spec->max_depth > 16) return false;
+	size_t coarse = (size_t) 1 << spec->max_depth;
+	ctx.width = (samples->parameters[0].count - 1) * coarse;
+	ctx.height = (samples->parameters[1].count - 1) * coarse;
+
+	if (!sweep_resolve_parameters(sim, samples->parameters, 2, ctx.param_args)) {
+		fprintf(stderr, "Basin map parameter does not exist in the simulation\n");
+		return false;
+	}
+	ASSERT(ctx.base_args = base_args = calloc(sim->internal_args_len, sizeof(*base_args)));
+	sim_pack_args(sim, base_args);
+
+	ASSERT(ctx.values = malloc(ctx.width * ctx.height * sizeof(*ctx.values)));
+	for (size_t i = 0; i < ctx.width * ctx.height; ++i) ctx.values[i] = NAN;
+	ASSERT(ctx.memo.samples = calloc(BASIN_MEMO_INITIAL, sizeof(*ctx.memo.samples)));
+	ctx.memo.cap = BASIN_MEMO_INITIAL;
+	ASSERT(!pthread_mutex_init(&ctx.memo.lock, NULL));
+	memo_lock = true;
+	if (spec->cache) ASSERT(basin_cache_load(&ctx, spec->cache));
+
+	ASSERT(!pthread_mutex_init(&ctx.idle_lock, NULL));
+	idle_lock = true;
+	ASSERT(!pthread_cond_init(&ctx.idle_cond, NULL));
+	idle_cond = true;
+	ctx.threads = threads;
+	ASSERT(ctx.deques = calloc(threads, sizeof(*ctx.deques)));
+	for (; deques < threads; ++deques) ASSERT(!pthread_mutex_init(&ctx.deques[deques].lock, NULL));
+	ASSERT(workers = calloc(threads, sizeof(*workers)));
+	for (unsigned i = 0; i < threads; ++i) {
+		workers[i].ctx = &ctx;
+		workers[i].index = i;
+		ASSERT(workers[i].args = calloc(sim->internal_args_len, sizeof(*workers[i].args)));
+		ASSERT(workers[i].buffers.trajectory = calloc(state_len * (SWEEP_CHUNK_STEPS + 1), sizeof(*workers[i].buffers.trajectory)));
+	}
+
+	// the coarse grid, dealt out to the workers in rows so each starts with neighbouring cells
+	size_t cells = (samples->parameters[0].count - 1) * (samples->parameters[1].count - 1), cell_i = 0;
+	atomic_store(&ctx.pending, cells);
+	for (size_t y = 0; y < ctx.height; y += coarse)
+		for (size_t x = 0; x < ctx.width; x += coarse, ++cell_i)
+			ASSERT(basin_deque_push(&ctx.deques[cell_i * threads / cells], (struct basin_cell) {x, y, coarse}));
+
+	atomic_store(&ctx.running, threads);
+	for (; started < threads; ++started)
+		if (pthread_create(&workers[started].thread, NULL, basin_worker_func, &workers[started])) break;
+	atomic_fetch_sub(&ctx.running, threads - started);
+	if (started == 0) {
+		atomic_store(&ctx.running, 1);
+		basin_worker_func(&workers[0]); // fall back to running on this thread
+	}
+
+	const struct timespec interval = {.tv_nsec = spec->live ? BASIN_LIVE_INTERVAL : BASIN_PROGRESS_INTERVAL};
+	while (atomic_load(&ctx.running)) {
+		if (spec->live) {
+			display->info = ctx.info;
+			if (!display_render(display, basin_render, &ctx)) atomic_store(&ctx.failed, true);
+			display->info = NULL;
+		} else
+			fprintf(stderr, "\rBasin map: %zu samples computed, %zu cells pending", atomic_load(&ctx.computed), atomic_load(&ctx.pending));
+		if (*cancel || atomic_load(&ctx.failed)) basin_wake(&ctx); // the signal handler can't
+		nanosleep(&interval, NULL);
+	}
+	for (unsigned i = 0; i < started; ++i) pthread_join(workers[i].thread, NULL);
+	if (!spec->live) fprintf(stderr, "\n");
+	ASSERT(!atomic_load(&ctx.failed));
+
+	// a uniform grid would sample every corner of the finest one
+	fprintf(stderr, "Basin map %zux%zu: %zu samples computed, %zu loaded from the cache, %zu looked up, a uniform grid needs %zu\n",
+	        ctx.width, ctx.height, atomic_load(&ctx.computed), ctx.loaded, atomic_load(&ctx.lookups), (ctx.width + 1) * (ctx.height + 1));
+	if (spec->output) ASSERT(basin_write_image(&ctx, spec->output));
+	if (spec->cache) ASSERT(basin_cache_save(&ctx, spec->cache));
+
+	res = true;
+fail:
+	if (workers)
+		for (unsigned i = 0; i < threads; ++i) {
+			free(workers[i].args);
+			free(workers[i].buffers.trajectory);
+		}
+	free(workers);
+	for (unsigned i = 0; i < deques; ++i) {
+		pthread_mutex_destroy(&ctx.deques[i].lock);
+		free(ctx.deques[i].cells);
+	}
+	free(ctx.deques);
+	if (idle_cond) pthread_cond_destroy(&ctx.idle_cond);
+	if (idle_lock) pthread_mutex_destroy(&ctx.idle_lock);
+	if (memo_lock) pthread_mutex_destroy(&ctx.memo.lock);
+	free(ctx.memo.samples);
+	free(ctx.values);
+	free(base_args);
+	return res;
+}
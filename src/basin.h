@@ -0,0 +1,31 @@
+#ifndef BASIN_H
+#define BASIN_H
+#include "sim.h"
+#include "sweep.h"
+#include "display.h"
+#include <signal.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define BASIN_CACHE_MAGIC "DPBSN002"
+
+// map of when an angle first flips (leaves [-π, π]) over two parameters, e.g. the initial angles, capped at the time span
+// a grid of count - 1 cells along each axis is sampled at its corners first, then each cell whose corners' flip times differ by
+// more than threshold is split into four, down to max_depth times, so smooth regions (e.g. nothing flipping) stay coarse
+struct basin_spec {
+	// ranges and coarse grid points of the two axes, and steps, time_span and threads per sample
+	const struct sweep_spec *samples;
+	int max_depth;
+	double threshold; // seconds
+	size_t budget;    // samples computed before cells stop being split, 0 for no limit
+
+	const char *output; // image of the finest grid, PNG if it ends in ".png", otherwise PPM, brighter where it flips sooner
+	// samples from earlier runs over the same model and time span, which are reused wherever the new grid meets them,
+	// e.g. after zooming or panning, and which is rewritten with the new samples, NULL to not keep them
+	const char *cache;
+	bool live; // draw the map on the display as it fills in
+};
+
+// cancel stops early (keeping the samples so far in the cache) once it becomes non-zero
+bool basin_run(const struct sim_simulation *sim, const struct basin_spec *spec, struct display_data *display, volatile sig_atomic_t *cancel);
+#endif
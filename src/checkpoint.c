@@ -0,0 +1,262 @@
+#include "checkpoint.h"
+#include "linked_list.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+static uint64_t fnv1a(const unsigned char *data, size_t len) {
+	uint64_t hash = 0xcbf29ce484222325;
+	for (size_t i = 0; i < len; ++i) hash = (hash ^ data[i]) * 0x100000001b3;
+	return hash;
+}
+
+static size_t checkpoint_size(const struct sim_simulation *sim) {
+	size_t size = 8 + 4 * 2 + 4 + 8 * 2 + sim->variables_len * 8 + 4 + sim->events_len * 16 + 8;
+	LL_LOOP(struct sim_body *, body, sim->bodies) size += 4 * 2 + body->variables_len * 8 + body->coordinates_len * 16;
+	return size;
+}
+
+#define PUT(value)                                   \
+	{                                                \
+		__typeof__(value) put_temp = (value);        \
+		memcpy(cursor, &put_temp, sizeof(put_temp)); \
+		cursor += sizeof(put_temp);                  \
+	}
+
+static bool write_all(int fd, const unsigned char *buf, size_t len) {
+	while (len) {
+		ssize_t written = write(fd, buf, len);
+		if (written <= 0) return false;
+		buf += written, len -= written;
+	}
+	return true;
+}
+
+// the serialised checkpoint, to be freed by the caller, or NULL
+static unsigned char *checkpoint_serialise(const struct sim_simulation *sim, size_t *size) {
+	*size = checkpoint_size(sim);
+	unsigned char *buf = malloc(*size), *cursor = buf;
+	if (!buf) return NULL;
+
+	memcpy(cursor, CHECKPOINT_MAGIC, 8), cursor += 8;
+	size_t bodies_len = 0;
+	LL_LOOP(struct sim_body *, body, sim->bodies) ++bodies_len;
+	PUT((uint32_t) sim->variables_len);
+	PUT((uint32_t) bodies_len);
+	LL_LOOP(struct sim_body *, body, sim->bodies) {
+		PUT((uint32_t) body->coordinates_len);
+		PUT((uint32_t) body->variables_len);
+	}
+	PUT((uint32_t) sim->integrator);
+	PUT(sim->time);
+	PUT(sim->internal_step_size);
+	for (size_t i = 0; i < sim->variables_len; ++i) PUT(sim->in_variables[i]);
+	LL_LOOP(struct sim_body *, body, sim->bodies) {
+		for (size_t i = 0; i < body->variables_len; ++i) PUT(body->in_variables[i]);
+		for (size_t i = 0; i < body->coordinates_len; ++i) {
+			PUT(body->coordinates[i].position);
+			PUT(body->coordinates[i].velocity);
+		}
+	}
+	PUT((uint32_t) sim->events_len);
+	LL_LOOP(struct sim_event *, event, sim->events) {
+		PUT((uint64_t) event->count);
+		PUT(event->last_time);
+	}
+	PUT(fnv1a(buf, cursor - buf));
+	return buf;
+}
+
+static bool checkpoint_write(const char *path, const unsigned char *buf, size_t size) {
+	bool res = false;
+	int fd = -1;
+	char *temp_path = malloc(strlen(path) + 5), *dir_path = NULL;
+	ASSERT(temp_path);
+
+	// write to a temporary file, flush it to disk, then rename it over the old checkpoint so it is never left half-written
+	sprintf(temp_path, "%s.tmp", path);
+	ASSERT((fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0);
+	ASSERT(write_all(fd, buf, size));
+	ASSERT(!fsync(fd));
+	ASSERT(!close(fd));
+	fd = -1;
+	ASSERT(!rename(temp_path, path));
+
+	// and flush the rename itself
+	ASSERT(dir_path = strdup(path));
+	char *slash = strrchr(dir_path, '/');
+	if (slash) slash[slash == dir_path] = '\0'; // keep the slash if it is the root directory
+	if ((fd = open(slash ? dir_path : ".", O_RDONLY)) >= 0) fsync(fd);
+
+	res = true;
+fail:
+	if (fd >= 0) close(fd);
+	free(temp_path);
+	free(dir_path);
+	return res;
+}
+
+bool checkpoint_save(const struct sim_simulation *sim, const char *path) {
+	size_t size;
+	unsigned char *buf = checkpoint_serialise(sim, &size);
+	bool res = buf && checkpoint_write(path, buf, size);
+	free(buf);
+	return res;
+}
+
+struct checkpoint_writer {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	const char *path;
+	unsigned char *pending; // the latest snapshot not yet being written, or NULL
+	size_t pending_size;
+	bool stopping, failed;
+};
+
+static void *checkpoint_writer_func(void *data) {
+	struct checkpoint_writer *writer = data;
+	pthread_mutex_lock(&writer->lock);
+	while (1) {
+		while (!writer->pending && !writer->stopping) pthread_cond_wait(&writer->cond, &writer->lock);
+		if (!writer->pending) break;
+		unsigned char *buf = writer->pending;
+		size_t size = writer->pending_size;
+		writer->pending = NULL;
+		pthread_mutex_unlock(&writer->lock);
+
+		bool written = checkpoint_write(writer->path, buf, size);
+		free(buf);
+
+		pthread_mutex_lock(&writer->lock);
+		writer->failed = !written;
+	}
+	pthread_mutex_unlock(&writer->lock);
+	return NULL;
+}
+
+struct checkpoint_writer *checkpoint_writer_new(const char *path) {
+	struct checkpoint_writer *writer = calloc(1, sizeof(*writer));
+	if (!writer) return NULL;
+	writer->path = path;
+	bool lock = false, cond = false;
+	ASSERT(lock = !pthread_mutex_init(&writer->lock, NULL));
+	ASSERT(cond = !pthread_cond_init(&writer->cond, NULL));
+	ASSERT(!pthread_create(&writer->thread, NULL, checkpoint_writer_func, writer));
+	return writer;
+fail:
+	if (cond) pthread_cond_destroy(&writer->cond);
+	if (lock) pthread_mutex_destroy(&writer->lock);
+	free(writer);
+	return NULL;
+}
+
+bool checkpoint_writer_save(struct checkpoint_writer *writer, const struct sim_simulation *sim) {
+	size_t size;
+	unsigned char *buf = checkpoint_serialise(sim, &size);
+	if (!buf) return false;
+	pthread_mutex_lock(&writer->lock);
+	free(writer->pending); // superseded before the writer got to it
+	writer->pending = buf;
+	writer->pending_size = size;
+	pthread_cond_signal(&writer->cond);
+	pthread_mutex_unlock(&writer->lock);
+	return true;
+}
+
+bool checkpoint_writer_failed(struct checkpoint_writer *writer) {
+	pthread_mutex_lock(&writer->lock);
+	bool failed = writer->failed;
+	pthread_mutex_unlock(&writer->lock);
+	return failed;
+}
+
+bool checkpoint_writer_free(struct checkpoint_writer *writer) {
+	if (!writer) return true;
+	pthread_mutex_lock(&writer->lock);
+	writer->stopping = true;
+	pthread_cond_signal(&writer->cond);
+	pthread_mutex_unlock(&writer->lock);
+	pthread_join(writer->thread, NULL);
+
+	bool res = !writer->failed;
+	pthread_cond_destroy(&writer->cond);
+	pthread_mutex_destroy(&writer->lock);
+	free(writer);
+	return res;
+}
+
+#define GET(var)                             \
+	{                                        \
+		memcpy(&(var), cursor, sizeof(var)); \
+		cursor += sizeof(var);               \
+	}
+
+bool checkpoint_restore(struct sim_simulation *sim, const char *path) {
+	bool res = false;
+	size_t size = checkpoint_size(sim);
+	unsigned char *buf = malloc(size + 1), *cursor = buf;
+	FILE *file = NULL;
+	ASSERT(buf);
+
+	// read one extra byte to detect a checkpoint longer than expected
+	ASSERT(file = fopen(path, "rb"));
+	ASSERT(fread(buf, 1, size + 1, file) == size);
+
+	uint64_t hash;
+	memcpy(&hash, buf + size - 8, 8);
+	ASSERT(!memcmp(buf, CHECKPOINT_MAGIC, 8) && hash == fnv1a(buf, size - 8));
+	cursor += 8;
+
+	// check the shape matches
+	uint32_t variables_len, bodies_len, coordinates_len, integrator, events_len;
+	GET(variables_len);
+	GET(bodies_len);
+	ASSERT(variables_len == sim->variables_len);
+	size_t sim_bodies_len = 0;
+	LL_LOOP(struct sim_body *, body, sim->bodies) {
+		ASSERT(sim_bodies_len++ < bodies_len);
+		GET(coordinates_len);
+		GET(variables_len);
+		ASSERT(coordinates_len == body->coordinates_len && variables_len == body->variables_len);
+	}
+	ASSERT(sim_bodies_len == bodies_len);
+
+	GET(integrator);
+	GET(sim->time);
+	GET(sim->internal_step_size);
+	if (integrator != sim->integrator) sim->internal_step_size = 0;
+	for (size_t i = 0; i < sim->variables_len; ++i) GET(sim->in_variables[i]);
+	LL_LOOP(struct sim_body *, body, sim->bodies) {
+		for (size_t i = 0; i < body->variables_len; ++i) GET(body->in_variables[i]);
+		for (size_t i = 0; i < body->coordinates_len; ++i) {
+			GET(body->coordinates[i].position);
+			GET(body->coordinates[i].velocity);
+		}
+	}
+	GET(events_len);
+	ASSERT(events_len == sim->events_len);
+	LL_LOOP(struct sim_event *, event, sim->events) {
+		uint64_t count;
+		GET(count);
+		GET(event->last_time);
+		event->count = count;
+		// sim_step counts into its state too
+		if (sim->internal_state && event->index < sim->internal_model->events_len) {
+			sim->internal_state->event_counts[event->index] = event->count;
+			sim->internal_state->event_times[event->index] = event->last_time;
+		}
+	}
+
+	if (sim->internal_model) sim_update_energy(sim);
+	res = true;
+fail:
+	if (file) fclose(file);
+	free(buf);
+	return res;
+}
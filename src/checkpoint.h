@@ -0,0 +1,30 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+#include "sim.h"
+#include <stdbool.h>
+
+// compact binary snapshot of a compiled simulation's numerical state, to resume a run with the same model
+//
+// all integers and doubles are in native byte order
+// "DPCKPT02", u32 variables_len, u32 bodies_len, then for each body: u32 coordinates_len, u32 variables_len,
+// u32 integrator, f64 time, f64 internal_step_size, then the simulation variables, and for each body its variables
+// followed by its (position, velocity) pairs, then u32 events_len and for each event its u64 count and f64 last_time,
+// and finally a u64 FNV-1a hash of everything before it
+
+#define CHECKPOINT_MAGIC "DPCKPT02"
+
+// writes atomically, by writing a temporary file next to path and renaming it over path
+bool checkpoint_save(const struct sim_simulation *sim, const char *path);
+// restores a checkpoint into sim, which has to have the same shape as when it was saved, and recalculates energies
+bool checkpoint_restore(struct sim_simulation *sim, const char *path);
+
+// saves checkpoints to path on a background thread, so the caller (e.g. a frame) only copies the state, not waiting for the disk
+struct checkpoint_writer;
+struct checkpoint_writer *checkpoint_writer_new(const char *path);
+// snapshots sim to be written, replacing an earlier snapshot still waiting, false if it couldn't be taken
+bool checkpoint_writer_save(struct checkpoint_writer *writer, const struct sim_simulation *sim);
+// whether the last checkpoint written failed, cleared once one is written again
+bool checkpoint_writer_failed(struct checkpoint_writer *writer);
+// writes the snapshot still waiting, then stops the thread, returning whether the last checkpoint was written
+bool checkpoint_writer_free(struct checkpoint_writer *writer);
+#endif
@@ -0,0 +1,77 @@
+#include "columnar.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "columnar files are written in native byte order, which is assumed to be little-endian"
+#endif
+
+#define WRITE(ptr, size) ASSERT(fwrite(ptr, 1, size, writer->file) == (size))
+
+struct columnar_writer *columnar_open(const char *path, size_t columns_len, const char *const *names) {
+	struct columnar_writer *writer = calloc(1, sizeof(*writer));
+	if (!writer) return NULL;
+	writer->columns_len = columns_len;
+
+	ASSERT(writer->file = fopen(path, "wb"));
+
+	WRITE(COLUMNAR_MAGIC, 8);
+	uint32_t columns = columns_len;
+	WRITE(&columns, sizeof(columns));
+	for (size_t i = 0; i < columns_len; ++i) {
+		size_t len = strlen(names[i]);
+		ASSERT(len <= UINT16_MAX);
+		uint16_t len16 = len;
+		WRITE(&len16, sizeof(len16));
+		WRITE(names[i], len);
+	}
+	return writer;
+fail:
+	if (writer->file) fclose(writer->file);
+	free(writer);
+	return NULL;
+}
+
+bool columnar_write_group(struct columnar_writer *writer, size_t rows, const double *const *columns) {
+	if (rows == 0) return true;
+
+	// remember where the row group starts for the footer
+	if (writer->groups_len >= writer->groups_size) {
+		size_t size = writer->groups_size ? writer->groups_size * 2 : 64;
+		uint64_t *offsets = realloc(writer->group_offsets, size * sizeof(*offsets));
+		ASSERT(offsets);
+		writer->group_offsets = offsets;
+		writer->groups_size = size;
+	}
+	long offset = ftell(writer->file);
+	ASSERT(offset >= 0);
+	writer->group_offsets[writer->groups_len++] = offset;
+
+	uint64_t rows64 = rows;
+	WRITE(&rows64, sizeof(rows64));
+	for (size_t i = 0; i < writer->columns_len; ++i)
+		WRITE(columns[i], rows * sizeof(**columns));
+
+	writer->rows += rows;
+	return true;
+fail:
+	return false;
+}
+
+bool columnar_close(struct columnar_writer *writer) {
+	if (!writer) return true;
+	bool res = false;
+
+	WRITE(writer->group_offsets, writer->groups_len * sizeof(*writer->group_offsets));
+	WRITE(&writer->groups_len, sizeof(writer->groups_len));
+	WRITE(&writer->rows, sizeof(writer->rows));
+	WRITE(COLUMNAR_FOOTER_MAGIC, 8);
+
+	res = true;
+fail:
+	if (fclose(writer->file)) res = false;
+	free(writer->group_offsets);
+	free(writer);
+	return res;
+}
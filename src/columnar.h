@@ -0,0 +1,30 @@
+#ifndef COLUMNAR_H
+#define COLUMNAR_H
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// simple columnar file of doubles, written in row groups so it can be streamed without holding all rows in memory
+//
+// all integers and doubles are little-endian
+// header:    "DPCOL001", u32 columns, then for each column: u16 name length, name (not null-terminated)
+// row group: u64 rows, then for each column: rows doubles
+// footer:    u64 offset of each row group, u64 row groups, u64 total rows, "DPCOLEND"
+
+#define COLUMNAR_MAGIC "DPCOL001"
+#define COLUMNAR_FOOTER_MAGIC "DPCOLEND"
+
+struct columnar_writer {
+	FILE *file;
+	size_t columns_len;
+	uint64_t rows, groups_len, groups_size;
+	uint64_t *group_offsets;
+};
+
+struct columnar_writer *columnar_open(const char *path, size_t columns_len, const char *const *names);
+// columns[i] points to rows values of column i
+bool columnar_write_group(struct columnar_writer *writer, size_t rows, const double *const *columns);
+// writes the footer and closes the file, frees writer even if it fails
+bool columnar_close(struct columnar_writer *writer);
+#endif
@@ -3,23 +3,35 @@
 
 #include "sim.h"
 #include "display.h"
+#include "ensemble.h"
 
 typedef uintmax_t nsec_t;
 #define SEC ((nsec_t) 1000000000)
 
 struct timing_info {
 	nsec_t time, sim_time, render_time, frame_time;
-	bool show_lag, lag, first;
+	bool show_lag, lag, first, paused;
 	nsec_t last_lag_time;
+	int steps;          // integration steps of the last frame
+	double utilisation; // of the frame budget by the last frame's steps
+	const char *warning; // shown in the overlay, e.g. when a checkpoint failed, NULL for none
 };
 
 struct display_data init_display(void);
-struct sim_simulation *init_simulation(void);
+// interactive when stepped frame by frame in the terminal, where the first frame shouldn't wait for compiling,
+// otherwise headless runs want the fastest kernels from the start
+struct sim_simulation *init_simulation(bool interactive);
 void free_simulation(struct sim_simulation *sim);
 bool render_func(struct display_screen screen, struct sim_simulation *sim);
+// draws every member of the ensemble onto a screen in a density mode, used instead of render_func when running one
+bool render_ensemble_func(struct display_screen screen, struct sim_simulation *sim, struct ensemble *ensemble);
 bool update_display_func(struct sim_simulation *sim, struct display_data *display, const struct timing_info *timing);
 
 extern nsec_t max_fps;
 extern double simulation_speed;
-extern int steps_per_frame;
+extern int steps_per_frame; // of the first frame, and of every frame if frame_budget is 0
+// fraction of each frame's time (from max_fps) the steps may take, their number being chosen between min_steps_per_frame and
+// max_steps_per_frame to fill it, so there are as many steps as the machine has time for
+extern double frame_budget;
+extern int min_steps_per_frame, max_steps_per_frame;
 extern bool frame_skip; // frame skipping is non-deterministic, TODO: check if unsetting this is actually deterministic
@@ -1,4 +1,6 @@
 #include "display.h"
+#include "metrics.h"
+#include "image.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -9,14 +11,69 @@
 #include <unistd.h>
 #include <string.h>
 #include <math.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #define DISPLAY_FD (STDOUT_FILENO)
-#define eprintf(...) \
-	if (dprintf(DISPLAY_FD, __VA_ARGS__) < 0) goto fail
+#define DISPLAY_TILE POSS(8, 4)         // characters per tile of graphics, each sent whole when any of its pixels change
+#define DISPLAY_CELL_PIXELS POSS(8, 16) // assumed size of a character when the terminal doesn't report it
+#define DISPLAY_SIXEL_LEVELS 16         // grey colour registers, rather than the 256 levels of kitty's PNGs
+#define DISPLAY_KITTY_CHUNK 4096        // base64 bytes per escape sequence, the most kitty accepts
+#define eprintf(...) ASSERT(display_append(display, __VA_ARGS__))
+
+// appends to the output buffer, which is only written to the terminal by display_flush
+static bool display_append(struct display_data *display, const char *format, ...) {
+	while (1) {
+		size_t space = display->output_cap - display->output_len;
+		va_list args;
+		va_start(args, format);
+		int len = vsnprintf(display->output + display->output_len, space, format, args);
+		va_end(args);
+		if (len < 0) return false;
+		if ((size_t) len < space) {
+			display->output_len += len;
+			return true;
+		}
+
+		size_t cap = display->output_cap ? display->output_cap : 4096;
+		while (cap <= display->output_len + len) cap *= 2;
+		char *output = realloc(display->output, cap);
+		if (!output) return false;
+		display->output = output;
+		display->output_cap = cap;
+	}
+}
+
+bool display_flush(struct display_data *display) {
+	while (DISPLAY_PENDING(display)) {
+		ssize_t written = write(display->fd, display->output + display->output_pos, display->output_len - display->output_pos);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK; // the terminal is busy, try again on the next frame
+		}
+		display->output_pos += written;
+		METRICS_COUNT(METRICS_TTY_BYTES, written);
+	}
+	display->output_len = display->output_pos = 0;
+	return true;
+}
+
+// waits for everything to be written
+static bool display_drain(struct display_data *display) {
+	if (display->fd != DISPLAY_FD) fcntl(display->fd, F_SETFL, fcntl(display->fd, F_GETFL) & ~O_NONBLOCK);
+	return display_flush(display) && !DISPLAY_PENDING(display);
+}
 
 bool display_enable(struct display_data *display) {
 	if (tcgetattr(DISPLAY_FD, &display->old_termios)) return false;
 
+	// a separate open file description, so stdout and stderr (and the shell sharing them) keep blocking
+	const char *tty = ttyname(DISPLAY_FD);
+	display->fd = tty ? open(tty, O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC) : -1;
+	if (display->fd < 0) display->fd = DISPLAY_FD;
+	display->output_len = display->output_pos = 0;
+
 	if (!display->debug) {
 		struct termios new_termios = display->old_termios;
 		cfmakeraw(&new_termios);     // stty raw
@@ -33,16 +90,20 @@ bool display_enable(struct display_data *display) {
 
 	display->screen.buf = NULL;
 	display->term.buf = NULL;
-	return true;
+	return display_flush(display);
 fail:
 	return false;
 }
 
 bool display_disable(struct display_data *display) {
+	bool res = false;
 	FREE(display->screen.buf);
 	FREE(display->term.buf);
 
+	// finish the frame being written, so the escape codes below aren't interleaved with it
+	if (!display_drain(display)) goto fail;
 	if (!display->debug) {
+		if (display->graphics == DISPLAY_KITTY) eprintf("\x1b_Ga=d,d=A,q=2\x1b\\"); // delete the images
 		eprintf(
 		        "\x1b[H"      // move to start
 		        "\x1b[2J"     // clear
@@ -50,12 +111,17 @@ bool display_disable(struct display_data *display) {
 		        "\x1b[?7h"    // re-enable newline at end of line
 		        "\x1b[?1049l" // restore buffer
 		);
+		if (!display_drain(display)) goto fail;
 
-		if (tcsetattr(DISPLAY_FD, TCSANOW, &display->old_termios)) return false; // restore terminal settings
+		if (tcsetattr(DISPLAY_FD, TCSANOW, &display->old_termios)) goto fail; // restore terminal settings
 	}
-	return true;
+	res = true;
 fail:
-	return false;
+	if (display->fd != DISPLAY_FD) close(display->fd);
+	display->fd = DISPLAY_FD;
+	FREE(display->output);
+	display->output_len = display->output_pos = display->output_cap = 0;
+	return res;
 }
 
 static bool init_screen(struct display_screen *screen, size_t item_size, struct poss size, bool *resize, bool *clear) {
@@ -84,16 +150,229 @@ static bool init_screen(struct display_screen *screen, size_t item_size, struct
 	return true;
 }
 
+// counts are tone-mapped logarithmically up to the largest in the frame
+static double display_tone_scale(const struct display_screen *screen) {
+	if (screen->mode == DISPLAY_BLOCKS) return 0;
+	uint32_t max = 0;
+	const uint32_t *cell_counts = screen->buf;
+	for (size_t i = 0; i < screen->w * screen->h; ++i)
+		if (cell_counts[i] > max) max = cell_counts[i];
+	return max ? 1 / log1p(max) : 0;
+}
+
+static bool display_append_info(struct display_data *display) {
+	eprintf("\x1b[H");
+	if (display->mode == DISPLAY_COLOR) eprintf("\x1b[0m"); // default colours for the text
+	const char *info = display->info;
+	const char *newline;
+	do {
+		newline = strchr(info, '\n');
+		size_t nbyte = newline ? newline - info : strlen(info);
+		eprintf("\x1b[2K");              // clear line
+		eprintf("%.*s", (int) nbyte, info); // write up until first newline
+		eprintf("\x1b[E");               // next line
+		info = newline + 1;
+	} while (newline);
+	return true;
+fail:
+	return false;
+}
+
+// sixel characters of count pixels in a row, each the bits of a column of 6 pixels
+static bool display_append_sixels(struct display_data *display, int bits, size_t count) {
+	if (count > 3) {
+		eprintf("!%zu%c", count, '?' + bits); // repeat introducer
+	} else {
+		for (size_t i = 0; i < count; ++i) eprintf("%c", '?' + bits);
+	}
+	return true;
+fail:
+	return false;
+}
+
+// a sixel image of the grey levels in rect of display->term, which is drawn at the cursor
+static bool display_append_sixel(struct display_data *display, struct rects rect) {
+	const uint8_t *levels = display->term.buf;
+	// 1:1 pixels, leaving unset pixels as they are, and only the raster height of the last band
+	eprintf("\x1bP0;1;0q\"1;1;%zu;%zu", rect.w, rect.h);
+
+	uint32_t defined = 0;
+	for (size_t band = 0; band < rect.h; band += 6) {
+		size_t rows = rect.h - band < 6 ? rect.h - band : 6;
+		uint32_t used = 0;
+		for (size_t y = 0; y < rows; ++y)
+			for (size_t x = 0; x < rect.w; ++x) used |= 1u << levels[(rect.y + band + y) * display->term.w + rect.x + x];
+
+		bool first = true;
+		for (int level = 0; level < DISPLAY_SIXEL_LEVELS; ++level) {
+			if (!(used & 1u << level)) continue;
+			if (!(defined & 1u << level)) {
+				int percent = level * 100 / (DISPLAY_SIXEL_LEVELS - 1);
+				eprintf("#%i;2;%i;%i;%i", level, percent, percent, percent);
+				defined |= 1u << level;
+			}
+			if (!first) eprintf("$"); // back to the start of the band, overlaying the next colour
+			first = false;
+			eprintf("#%i", level);
+
+			// run-length encoded, leaving out the unset pixels at the end
+			int run_bits = 0;
+			size_t run = 0;
+			for (size_t x = 0; x < rect.w; ++x) {
+				int bits = 0;
+				for (size_t y = 0; y < rows; ++y) bits |= (levels[(rect.y + band + y) * display->term.w + rect.x + x] == level) << y;
+				if (bits != run_bits && run) {
+					ASSERT(display_append_sixels(display, run_bits, run));
+					run = 0;
+				}
+				run_bits = bits;
+				++run;
+			}
+			if (run_bits) ASSERT(display_append_sixels(display, run_bits, run));
+		}
+		if (band + 6 < rect.h) eprintf("-"); // next band
+	}
+	eprintf("\x1b\\");
+	return true;
+fail:
+	return false;
+}
+
+// a PNG of the grey levels in rect of display->term, placed at the cursor under any text as image id
+static bool display_append_kitty(struct display_data *display, struct rects rect, size_t id) {
+	static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	bool res = false;
+	const uint8_t *levels = display->term.buf;
+	char *png = NULL;
+	size_t png_len = 0;
+
+	struct image image = {.w = rect.w, .h = rect.h, .rgb = malloc(rect.w * rect.h * 3)};
+	if (!image.rgb) return false;
+	for (size_t y = 0; y < rect.h; ++y)
+		for (size_t x = 0; x < rect.w; ++x) memset(image.rgb + (y * rect.w + x) * 3, levels[(rect.y + y) * display->term.w + rect.x + x], 3);
+	FILE *file = open_memstream(&png, &png_len);
+	ASSERT(file);
+	bool encoded = image_encode_png(&image, file);
+	ASSERT(!fclose(file) && encoded);
+
+	// in chunks, each a whole number of base64 groups, and without moving the cursor or replying
+	for (size_t pos = 0; pos < png_len || pos == 0; pos += DISPLAY_KITTY_CHUNK / 4 * 3) {
+		bool more = png_len - pos > DISPLAY_KITTY_CHUNK / 4 * 3;
+		if (pos == 0) {
+			eprintf("\x1b_Ga=T,f=100,i=%zu,p=1,C=1,z=-1,q=2,m=%i;", id, more);
+		} else {
+			eprintf("\x1b_Gm=%i;", more);
+		}
+		size_t end = more ? pos + DISPLAY_KITTY_CHUNK / 4 * 3 : png_len;
+		for (size_t i = pos; i < end; i += 3) {
+			uint32_t group = (uint8_t) png[i] << 16 | (i + 1 < end ? (uint8_t) png[i + 1] << 8 : 0) | (i + 2 < end ? (uint8_t) png[i + 2] : 0);
+			eprintf("%c%c%c%c", base64[group >> 18], base64[group >> 12 & 63],
+			        i + 1 < end ? base64[group >> 6 & 63] : '=', i + 2 < end ? base64[group & 63] : '=');
+		}
+		eprintf("\x1b\\");
+	}
+	res = true;
+fail:
+	free(image.rgb);
+	free(png);
+	return res;
+}
+
+// the screen at the terminal's pixel resolution, sending only the tiles whose grey levels changed
+static bool display_render_graphics(struct display_data *display, struct winsize ioctl_term_size,
+                                    bool (*render_func)(struct display_screen screen, void *render_data), void *render_data) {
+	bool sixel = display->graphics == DISPLAY_SIXEL;
+	struct poss term_size = POSS(ioctl_term_size.ws_col, ioctl_term_size.ws_row);
+	// sixel images move the cursor below them, so leave the last line for it rather than scrolling
+	if (sixel && term_size.y > 1) --term_size.y;
+	struct poss cell = ioctl_term_size.ws_xpixel && ioctl_term_size.ws_ypixel && ioctl_term_size.ws_col && ioctl_term_size.ws_row
+	                           ? POSS(ioctl_term_size.ws_xpixel / ioctl_term_size.ws_col, ioctl_term_size.ws_ypixel / ioctl_term_size.ws_row)
+	                           : DISPLAY_CELL_PIXELS;
+	struct poss size = poss_mul(term_size, cell);
+
+	// display->term holds the grey level of every pixel sent
+	bool resize = false, clear = false;
+	if (!init_screen(&display->term, 1, size, &resize, NULL)) return false;
+	display->screen.mode = display->mode;
+	display->screen.graphics = display->graphics;
+	if (!init_screen(&display->screen, display->mode == DISPLAY_BLOCKS ? 1 : sizeof(uint32_t), size, &resize, &clear)) return false;
+	if (clear) memset(display->screen.buf, 0x00, display->screen.buf_size);
+
+	if (!render_func(display->screen, render_data)) return false;
+	double tone_scale = display_tone_scale(&display->screen);
+	int max_level = sixel ? DISPLAY_SIXEL_LEVELS - 1 : 255;
+
+	if (resize) {
+		eprintf("\x1b[2J");
+		if (!sixel) eprintf("\x1b_Ga=d,d=A,q=2\x1b\\"); // delete the images of the old tiles
+	}
+
+	// the info text is written over sixel images, so the tiles under it are sent every frame to restore what it cleared
+	size_t info_lines = 0;
+	if (display->info && sixel)
+		for (const char *c = display->info; c; c = strchr(c, '\n')) ++info_lines, ++c;
+
+	struct poss tile_pixels = poss_mul(DISPLAY_TILE, cell), tile;
+	size_t tiles_x = (size.x + tile_pixels.x - 1) / tile_pixels.x;
+	for (tile.y = 0; tile.y * tile_pixels.y < size.y; ++tile.y)
+		for (tile.x = 0; tile.x * tile_pixels.x < size.x; ++tile.x) {
+			struct rects rect = RECTS(tile.x * tile_pixels.x, tile.y * tile_pixels.y, tile_pixels.x, tile_pixels.y);
+			if (rect.x + rect.w > size.x) rect.w = size.x - rect.x;
+			if (rect.y + rect.h > size.y) rect.h = size.y - rect.y;
+
+			bool changed = resize || tile.y * DISPLAY_TILE.y < info_lines;
+			uint8_t *levels = display->term.buf;
+			for (size_t y = rect.y; y < rect.y + rect.h; ++y)
+				for (size_t x = rect.x; x < rect.x + rect.w; ++x) {
+					size_t i = y * size.x + x;
+					uint8_t level;
+					if (display->mode == DISPLAY_BLOCKS) {
+						level = ((char *) display->screen.buf)[i] ? max_level : 0;
+					} else {
+						uint32_t count = ((uint32_t *) display->screen.buf)[i];
+						level = count ? ceil(max_level * fmin(1, log1p(count) * tone_scale)) : 0;
+					}
+					if (levels[i] != level) {
+						levels[i] = level;
+						changed = true;
+					}
+				}
+			if (!changed) continue;
+
+			eprintf("\x1b[%zu;%zuH", tile.y * DISPLAY_TILE.y + 1, tile.x * DISPLAY_TILE.x + 1);
+			if (sixel) {
+				ASSERT(display_append_sixel(display, rect));
+			} else {
+				ASSERT(display_append_kitty(display, rect, tile.y * tiles_x + tile.x + 1));
+			}
+		}
+
+	if (display->info) ASSERT(display_append_info(display));
+	return display_flush(display);
+fail:
+	return false;
+}
+
 bool display_render(struct display_data *display, bool (*render_func)(struct display_screen screen, void *render_data), void *render_data) {
 	bool res = false;
 
+	if (!display_flush(display)) return false;
+	if (DISPLAY_PENDING(display)) {
+		// the terminal hasn't taken the previous frame yet, so drop this one rather than queueing stale frames
+		METRICS_COUNT(METRICS_FRAMES_COALESCED, 1);
+		return true;
+	}
+
 	eprintf("\x1b[H"); // move to start
 
 	struct winsize ioctl_term_size;
 	if (ioctl(DISPLAY_FD, TIOCGWINSZ, &ioctl_term_size)) return false; // get terminal size
+	if (display->graphics != DISPLAY_TEXT) return display_render_graphics(display, ioctl_term_size, render_func, render_data);
 	struct poss term_size = POSS(ioctl_term_size.ws_col, ioctl_term_size.ws_row);
 
-	const static struct poss block_size = {2, 2}; // adjust code for producing block character if changing this
+	// adjust code for producing block character if changing this
+	const struct poss block_size = display->mode == DISPLAY_COLOR ? POSS(1, 2) : POSS(2, 2);
+	bool counts = display->mode != DISPLAY_BLOCKS;
 
 	// initialise terminal screen
 	bool resize = false, clear = false;
@@ -101,53 +380,77 @@ bool display_render(struct display_data *display, bool (*render_func)(struct dis
 
 	// initialise screen on which cells are drawn
 	display->screen.size = poss_mul(term_size, block_size);
-	if (!init_screen(&display->screen, 1, display->screen.size, &resize, &clear)) goto fail;
+	display->screen.mode = display->mode;
+	display->screen.graphics = DISPLAY_TEXT;
+	if (!init_screen(&display->screen, counts ? sizeof(uint32_t) : 1, display->screen.size, &resize, &clear)) goto fail;
 	if (clear) memset(display->screen.buf, 0x00, display->screen.buf_size);
 
 	if (!render_func(display->screen, render_data)) goto fail;
 
+	double tone_scale = display_tone_scale(&display->screen);
+
 	if (resize) eprintf("\x1b[2J"); // clear on resize
-	if (display->info) {
-		eprintf("\x1b[H");
-		const char *info = display->info;
-		const char *newline;
-		do {
-			newline = strchr(info, '\n');
-			size_t nbyte = newline ? newline - info : strlen(info);
-			eprintf("\x1b[2K");                                     // clear line
-			if (nbyte != write(DISPLAY_FD, info, nbyte)) goto fail; // write up until first newline
-			eprintf("\x1b[E");                                      // next line
-			info = newline + 1;
-		} while (newline);
-	}
+	if (display->info) ASSERT(display_append_info(display));
 
 	struct poss cursor = POSS(-1, 0), term_cell;
 	for (term_cell.x = 0; term_cell.x < display->term.w; ++term_cell.x)
 		for (term_cell.y = 0; term_cell.y < display->term.h; ++term_cell.y) {
-			unsigned char term_char = 0;
+			int term_char = 0;
 			struct poss rel_block, screen_cell = poss_mul(term_cell, block_size);
-			for (rel_block.y = 0; rel_block.y < block_size.y; ++rel_block.y)
-				for (rel_block.x = 0; rel_block.x < block_size.x; ++rel_block.x) {
-					struct poss block = poss_add(screen_cell, rel_block);
-					if (!DISPLAY_GET_CELL(block, display->screen)) continue;
-					term_char |= 1 << (rel_block.y * block_size.x + rel_block.x); // set corresponding bit for the block character
+			if (display->mode == DISPLAY_BLOCKS) {
+				for (rel_block.y = 0; rel_block.y < block_size.y; ++rel_block.y)
+					for (rel_block.x = 0; rel_block.x < block_size.x; ++rel_block.x) {
+						struct poss block = poss_add(screen_cell, rel_block);
+						if (!DISPLAY_GET_CELL(block, display->screen)) continue;
+						term_char |= 1 << (rel_block.y * block_size.x + rel_block.x); // set corresponding bit for the block character
+					}
+			} else if (display->mode == DISPLAY_SHADES) {
+				uint32_t count = 0;
+				for (rel_block.y = 0; rel_block.y < block_size.y; ++rel_block.y)
+					for (rel_block.x = 0; rel_block.x < block_size.x; ++rel_block.x)
+						count += DISPLAY_GET_CELL_TYPE(poss_add(screen_cell, rel_block), display->screen, uint32_t);
+				term_char = ceil(4 * fmin(1, log1p(count) * tone_scale)); // the sum may exceed the largest single cell
+			} else {
+				// grey levels of the top and bottom half, 0 leaving the background
+				for (rel_block.y = 0; rel_block.y < block_size.y; ++rel_block.y) {
+					uint32_t count = DISPLAY_GET_CELL_TYPE(poss_add(screen_cell, rel_block), display->screen, uint32_t);
+					term_char = term_char << 5 | (int) ceil(24 * log1p(count) * tone_scale);
 				}
+			}
+
 			if (!resize && DISPLAY_GET_CELL_TYPE(term_cell, display->term, int) != term_char) {
 				DISPLAY_SET_CELL_TYPE(term_cell, term_char, display->term, int);
 
-				static const char *chars[] = {" ", "▘", "▝", "▀", "▖", "▌", "▞", "▛", "▗", "▚", "▐", "▜", "▄", "▙", "▟", "█"};
-				const char *c = chars[term_char];
 				if (!poss_eq(term_cell, cursor)) {
-					eprintf("\x1b[%zu;%zuH%s", term_cell.y + 1, term_cell.x + 1, c);
+					eprintf("\x1b[%zu;%zuH", term_cell.y + 1, term_cell.x + 1);
 					cursor = term_cell;
-				} else
-					eprintf("%s", c);
+				}
+				if (display->mode == DISPLAY_BLOCKS) {
+					static const char *chars[] = {" ", "▘", "▝", "▀", "▖", "▌", "▞", "▛", "▗", "▚", "▐", "▜", "▄", "▙", "▟", "█"};
+					eprintf("%s", chars[term_char]);
+				} else if (display->mode == DISPLAY_SHADES) {
+					static const char *chars[] = {" ", "░", "▒", "▓", "█"};
+					eprintf("%s", chars[term_char]);
+				} else {
+					int top = term_char >> 5, bottom = term_char & 31;
+					// greyscale ramp of 24 colours from 232
+					if (top) {
+						eprintf("\x1b[38;5;%im", 231 + top);
+					} else {
+						eprintf("\x1b[39m");
+					}
+					if (bottom) {
+						eprintf("\x1b[48;5;%im▀", 231 + bottom);
+					} else {
+						eprintf("\x1b[49m▀");
+					}
+				}
 				++cursor.x;
 			}
 		}
+	if (display->mode == DISPLAY_COLOR) eprintf("\x1b[0m");
 
-	res = true;
+	res = display_flush(display);
 fail:
-	fsync(DISPLAY_FD);
 	return res;
 }
@@ -4,6 +4,20 @@
 #include "util.h"
 #include <stdbool.h>
 #include <termios.h>
+enum display_mode {
+	DISPLAY_BLOCKS,   // cells are set or not, drawn as quadrant block characters, 2x2 cells per character
+	DISPLAY_SHADES,   // cells are uint32_t counts, tone-mapped to shaded block characters, 2x2 cells per character
+	DISPLAY_COLOR,    // cells are uint32_t counts, tone-mapped to 256-colour half blocks, 1x2 cells per character
+	DISPLAY_COVERAGE, // cells are float coverage of anti-aliased lines, for rendering images offline rather than to the terminal
+};
+
+// how the screen reaches the terminal
+enum display_graphics {
+	DISPLAY_TEXT,  // as characters, each changed one addressed with the cursor
+	DISPLAY_SIXEL, // as a bitmap at the terminal's pixel resolution, in sixel images of the changed tiles
+	DISPLAY_KITTY, // the same, in PNG images of the changed tiles sent with the kitty graphics protocol
+};
+
 struct display_screen {
 	union {
 		struct poss size;
@@ -13,15 +27,26 @@ struct display_screen {
 	};
 	size_t buf_size;
 	void *buf, *buf_damage;
+	enum display_mode mode;
+	enum display_graphics graphics; // cells are square pixels unless DISPLAY_TEXT
 };
 
 struct display_data {
 	const char *info;
 	bool debug;
+	enum display_mode mode;
+	enum display_graphics graphics;
 	struct termios old_termios;
 	struct display_screen screen, term;
+
+	int fd; // the terminal opened again without blocking, or stdout if it isn't one
+	// output of the latest frame, written from output_pos to output_len as the terminal accepts it
+	char *output;
+	size_t output_len, output_pos, output_cap;
 };
 
+#define DISPLAY_PENDING(display) ((display)->output_pos < (display)->output_len)
+
 #define DISPLAY_INDEX(pos, screen) ((size_t) (pos.y) * (size_t) (screen.w) + (size_t) (pos.x))
 
 #define DISPLAY_CELL_IN_BOUNDS(pos, screen) ((pos).x >= 0 && (pos).y >= 0 && (pos).x < (screen).w && (pos).y < (screen).h)
@@ -36,5 +61,8 @@ struct display_data {
 
 bool display_enable(struct display_data *display);
 bool display_disable(struct display_data *display);
+// writes as much pending output as the terminal accepts without blocking, false on error
+bool display_flush(struct display_data *display);
+// skips the frame if the previous one is still being written, so only the latest state is ever sent
 bool display_render(struct display_data *display, bool (*render)(struct display_screen screen, void *render_data), void *render_data);
 #endif
@@ -0,0 +1,185 @@
+#include "ensemble.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// threads started with the ensemble, each waiting for the next task, so stepping and drawing every frame doesn't start any
+struct ensemble_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	pthread_t *threads;
+	unsigned started;
+	size_t generation; // of the current task, advanced for each
+	unsigned remaining; // workers still running the current task
+	bool stopping;
+	ensemble_task task;
+	void *data;
+};
+
+struct ensemble_worker {
+	struct ensemble *ensemble;
+	unsigned index;
+};
+
+static void *ensemble_worker_func(void *data) {
+	struct ensemble_worker *worker = data;
+	struct ensemble *ensemble = worker->ensemble;
+	struct ensemble_pool *pool = ensemble->pool;
+	unsigned index = worker->index;
+	free(worker);
+
+	// no task can be posted before the pool has started, so it waits for the first one from generation 0
+	pthread_mutex_lock(&pool->lock);
+	for (size_t generation = 0;; generation = pool->generation) {
+		while (pool->generation == generation && !pool->stopping) pthread_cond_wait(&pool->work, &pool->lock);
+		if (pool->stopping) break;
+		ensemble_task task = pool->task;
+		void *task_data = pool->data;
+		pthread_mutex_unlock(&pool->lock);
+		task(task_data, index, ensemble->threads);
+		pthread_mutex_lock(&pool->lock);
+		if (!--pool->remaining) pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+void ensemble_parallel(struct ensemble *ensemble, ensemble_task task, void *data) {
+	struct ensemble_pool *pool = ensemble->pool;
+	pthread_mutex_lock(&pool->lock);
+	pool->task = task;
+	pool->data = data;
+	pool->remaining = pool->started;
+	++pool->generation;
+	pthread_mutex_unlock(&pool->lock);
+	pthread_cond_broadcast(&pool->work);
+
+	// the first index runs on this thread, as do those of any workers that couldn't be started
+	task(data, 0, ensemble->threads);
+	for (unsigned i = 1 + pool->started; i < ensemble->threads; ++i) task(data, i, ensemble->threads);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->remaining) pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static bool ensemble_pool_start(struct ensemble *ensemble) {
+	struct ensemble_pool *pool = calloc(1, sizeof(*pool));
+	if (!pool) return false;
+	bool lock = false, work = false, done = false;
+	ASSERT(lock = !pthread_mutex_init(&pool->lock, NULL));
+	ASSERT(work = !pthread_cond_init(&pool->work, NULL));
+	ASSERT(done = !pthread_cond_init(&pool->done, NULL));
+	ASSERT(pool->threads = calloc(ensemble->threads, sizeof(*pool->threads)));
+	ensemble->pool = pool;
+
+	// workers that can't be started leave their indices to the calling thread
+	for (unsigned i = 1; i < ensemble->threads; ++i) {
+		struct ensemble_worker *worker = malloc(sizeof(*worker));
+		if (!worker) break;
+		*worker = (struct ensemble_worker) {.ensemble = ensemble, .index = i};
+		if (pthread_create(&pool->threads[pool->started], NULL, ensemble_worker_func, worker)) {
+			free(worker);
+			break;
+		}
+		++pool->started;
+	}
+	return true;
+fail:
+	if (done) pthread_cond_destroy(&pool->done);
+	if (work) pthread_cond_destroy(&pool->work);
+	if (lock) pthread_mutex_destroy(&pool->lock);
+	free(pool);
+	return false;
+}
+
+static void ensemble_pool_stop(struct ensemble_pool *pool) {
+	if (!pool) return;
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (unsigned i = 0; i < pool->started; ++i) pthread_join(pool->threads[i], NULL);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+struct ensemble *ensemble_new(const struct sim_simulation *sim, size_t members, double spread, uint64_t seed, unsigned threads) {
+	struct ensemble *ensemble = calloc(1, sizeof(*ensemble));
+	if (!ensemble) return NULL;
+	ensemble->sim = sim;
+	ensemble->members = members;
+	ensemble->threads = threads ? threads : 1;
+	ASSERT(members > 0);
+	ASSERT(ensemble->args = calloc(members * sim->internal_args_len, sizeof(*ensemble->args)));
+	ASSERT(ensemble->initial = calloc(members * sim->internal_args_len, sizeof(*ensemble->initial)));
+	ASSERT(ensemble->outputs = calloc(members * SIM_ENERGY_LEN(sim), sizeof(*ensemble->outputs)));
+	ASSERT(ensemble->step_sizes = calloc(members, sizeof(*ensemble->step_sizes)));
+	ASSERT(ensemble_pool_start(ensemble));
+
+	uint64_t state = seed;
+	for (size_t i = 0; i < members; ++i) {
+		double *args = ensemble->initial + i * sim->internal_args_len;
+		sim_pack_args(sim, args);
+		if (i == 0) continue;
+		// positions are the even items of the state
+		for (size_t j = sim->internal_coordinates_start; j < sim->internal_args_len; j += 2) args[j] += spread * (2 * random_unit(&state) - 1);
+	}
+	ensemble_reset(ensemble);
+	return ensemble;
+fail:
+	ensemble_free(ensemble);
+	return NULL;
+}
+
+void ensemble_free(struct ensemble *ensemble) {
+	if (!ensemble) return;
+	ensemble_pool_stop(ensemble->pool);
+	free(ensemble->args);
+	free(ensemble->initial);
+	free(ensemble->outputs);
+	free(ensemble->step_sizes);
+	free(ensemble->points);
+	free(ensemble);
+}
+
+void ensemble_reset(struct ensemble *ensemble) {
+	const struct sim_simulation *sim = ensemble->sim;
+	memcpy(ensemble->args, ensemble->initial, sizeof(*ensemble->args) * ensemble->members * sim->internal_args_len);
+	memset(ensemble->step_sizes, 0, sizeof(*ensemble->step_sizes) * ensemble->members);
+	for (size_t i = 0; i < ensemble->members; ++i)
+		sim_energy(sim, ensemble->args + i * sim->internal_args_len, ensemble->outputs + i * SIM_ENERGY_LEN(sim));
+}
+
+struct ensemble_step_task {
+	struct ensemble *ensemble;
+	int steps;
+	double time_span;
+	bool *failed; // by index
+};
+
+// a contiguous range of members, so each thread's args stay together in memory
+static void ensemble_step_func(void *data, unsigned index, unsigned count) {
+	struct ensemble_step_task *task = data;
+	struct ensemble *ensemble = task->ensemble;
+	const struct sim_simulation *sim = ensemble->sim;
+	for (size_t i = ensemble->members * index / count; i < ensemble->members * (index + 1) / count; ++i) {
+		double *args = ensemble->args + i * sim->internal_args_len;
+		if (!sim_integrate(sim, args, task->steps, task->time_span, NULL, &ensemble->step_sizes[i])) task->failed[index] = true;
+		sim_energy(sim, args, ensemble->outputs + i * SIM_ENERGY_LEN(sim));
+	}
+}
+
+bool ensemble_step(struct ensemble *ensemble, int steps, double time_span) {
+	bool failed[ensemble->threads];
+	memset(failed, 0, sizeof(failed));
+	struct ensemble_step_task task = {.ensemble = ensemble, .steps = steps, .time_span = time_span, .failed = failed};
+	ensemble_parallel(ensemble, ensemble_step_func, &task);
+	for (unsigned i = 0; i < ensemble->threads; ++i)
+		if (failed[i]) return false;
+	return true;
+}
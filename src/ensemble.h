@@ -0,0 +1,40 @@
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+#include "sim.h"
+#include "util.h"
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// copies of a simulation started from slightly different states, integrated alongside it to show how they spread apart
+struct ensemble {
+	const struct sim_simulation *sim;
+	size_t members;
+	unsigned threads;
+
+	double *args;       // internal_args_len items per member
+	double *outputs;    // SIM_ENERGY_LEN(sim) items per member, energies followed by observables, updated by ensemble_step
+	double *step_sizes; // per member, for adaptive integrators
+	double *initial;    // perturbed states to reset to, internal_args_len items per member
+
+	// room for the segments the members are drawn with, kept between frames by whoever draws them
+	struct posf *points;
+	size_t points_cap;
+
+	struct ensemble_pool *pool; // threads - 1 workers, started with the ensemble
+};
+
+// one of count (the ensemble's threads) parts of some work, e.g. a range of members or a band of rows
+typedef void (*ensemble_task)(void *data, unsigned index, unsigned count);
+
+// member 0 starts from the current state of sim, the rest with each position perturbed uniformly within ±spread
+// sim must stay compiled and unchanged in shape while the ensemble exists
+struct ensemble *ensemble_new(const struct sim_simulation *sim, size_t members, double spread, uint64_t seed, unsigned threads);
+void ensemble_free(struct ensemble *ensemble);
+// integrates every member like sim_step, split between the threads, and evaluates their outputs
+bool ensemble_step(struct ensemble *ensemble, int steps, double time_span);
+// runs task for every index below the ensemble's threads, on the calling thread and the ensemble's workers, returning once all have
+void ensemble_parallel(struct ensemble *ensemble, ensemble_task task, void *data);
+// returns every member to its initial state
+void ensemble_reset(struct ensemble *ensemble);
+#endif
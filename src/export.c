@@ -0,0 +1,287 @@
+#include "export.h"
+#include "image.h"
+#include "trajectory.h"
+#include "linked_list.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#define EXPORT_QUEUE_PER_THREAD 2          // states waiting for each worker, so producing them overlaps with rendering
+#define EXPORT_PROGRESS_INTERVAL 250000000 // nanoseconds between progress updates
+
+struct export_job {
+	size_t frame;
+	double time;
+	double *args;
+};
+
+// bounded queue of states, from the calling thread to the workers
+struct export_context {
+	const struct sim_simulation *sim;
+	const struct export_spec *spec;
+
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty, not_full;
+	struct export_job *jobs;
+	size_t jobs_len, head, count, written;
+	bool done, failed;
+
+	uint8_t gamma[256]; // coverage to sRGB intensity, so anti-aliased edges look as bright as they are covered
+};
+
+struct export_worker {
+	pthread_t thread;
+	struct export_context *ctx;
+
+	struct sim_simulation *sim; // of the same shape and variables as ctx->sim, only holding the state of each frame
+	double *args;
+	float *coverage;
+	struct image image;
+	char *path;
+	size_t path_size;
+};
+
+// checks that the output pattern has a single conversion, for the frame number as a size_t
+static bool export_check_pattern(const char *pattern) {
+	size_t conversions = 0;
+	for (const char *c = pattern; *c; ++c) {
+		if (*c != '%') continue;
+		if (*++c == '%') continue;
+		c += strspn(c, "-+ #0123456789");
+		if (c[0] != 'z' || c[1] != 'u') return false;
+		++c;
+		++conversions;
+	}
+	return conversions == 1;
+}
+
+// a simulation with the same bodies and variables, which doesn't need compiling to be rendered
+static struct sim_simulation *export_clone_shape(const struct sim_simulation *sim) {
+	struct sim_simulation *clone = sim_new(NULL, sim->variables_len);
+	if (!clone) return NULL;
+	memcpy(clone->in_variables, sim->in_variables, sim->variables_len * sizeof(*sim->in_variables));
+	LL_LOOP(struct sim_body *, body, sim->bodies) {
+		struct sim_body *clone_body = sim_new_body(NULL, clone, body->coordinates_len, body->variables_len, NULL);
+		if (!clone_body) {
+			sim_remove(clone);
+			return NULL;
+		}
+		memcpy(clone_body->in_variables, body->in_variables, body->variables_len * sizeof(*body->in_variables));
+	}
+	return clone;
+}
+
+static bool export_render_frame(struct export_worker *worker, size_t frame, double time) {
+	struct export_context *ctx = worker->ctx;
+	const struct export_spec *spec = ctx->spec;
+	size_t pixels = spec->width * spec->height;
+
+	// the clone isn't compiled, so it doesn't know the layout of args
+	const double *state = worker->args + ctx->sim->internal_coordinates_start;
+	LL_LOOP(struct sim_body *, body, worker->sim->bodies) {
+		for (size_t i = 0; i < body->coordinates_len; ++i) {
+			body->coordinates[i].position = *state++;
+			body->coordinates[i].velocity = *state++;
+		}
+	}
+	worker->sim->time = time;
+
+	memset(worker->coverage, 0, pixels * sizeof(*worker->coverage));
+	struct display_screen screen = {
+	        .size = POSS(spec->width, spec->height),
+	        .buf_size = pixels * sizeof(*worker->coverage),
+	        .buf = worker->coverage,
+	        .mode = DISPLAY_COVERAGE,
+	};
+	if (!spec->render_func(screen, worker->sim)) return false;
+
+	// white on black, overlapping lines saturating
+	uint8_t *rgb = worker->image.rgb;
+	for (size_t i = 0; i < pixels; ++i) {
+		float coverage = worker->coverage[i];
+		uint8_t value = ctx->gamma[coverage < 1 ? (int) (coverage * 255 + 0.5f) : 255];
+		rgb[i * 3] = rgb[i * 3 + 1] = rgb[i * 3 + 2] = value;
+	}
+
+	snprintf(worker->path, worker->path_size, spec->output, frame);
+	return image_write(&worker->image, worker->path);
+}
+
+static void *export_worker_func(void *data) {
+	struct export_worker *worker = data;
+	struct export_context *ctx = worker->ctx;
+	size_t args_len = ctx->sim->internal_args_len;
+
+	while (1) {
+		pthread_mutex_lock(&ctx->lock);
+		while (!ctx->count && !ctx->done && !ctx->failed) pthread_cond_wait(&ctx->not_empty, &ctx->lock);
+		if (!ctx->count || ctx->failed) {
+			pthread_mutex_unlock(&ctx->lock);
+			break;
+		}
+		struct export_job *job = &ctx->jobs[ctx->head];
+		size_t frame = job->frame;
+		double time = job->time;
+		memcpy(worker->args, job->args, args_len * sizeof(*job->args));
+		ctx->head = (ctx->head + 1) % ctx->jobs_len;
+		--ctx->count;
+		pthread_cond_signal(&ctx->not_full);
+		pthread_mutex_unlock(&ctx->lock);
+
+		bool ok = export_render_frame(worker, frame, time);
+
+		pthread_mutex_lock(&ctx->lock);
+		if (ok)
+			++ctx->written;
+		else
+			ctx->failed = true;
+		pthread_cond_broadcast(&ctx->not_full); // wakes the producer to notice a failure
+		pthread_mutex_unlock(&ctx->lock);
+	}
+	return NULL;
+}
+
+// waits for room in the queue and copies the state into it
+static bool export_push(struct export_context *ctx, size_t frame, double time, const double *args) {
+	pthread_mutex_lock(&ctx->lock);
+	while (ctx->count == ctx->jobs_len && !ctx->failed) pthread_cond_wait(&ctx->not_full, &ctx->lock);
+	bool res = !ctx->failed;
+	if (res) {
+		struct export_job *job = &ctx->jobs[(ctx->head + ctx->count) % ctx->jobs_len];
+		job->frame = frame;
+		job->time = time;
+		memcpy(job->args, args, ctx->sim->internal_args_len * sizeof(*args));
+		++ctx->count;
+		pthread_cond_signal(&ctx->not_empty);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return res;
+}
+
+static uint64_t export_now(void) {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t) tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+bool export_run(struct sim_simulation *sim, const struct export_spec *spec, volatile sig_atomic_t *cancel) {
+	bool res = false, lock = false, conds = false;
+	unsigned threads = spec->threads ? spec->threads : 1, started = 0;
+	struct export_context ctx = {.sim = sim, .spec = spec};
+	struct export_worker *workers = NULL;
+	struct trajectory_reader *reader = NULL;
+	double *args = NULL;
+
+	if (!export_check_pattern(spec->output)) {
+		fprintf(stderr, "Output pattern needs a single %%zu for the frame number: %s\n", spec->output);
+		return false;
+	}
+	ASSERT(spec->width > 0 && spec->height > 0 && spec->render_func);
+
+	size_t frames = spec->frames;
+	if (spec->input) {
+		ASSERT(reader = trajectory_reader_open(spec->input));
+		ASSERT(reader->state_len == SIM_STATE_LEN(sim));
+		frames = reader->records;
+	} else
+		ASSERT(spec->time_step > 0 && spec->steps_per_frame > 0);
+
+	for (int i = 0; i < 256; ++i) {
+		double linear = i / 255.0;
+		double srgb = linear <= 0.0031308 ? 12.92 * linear : 1.055 * pow(linear, 1 / 2.4) - 0.055;
+		ctx.gamma[i] = srgb * 255 + 0.5;
+	}
+
+	ASSERT(!pthread_mutex_init(&ctx.lock, NULL));
+	lock = true;
+	ASSERT(!pthread_cond_init(&ctx.not_empty, NULL));
+	if (pthread_cond_init(&ctx.not_full, NULL)) {
+		pthread_cond_destroy(&ctx.not_empty);
+		goto fail;
+	}
+	conds = true;
+
+	ctx.jobs_len = threads * EXPORT_QUEUE_PER_THREAD;
+	ASSERT(ctx.jobs = calloc(ctx.jobs_len, sizeof(*ctx.jobs)));
+	for (size_t i = 0; i < ctx.jobs_len; ++i) ASSERT(ctx.jobs[i].args = calloc(sim->internal_args_len, sizeof(*ctx.jobs[i].args)));
+	ASSERT(args = calloc(sim->internal_args_len, sizeof(*args)));
+
+	// per-thread buffers, allocated once and reused for every frame
+	ASSERT(workers = calloc(threads, sizeof(*workers)));
+	for (unsigned i = 0; i < threads; ++i) {
+		struct export_worker *worker = &workers[i];
+		worker->ctx = &ctx;
+		ASSERT(worker->sim = export_clone_shape(sim));
+		ASSERT(worker->args = calloc(sim->internal_args_len, sizeof(*worker->args)));
+		ASSERT(worker->coverage = calloc(spec->width * spec->height, sizeof(*worker->coverage)));
+		worker->image = (struct image) {.w = spec->width, .h = spec->height};
+		ASSERT(worker->image.rgb = malloc(spec->width * spec->height * 3));
+		worker->path_size = strlen(spec->output) + 32;
+		ASSERT(worker->path = malloc(worker->path_size));
+	}
+
+	for (; started < threads; ++started)
+		if (pthread_create(&workers[started].thread, NULL, export_worker_func, &workers[started])) break;
+	if (started == 0) {
+		fprintf(stderr, "Failed to start export threads\n");
+		goto fail;
+	}
+
+	// this thread produces the states, in order, while the workers render them in any order
+	uint64_t next_progress = 0;
+	sim_pack_args(sim, args);
+	for (size_t frame = 0; frame < frames && !*cancel; ++frame) {
+		double time = sim->time;
+		if (reader) {
+			if (!trajectory_read(reader, frame, &time, args + sim->internal_coordinates_start)) break;
+		} else if (frame > 0) {
+			if (!sim_step(sim, spec->steps_per_frame, spec->time_step)) break;
+			sim_pack_args(sim, args);
+			time = sim->time;
+		}
+		if (!export_push(&ctx, frame, time, args)) break;
+
+		uint64_t now = export_now();
+		if (now >= next_progress) {
+			pthread_mutex_lock(&ctx.lock);
+			fprintf(stderr, "\rExported %zu/%zu frames", ctx.written, frames);
+			pthread_mutex_unlock(&ctx.lock);
+			next_progress = now + EXPORT_PROGRESS_INTERVAL;
+		}
+	}
+
+	pthread_mutex_lock(&ctx.lock);
+	ctx.done = true;
+	pthread_cond_broadcast(&ctx.not_empty);
+	pthread_mutex_unlock(&ctx.lock);
+	for (unsigned i = 0; i < started; ++i) pthread_join(workers[i].thread, NULL);
+	fprintf(stderr, "\rExported %zu/%zu frames\n", ctx.written, frames);
+	ASSERT(!ctx.failed && (ctx.written == frames || *cancel));
+
+	res = true;
+fail:
+	if (workers)
+		for (unsigned i = 0; i < threads; ++i) {
+			if (workers[i].sim) sim_remove(workers[i].sim);
+			free(workers[i].args);
+			free(workers[i].coverage);
+			free(workers[i].image.rgb);
+			free(workers[i].path);
+		}
+	free(workers);
+	if (ctx.jobs)
+		for (size_t i = 0; i < ctx.jobs_len; ++i) free(ctx.jobs[i].args);
+	free(ctx.jobs);
+	free(args);
+	trajectory_reader_close(reader);
+	if (conds) {
+		pthread_cond_destroy(&ctx.not_empty);
+		pthread_cond_destroy(&ctx.not_full);
+	}
+	if (lock) pthread_mutex_destroy(&ctx.lock);
+	return res;
+}
@@ -0,0 +1,28 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+#include "sim.h"
+#include "display.h"
+#include <signal.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+struct export_spec {
+	const char *output; // printf pattern given the frame number, e.g. "frames/%06zu.png", PNG if it ends in ".png", otherwise PPM
+	size_t width, height;
+	unsigned threads; // each rasterises and encodes whole frames, while the calling thread produces the states
+
+	// states are read from every record of this trajectory file (see trajectory.h), or integrated if it is NULL
+	const char *input;
+	// when integrating, frames are time_step of simulated time apart, with steps_per_frame steps each
+	size_t frames;
+	double time_step;
+	int steps_per_frame;
+
+	// called with a screen in DISPLAY_COVERAGE mode, on a simulation holding the frame's state but not compiled,
+	// so it must not depend on the compiled outputs, as when viewing a published simulation
+	bool (*render_func)(struct display_screen screen, struct sim_simulation *sim);
+};
+
+// renders each frame to an image, cancel stops early (keeping the frames written) once it becomes non-zero
+bool export_run(struct sim_simulation *sim, const struct export_spec *spec, volatile sig_atomic_t *cancel);
+#endif
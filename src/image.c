@@ -0,0 +1,201 @@
+#include "image.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WRITE(ptr, size) ASSERT(fwrite(ptr, 1, size, file) == (size))
+
+bool image_write_ppm(const struct image *image, const char *path) {
+	bool res = false;
+	FILE *file = fopen(path, "wb");
+	if (!file) return false;
+	ASSERT(fprintf(file, "P6\n%zu %zu\n255\n", image->w, image->h) > 0);
+	WRITE(image->rgb, image->w * image->h * 3);
+	res = true;
+fail:
+	if (fclose(file)) res = false;
+	return res;
+}
+
+// https://www.w3.org/TR/png/#D-CRCAppendix, bitwise since it only covers the already compressed data
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len) {
+	crc = ~crc;
+	for (size_t i = 0; i < len; ++i) {
+		crc ^= data[i];
+		for (int k = 0; k < 8; ++k) crc = crc >> 1 ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+static void put_u32_be(uint8_t *out, uint32_t value) {
+	out[0] = value >> 24, out[1] = value >> 16, out[2] = value >> 8, out[3] = value;
+}
+
+// deflate (RFC 1951) of a stream of bytes, matching only runs that repeat the pixel before, written out in IDAT chunks
+#define PNG_CHUNK_SIZE 65536
+#define DEFLATE_DISTANCE 3 // one RGB pixel
+#define DEFLATE_MAX_MATCH 258
+
+struct png_deflate {
+	FILE *file;
+	bool failed;
+
+	uint8_t chunk[8 + PNG_CHUNK_SIZE]; // length and type, then the data
+	size_t chunk_len;
+	uint64_t acc;
+	unsigned bits;
+
+	uint8_t history[DEFLATE_DISTANCE]; // latest bytes, as a ring indexed by the position
+	uint64_t position;
+	size_t run; // bytes matching the ones DEFLATE_DISTANCE before them, not yet written
+	uint8_t run_bytes[DEFLATE_MAX_MATCH];
+	uint32_t adler_a, adler_b;
+};
+
+static void png_write_chunk(struct png_deflate *deflate, const char *type, size_t len) {
+	put_u32_be(deflate->chunk, len);
+	memcpy(deflate->chunk + 4, type, 4);
+	uint8_t crc[4];
+	put_u32_be(crc, crc32_update(0, deflate->chunk + 4, len + 4));
+	if (fwrite(deflate->chunk, 1, len + 8, deflate->file) != len + 8 || fwrite(crc, 1, 4, deflate->file) != 4) deflate->failed = true;
+}
+
+static void deflate_put_byte(struct png_deflate *deflate, uint8_t byte) {
+	deflate->chunk[8 + deflate->chunk_len++] = byte;
+	if (deflate->chunk_len < PNG_CHUNK_SIZE) return;
+	png_write_chunk(deflate, "IDAT", deflate->chunk_len);
+	deflate->chunk_len = 0;
+}
+
+// deflate packs bits starting from the least significant
+static void deflate_bits(struct png_deflate *deflate, uint32_t value, unsigned n) {
+	deflate->acc |= (uint64_t) value << deflate->bits;
+	deflate->bits += n;
+	while (deflate->bits >= 8) {
+		deflate_put_byte(deflate, deflate->acc);
+		deflate->acc >>= 8;
+		deflate->bits -= 8;
+	}
+}
+
+// except for Huffman codes, which start from their most significant bit
+static void deflate_code(struct png_deflate *deflate, uint32_t code, unsigned n) {
+	uint32_t reversed = 0;
+	for (unsigned i = 0; i < n; ++i) reversed |= (code >> i & 1) << (n - 1 - i);
+	deflate_bits(deflate, reversed, n);
+}
+
+// fixed Huffman code of a literal/length symbol
+static void deflate_symbol(struct png_deflate *deflate, unsigned symbol) {
+	if (symbol < 144)
+		deflate_code(deflate, 0x30 + symbol, 8);
+	else if (symbol < 256)
+		deflate_code(deflate, 0x190 + symbol - 144, 9);
+	else if (symbol < 280)
+		deflate_code(deflate, symbol - 256, 7);
+	else
+		deflate_code(deflate, 0xc0 + symbol - 280, 8);
+}
+
+static void deflate_match(struct png_deflate *deflate, unsigned length) {
+	static const uint16_t length_base[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+	static const uint8_t length_extra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+	unsigned code = LENGTHOF(length_base) - 1;
+	while (length_base[code] > length) --code;
+	deflate_symbol(deflate, 257 + code);
+	deflate_bits(deflate, length - length_base[code], length_extra[code]);
+	deflate_code(deflate, DEFLATE_DISTANCE - 1, 5); // distance codes 0 to 3 are the distances 1 to 4, without extra bits
+}
+
+static void deflate_flush_run(struct png_deflate *deflate) {
+	if (deflate->run >= 3)
+		deflate_match(deflate, deflate->run);
+	else
+		for (size_t i = 0; i < deflate->run; ++i) deflate_symbol(deflate, deflate->run_bytes[i]);
+	deflate->run = 0;
+}
+
+static void deflate_feed(struct png_deflate *deflate, const uint8_t *data, size_t len) {
+	// Adler-32, reduced every 5552 bytes, the most that can be summed before b overflows
+	for (size_t start = 0; start < len; start += 5552) {
+		size_t end = len - start < 5552 ? len : start + 5552;
+		for (size_t i = start; i < end; ++i) {
+			deflate->adler_a += data[i];
+			deflate->adler_b += deflate->adler_a;
+		}
+		deflate->adler_a %= 65521;
+		deflate->adler_b %= 65521;
+	}
+
+	for (size_t i = 0; i < len; ++i) {
+		uint8_t byte = data[i];
+		uint8_t *previous = &deflate->history[deflate->position++ % DEFLATE_DISTANCE];
+		if (deflate->position > DEFLATE_DISTANCE && *previous == byte) {
+			deflate->run_bytes[deflate->run++] = byte;
+			if (deflate->run == DEFLATE_MAX_MATCH) deflate_flush_run(deflate);
+		} else {
+			deflate_flush_run(deflate);
+			deflate_symbol(deflate, byte);
+		}
+		*previous = byte;
+	}
+}
+
+bool image_encode_png(const struct image *image, FILE *file) {
+	static const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	bool res = false;
+	if (image->w > INT32_MAX || image->h > INT32_MAX) return false;
+	// too large for the stack
+	struct png_deflate *deflate = calloc(1, sizeof(*deflate));
+	ASSERT(deflate);
+	deflate->file = file;
+	deflate->adler_a = 1;
+
+	WRITE(signature, sizeof(signature));
+	uint8_t *header = deflate->chunk + 8;
+	put_u32_be(header, image->w);
+	put_u32_be(header + 4, image->h);
+	header[8] = 8;                            // bit depth
+	header[9] = 2;                            // RGB
+	header[10] = header[11] = header[12] = 0; // deflate, adaptive filtering, no interlacing
+	png_write_chunk(deflate, "IHDR", 13);
+
+	// zlib stream of a single block with the fixed codes, each row prefixed by filter type 0 (none)
+	deflate_put_byte(deflate, 0x78);
+	deflate_put_byte(deflate, 0x01);
+	deflate_bits(deflate, 1, 1); // final block
+	deflate_bits(deflate, 1, 2); // fixed Huffman codes
+	for (size_t y = 0; y < image->h; ++y) {
+		static const uint8_t filter = 0;
+		deflate_feed(deflate, &filter, 1);
+		deflate_feed(deflate, image->rgb + y * image->w * 3, image->w * 3);
+	}
+	deflate_flush_run(deflate);
+	deflate_symbol(deflate, 256); // end of block
+	if (deflate->bits) deflate_bits(deflate, 0, 8 - deflate->bits);
+	uint8_t adler[4];
+	put_u32_be(adler, deflate->adler_b << 16 | deflate->adler_a);
+	for (size_t i = 0; i < 4; ++i) deflate_put_byte(deflate, adler[i]);
+	if (deflate->chunk_len) png_write_chunk(deflate, "IDAT", deflate->chunk_len);
+	png_write_chunk(deflate, "IEND", 0);
+
+	res = !deflate->failed;
+fail:
+	free(deflate);
+	return res;
+}
+
+bool image_write_png(const struct image *image, const char *path) {
+	FILE *file = fopen(path, "wb");
+	if (!file) return false;
+	bool res = image_encode_png(image, file);
+	if (fclose(file)) res = false;
+	return res;
+}
+
+bool image_write(const struct image *image, const char *path) {
+	size_t len = strlen(path);
+	if (len >= 4 && !strcmp(path + len - 4, ".png")) return image_write_png(image, path);
+	return image_write_ppm(image, path);
+}
@@ -0,0 +1,22 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// 8-bit RGB image, rows top to bottom without padding
+struct image {
+	size_t w, h;
+	uint8_t *rgb;
+};
+
+// binary PPM (P6)
+bool image_write_ppm(const struct image *image, const char *path);
+// PNG compressed with fixed Huffman codes and runs of repeated pixels, which suits mostly empty frames without needing zlib
+bool image_write_png(const struct image *image, const char *path);
+// the same, written to an open file, e.g. from open_memstream
+bool image_encode_png(const struct image *image, FILE *file);
+// PNG if path ends in ".png", otherwise PPM
+bool image_write(const struct image *image, const char *path);
+#endif
@@ -0,0 +1,98 @@
+#include "lyapunov.h"
+#include "rk4.h"
+#include "util.h"
+#include "metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+struct tangent_data {
+	const struct sim_simulation *sim;
+	size_t state_len, vectors_len;
+	double *args, *jacobian;
+};
+
+// time derivative of the state followed by the tangent vectors, dv/dt = J(y) v
+static void tangent_dydt(double t, double y[], double out[], void *custom) {
+	struct tangent_data *data = custom;
+	const struct sim_simulation *sim = data->sim;
+	size_t n = data->state_len;
+
+	memcpy(data->args + sim->internal_coordinates_start, y, n * sizeof(*y));
+	sim_dydt(sim, data->args, out);
+	sim_jacobian(sim, data->args, data->jacobian);
+
+	for (size_t v = 0; v < data->vectors_len; ++v) {
+		const double *vec = y + n * (v + 1);
+		double *vec_out = out + n * (v + 1);
+		for (size_t row = 0; row < n; ++row) {
+			const double *jacobian_row = data->jacobian + row * n;
+			double sum = 0;
+			for (size_t col = 0; col < n; ++col) sum += jacobian_row[col] * vec[col];
+			vec_out[row] = sum;
+		}
+	}
+}
+
+// modified Gram-Schmidt, adding the log of the growth of each vector to sums
+static void orthonormalise(double *vectors, size_t vectors_len, size_t n, double *sums) {
+	for (size_t v = 0; v < vectors_len; ++v) {
+		double *vec = vectors + v * n;
+		for (size_t u = 0; u < v; ++u) {
+			const double *prev = vectors + u * n;
+			double dot = 0;
+			for (size_t i = 0; i < n; ++i) dot += vec[i] * prev[i];
+			for (size_t i = 0; i < n; ++i) vec[i] -= dot * prev[i];
+		}
+		double norm = 0;
+		for (size_t i = 0; i < n; ++i) norm += vec[i] * vec[i];
+		norm = sqrt(norm);
+		sums[v] += log(norm);
+		for (size_t i = 0; i < n; ++i) vec[i] /= norm;
+	}
+}
+
+bool lyapunov_spectrum(const struct sim_simulation *sim, double *args, size_t exponents_len, int steps, double time_span, int renormalise_steps, double *exponents) {
+	size_t n = SIM_STATE_LEN(sim);
+	if (exponents_len < 1 || exponents_len > n) return false;
+	if (steps < 1 || time_span <= 0 || renormalise_steps < 1) return false;
+	if (!sim->internal_model || !sim->internal_model->jacobian_func) return false;
+
+	bool res = false;
+	size_t len = n * (exponents_len + 1);
+	double *y = NULL, *trajectory = NULL, *time_out = NULL, *jacobian = NULL, *stage_args = NULL;
+	ASSERT(y = calloc(len, sizeof(*y)));
+	ASSERT(trajectory = calloc(len * (renormalise_steps + 1), sizeof(*trajectory)));
+	ASSERT(time_out = calloc(renormalise_steps + 1, sizeof(*time_out)));
+	ASSERT(jacobian = calloc(n * n, sizeof(*jacobian)));
+	ASSERT(stage_args = calloc(sim->internal_args_len, sizeof(*stage_args)));
+	memcpy(stage_args, args, sim->internal_args_len * sizeof(*stage_args));
+
+	// start with the state and orthonormal tangent vectors along the first axes
+	memcpy(y, args + sim->internal_coordinates_start, n * sizeof(*y));
+	for (size_t v = 0; v < exponents_len; ++v) y[n * (v + 1) + v] = 1;
+	for (size_t v = 0; v < exponents_len; ++v) exponents[v] = 0;
+
+	struct tangent_data data = {.sim = sim, .state_len = n, .vectors_len = exponents_len, .args = stage_args, .jacobian = jacobian};
+	double dt = time_span / steps;
+	for (int step = 0; step < steps; step += renormalise_steps) {
+		int chunk = steps - step < renormalise_steps ? steps - step : renormalise_steps;
+		double tspan[2] = {step * dt, (step + chunk) * dt};
+		rk4(tangent_dydt, tspan, y, chunk, len, time_out, trajectory, &data);
+		METRICS_COUNT(METRICS_RK_STEPS, chunk);
+		memcpy(y, trajectory + len * chunk, len * sizeof(*y));
+		orthonormalise(y + n, exponents_len, n, exponents);
+	}
+
+	for (size_t v = 0; v < exponents_len; ++v) exponents[v] /= time_span;
+	memcpy(args + sim->internal_coordinates_start, y, n * sizeof(*y));
+
+	res = true;
+fail:
+	free(y);
+	free(trajectory);
+	free(time_out);
+	free(jacobian);
+	free(stage_args);
+	return res;
+}
@@ -0,0 +1,12 @@
+#ifndef LYAPUNOV_H
+#define LYAPUNOV_H
+#include "sim.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+// estimates the exponents_len largest Lyapunov exponents of the trajectory starting at the state in args,
+// by integrating the tangent linear system (using the compiled Jacobian) alongside the state
+// the tangent vectors are orthonormalised every renormalise_steps steps (Benettin et al. 1980)
+// sim must have been compiled with compile_jacobian set, args is advanced to the final state
+bool lyapunov_spectrum(const struct sim_simulation *sim, double *args, size_t exponents_len, int steps, double time_span, int renormalise_steps, double *exponents);
+#endif
@@ -8,15 +8,45 @@
 #include <time.h>
 #include <stdint.h>
 #include <math.h>
+#include <getopt.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
 
 #define eprintf(...) fprintf(stderr, __VA_ARGS__)
 
 #include "display.h"
 #include "sim.h"
 #include "util.h"
+#include "linked_list.h"
+#include "sweep.h"
+#include "lyapunov.h"
+#include "parareal.h"
+#include "metrics.h"
+#include "shm.h"
+#include "checkpoint.h"
+#include "poincare.h"
+#include "ensemble.h"
+#include "trajectory.h"
+#include "export.h"
+#include "basin.h"
+#include "pacing.h"
+#include "pipeline.h"
 
 static struct sim_simulation *simulation = NULL;
 static struct display_data display;
+static struct shm_segment *publish_segment = NULL, *view_segment = NULL;
+static const char *checkpoint_path = NULL;
+static struct checkpoint_writer *checkpoint_writer = NULL; // writes the periodic checkpoints off the frame loop
+static const char *autotune_cache = NULL;
+static volatile sig_atomic_t exit_signal = 0; // terminating signal caught while running headless
+static bool paused = false;
+static int step_frames = 0;         // frames to simulate while paused
+static double *initial_args = NULL; // state to reset to
+static double initial_time = 0;
+static struct ensemble *ensemble = NULL; // perturbed copies drawn as a density instead of the simulation
+static struct trajectory_writer *recording = NULL;
 
 #include "config.h"
 
@@ -45,13 +75,35 @@ static bool stop(bool final) {
 	return res;
 }
 
+// compiles the simulation again if asked to, or with --autotune to pick the kernel fastest over about calls evaluations of the time derivative
+static bool recompile_simulation(struct sim_simulation *sim, bool recompile, double calls) {
+	if (autotune_cache) {
+		sim->autotune_calls = calls > 1 ? calls : 1;
+		sim->autotune_cache = autotune_cache;
+	} else if (!recompile)
+		return true;
+	if (!sim_compile(NULL, sim)) return false;
+	if (autotune_cache) {
+		if (sim->kernel.backend == SIM_BACKEND_LLVM)
+			eprintf("Kernel: LLVM -O%i%s\n", sim->kernel.opt_level, sim->kernel.cse ? " with CSE" : "");
+		else
+			eprintf("Kernel: lambda%s\n", sim->kernel.cse ? " with CSE" : "");
+	}
+	return true;
+}
+
 static bool start(bool first) {
 	if (running) return true;
 	running = true;
 
 	bool res = true;
 	if (first) {
-		if (!simulation) ASSERT(simulation = init_simulation(), "Failed to initialise simulation\n");
+		// viewers only need the shape of the published simulation, not a compiled one
+		if (!simulation) {
+			ASSERT(simulation = view_segment ? shm_view_simulation(view_segment) : init_simulation(true), "Failed to initialise simulation\n");
+			// tuned for a minute at 60 frames per second
+			if (!view_segment) ASSERT(recompile_simulation(simulation, false, 4.0 * steps_per_frame * 60 * 60), "Failed to compile simulation\n");
+		}
 	}
 	ASSERT(display_enable(&display), "Failed to initialise display\n");
 
@@ -60,32 +112,90 @@ static bool start(bool first) {
 }
 #undef ASSERT
 
-static void signal_func(int signal) {
-	if (signal == SIGWINCH) {
-		return;
-	}
+// signals handled by the main loop through a signalfd, all others are fatal
+static const int loop_signals[] = {SIGINT, SIGTERM, SIGHUP, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCONT, SIGWINCH};
 
-	if (signal == SIGCONT) {
-		if (!start(false)) exit(3);
-		return;
+// only restores the terminal, with async-signal-safe calls, before dying from the signal as usual
+static void fatal_signal_func(int signal) {
+	static const char restore[] = "\x1b[?25h\x1b[?7h\x1b[?1049l";
+	if (running && !display.debug) {
+		if (write(STDOUT_FILENO, restore, sizeof(restore) - 1)) {}
+		tcsetattr(STDOUT_FILENO, TCSANOW, &display.old_termios);
 	}
+	raise(signal); // the handler was reset, and the signal is blocked until returning
+}
+
+// saves a checkpoint if asked to, and exits
+static void quit(int signal) {
+	// the final checkpoint is written here, after any still being written in the background
+	checkpoint_writer_free(checkpoint_writer);
+	checkpoint_writer = NULL;
+	bool saved = !checkpoint_path || view_segment || checkpoint_save(simulation, checkpoint_path);
+	bool did_stop = stop(true);
+	if (!saved) eprintf("Failed to write checkpoint: %s\n", checkpoint_path);
+	if (signal) eprintf("Caught signal %02i: %s\n", signal, strsignal(signal));
+	if (!did_stop) exit(3);
+	exit(signal && signal != SIGINT ? 1 : 0);
+}
 
-	bool is_stop_signal = false;
+static void handle_signal(int signal) {
 	switch (signal) {
+		case SIGWINCH: return; // the size is checked every frame
+		case SIGCONT:
+			if (!start(false)) exit(3);
+			return;
 		case SIGTSTP:
 		case SIGTTIN:
 		case SIGTTOU:
-			is_stop_signal = true;
+			if (!stop(false)) exit(3);
+			raise(SIGSTOP);
+			return;
+		default: quit(signal);
 	}
+}
 
-	bool did_stop = stop(!is_stop_signal);
-	eprintf("Caught signal %02i: %s\n", signal, strsignal(signal));
-	if (!did_stop) exit(3);
-	if (is_stop_signal) {
-		raise(SIGSTOP);
-		return;
+static void reset_simulation(void) {
+	sim_unpack_args(simulation, initial_args);
+	simulation->time = initial_time;
+	simulation->internal_step_size = 0;
+	sim_update_energy(simulation);
+	if (ensemble) ensemble_reset(ensemble);
+}
+
+static void perturb_simulation(void) {
+	LL_LOOP(struct sim_body *, body, simulation->bodies) {
+		for (size_t i = 0; i < body->coordinates_len; ++i) body->coordinates[i].position += 1e-3 * (2.0 * rand() / RAND_MAX - 1);
+	}
+	sim_update_energy(simulation);
+}
+
+static bool record_frame(void) {
+	double args[simulation->internal_args_len];
+	sim_pack_args(simulation, args);
+	return trajectory_write(recording, simulation->time, args + simulation->internal_coordinates_start);
+}
+
+static void handle_key(char key) {
+	switch (key) {
+		case ' ':
+		case 'p': paused = !paused; break;
+		case '.':
+		case 's':
+			paused = true;
+			++step_frames;
+			break;
+		case '+':
+		case '=': simulation_speed *= 2; break;
+		case '-': simulation_speed /= 2; break;
+		case '0': simulation_speed = 1; break;
+		case 'r':
+			if (!view_segment) reset_simulation();
+			break;
+		case 'x':
+			if (!view_segment) perturb_simulation();
+			break;
+		case 'q': quit(0);
 	}
-	exit(signal == SIGINT ? 0 : 1);
 }
 
 nsec_t get_time(void) {
@@ -94,70 +204,737 @@ nsec_t get_time(void) {
 	return (nsec_t) tp.tv_sec * SEC + tp.tv_nsec;
 }
 
-bool nsleep(nsec_t time) {
-	struct timespec tp = {.tv_sec = time / SEC, .tv_nsec = time % SEC};
-	return !nanosleep(&tp, NULL);
-}
-
 static bool main_render_func(struct display_screen screen, void *render_data) {
+	if (ensemble) return render_ensemble_func(screen, (struct sim_simulation *) render_data, ensemble);
 	return render_func(screen, (struct sim_simulation *) render_data);
 }
 
-int main(void) {
-	struct sigaction sa;
+static void usage(const char *argv0) {
+	eprintf("Usage: %s [options]\n"
+	        "  -s, --sweep <param>=<min>:<max>[:<count>]  add a sweep parameter, running headless,\n"
+	        "                                             param is sim.<var>, body<n>.<var>, pos<n>.<coord> or vel<n>.<coord>\n"
+	        "  -l, --lhs <points>                         use latin hypercube sampling instead of a grid\n"
+	        "      --seed <seed>                          seed for latin hypercube sampling\n"
+	        "  -n, --steps <steps>                        integration steps per sweep point\n"
+	        "  -t, --time <seconds>                       simulated time per sweep point\n"
+	        "  -j, --threads <threads>                    worker threads, defaults to the number of CPUs\n"
+	        "      --batch <points>                       points per batch/row group\n"
+	        "  -o, --output <file>                        columnar output file for the sweep\n"
+	        "  -f, --float                                integrate the sweep in single precision\n"
+	        "      --verify <points>                      points of a single precision sweep to re-run in double, defaults to 16\n"
+	        "  -P, --poincare <coord>=<value>[:+|:-]      stream crossings of a section to --output (CSV if it ends in .csv),\n"
+	        "                                             integrating a trajectory for each --sweep grid point, running headless\n"
+	        "      --plane <coord>,<coord>                coordinates recorded at each crossing, defaults to pos1.0,vel1.0\n"
+	        "      --live                                 scatter plot the crossings in the terminal while running\n"
+	        "  -B, --basin <image>                        map when an angle first flips over the first two --sweep parameters to image\n"
+	        "                                             (PNG if it ends in .png), refining their grid where it changes, running headless\n"
+	        "      --depth <levels>                       times a grid cell may be split in four, defaults to 4\n"
+	        "      --threshold <seconds>                  flip time difference across a cell to split it at, defaults to --time / 100\n"
+	        "      --budget <samples>                     samples to compute before refining stops\n"
+	        "      --basin-cache <file>                   reuse samples from earlier basin maps, e.g. when zooming, and add the new ones\n"
+	        "  -L, --lyapunov <count>                     print the largest Lyapunov exponents over --time, running headless\n"
+	        "      --renormalise <steps>                  steps between orthonormalising the tangent vectors\n"
+	        "      --parareal <slices>                    print the state after --time, integrated with Parareal over slices of it in parallel\n"
+	        "      --coarse <steps>                       steps of the coarse propagator per slice, defaults to a sixteenth of the fine\n"
+	        "      --parareal-tolerance <change>          largest change of a slice boundary to stop at, defaults to 1e-10\n",
+	        argv0);
+	// split to stay within the string length compilers must support
+	eprintf("  -e, --ensemble <members>                   integrate perturbed copies of the simulation, drawn as a density heatmap\n"
+	        "      --spread <radians>                     largest perturbation of each ensemble position, defaults to 1e-3\n"
+	        "      --color                                draw the heatmap with 256-colour half blocks instead of shaded blocks\n"
+	        "  -g, --graphics <sixel|kitty>               draw at the terminal's pixel resolution with sixel or the kitty graphics protocol\n"
+	        "      --frame-budget <fraction>              fraction of each frame the steps may take, choosing their number to fill it,\n"
+	        "                                             0 to always take the same number\n"
+	        "  -w, --record <file>                        write the state after every frame to a compressed trajectory file, overwriting it\n"
+	        "      --quantum <size>                       record the state rounded to multiples of size, smaller but lossy\n"
+	        "  -x, --export <pattern>                     render frames to images instead, e.g. frames/%%06zu.png (otherwise PPM), running headless\n"
+	        "      --size <width>x<height>                size of the exported frames, defaults to 1920x1080\n"
+	        "      --frames <count>                       frames to export, defaults to 600\n"
+	        "      --fps <rate>                           exported frames per second of simulated time, defaults to 60\n"
+	        "      --from <file>                          export every frame of a --record file instead of simulating\n"
+	        "      --pipeline <ndjson|binary>             integrate a job for each initial state read from stdin, over --steps and --time,\n"
+	        "                                             writing their results to stdout in order, running headless\n"
+	        "      --pipeline-output <ndjson|binary>      format of the results, defaults to that of the jobs\n"
+	        "      --fields <param>,...                   doubles of each binary job, as for --sweep, defaults to the whole state\n"
+	        "      --samples <count>                      states of each job's trajectory to include in its result\n"
+	        "      --autotune <file>                      compile the time derivative with the backend, optimisation level and CSE setting\n"
+	        "                                             fastest over the run, keeping the timings of each model in file\n"
+	        "  -m, --metrics                              collect metrics, printing a summary on exit\n"
+	        "      --trace <file>                         write Chrome trace events to file, implies --metrics\n"
+	        "  -p, --publish <name>                       publish the state to the shared memory segment name, e.g. /dpend\n"
+	        "  -v, --view <name>                          render the state published to name instead of simulating\n"
+	        "  -c, --checkpoint <file>                    periodically, and when terminated, save the state to file\n"
+	        "      --checkpoint-interval <seconds>        time between checkpoints, defaults to 60\n"
+	        "  -r, --restore <file>                       resume from a checkpoint\n"
+	        "      --self-check                           check that trajectory files round-trip, then exit\n"
+	        "  -h, --help                                 show this help\n");
+}
+
+static double sweep_points(const struct sweep_spec *spec) {
+	if (spec->sampling == SWEEP_LATIN_HYPERCUBE) return spec->points;
+	double points = 1;
+	for (size_t i = 0; i < spec->parameters_len; ++i) points *= spec->parameters[i].count;
+	return points;
+}
+
+static int run_sweep(struct sweep_spec *spec) {
+	struct sim_simulation *sim = init_simulation(false);
+	if (!sim) {
+		eprintf("Failed to initialise simulation\n");
+		return 3;
+	}
+	// the single precision kernel is only compiled when asked for
+	bool recompile = spec->precision != sim->precision;
+	sim->precision = spec->precision;
+	if (!recompile_simulation(sim, recompile, 4 * sweep_points(spec) * spec->steps)) {
+		eprintf("Failed to compile simulation\n");
+		free_simulation(sim);
+		return 3;
+	}
+	bool res = sweep_run(sim, spec);
+	if (!res) eprintf("Sweep failed\n");
+	free_simulation(sim);
+	return res ? 0 : 1;
+}
+
+static void cancel_signal_func(int signal) {
+	exit_signal = signal;
+}
+
+static int run_poincare(struct poincare_spec *spec) {
+	struct sim_simulation *sim = init_simulation(false);
+	if (!sim) {
+		eprintf("Failed to initialise simulation\n");
+		return 3;
+	}
+	if (!recompile_simulation(sim, false, 4 * sweep_points(spec->trajectories) * spec->trajectories->steps)) {
+		eprintf("Failed to compile simulation\n");
+		free_simulation(sim);
+		return 3;
+	}
+
+	// finish writing the crossings found so far when interrupted
+	struct sigaction sa = {.sa_handler = cancel_signal_func};
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	display = init_display();
+	if (spec->live && !display_enable(&display)) {
+		eprintf("Failed to initialise display\n");
+		free_simulation(sim);
+		return 3;
+	}
+	bool res = poincare_run(sim, spec, &display, &exit_signal);
+	if (spec->live) display_disable(&display);
+	if (!res) eprintf("Poincaré section failed\n");
+	free_simulation(sim);
+	return res ? 0 : 1;
+}
+
+static int run_export(struct export_spec *spec) {
+	struct sim_simulation *sim = init_simulation(false);
+	if (!sim) {
+		eprintf("Failed to initialise simulation\n");
+		return 3;
+	}
+	if (!recompile_simulation(sim, false, spec->input ? 0 : 4.0 * spec->frames * steps_per_frame)) {
+		eprintf("Failed to compile simulation\n");
+		free_simulation(sim);
+		return 3;
+	}
+
+	// finish the frames being written when interrupted
+	struct sigaction sa = {.sa_handler = cancel_signal_func};
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	spec->render_func = render_func;
+	spec->steps_per_frame = steps_per_frame;
+	bool res = export_run(sim, spec, &exit_signal);
+	if (!res) eprintf("Export failed\n");
+	free_simulation(sim);
+	return res ? 0 : 1;
+}
+
+static int run_lyapunov(size_t exponents_len, int steps, double time_span, int renormalise_steps) {
+	int res = 1;
+	double *args = NULL, exponents[exponents_len];
+	struct sim_simulation *sim = init_simulation(false);
+	if (!sim) {
+		eprintf("Failed to initialise simulation\n");
+		return 3;
+	}
+
+	// recompile with the Jacobian if the simulation didn't already ask for it
+	bool recompile = !sim->internal_model->jacobian_func;
+	sim->compile_jacobian = true;
+	if (!recompile_simulation(sim, recompile, 4.0 * steps)) {
+		eprintf("Failed to compile Jacobian\n");
+		goto fail;
+	}
+
+	if (!(args = calloc(sim->internal_args_len, sizeof(*args)))) goto fail;
+	sim_pack_args(sim, args);
+	if (!lyapunov_spectrum(sim, args, exponents_len, steps, time_span, renormalise_steps, exponents)) {
+		eprintf("Failed to compute Lyapunov exponents\n");
+		goto fail;
+	}
+	for (size_t i = 0; i < exponents_len; ++i) printf("%.9g\n", exponents[i]);
+
+	res = 0;
+fail:
+	free(args);
+	free_simulation(sim);
+	return res;
+}
+
+static int run_parareal(struct parareal_spec *spec, int steps, double time_span) {
+	int res = 1;
+	double *args = NULL;
+	struct sim_simulation *sim = init_simulation(false);
+	if (!sim) {
+		eprintf("Failed to initialise simulation\n");
+		return 3;
+	}
+	if (!recompile_simulation(sim, false, 4.0 * steps)) {
+		eprintf("Failed to compile simulation\n");
+		free_simulation(sim);
+		return 3;
+	}
+
+	// --steps is the total of the fine propagator, the coarse one taking a sixteenth unless given
+	spec->fine_steps = steps / (int) spec->slices > 0 ? steps / (int) spec->slices : 1;
+	if (!spec->coarse_steps) spec->coarse_steps = spec->fine_steps / 16 > 0 ? spec->fine_steps / 16 : 1;
+
+	struct parareal_stats stats;
+	if (!(args = calloc(sim->internal_args_len, sizeof(*args)))) goto fail;
+	sim_pack_args(sim, args);
+	if (!parareal_integrate(sim, args, time_span, spec, NULL, &stats)) {
+		eprintf("Failed to integrate\n");
+		goto fail;
+	}
+	eprintf("%i iterations, largest change %g\n", stats.iterations, stats.change);
+	for (size_t i = sim->internal_coordinates_start; i < sim->internal_args_len; ++i) printf("%.17g\n", args[i]);
+
+	res = 0;
+fail:
+	free(args);
+	free_simulation(sim);
+	return res;
+}
+
+static int run_pipeline(struct pipeline_spec *spec) {
+	struct sim_simulation *sim = init_simulation(false);
+	if (!sim) {
+		eprintf("Failed to initialise simulation\n");
+		return 3;
+	}
+	// tuned for a hundred thousand jobs, as the length of the stream isn't known
+	if (!recompile_simulation(sim, false, 4.0 * spec->steps * 100000)) {
+		eprintf("Failed to compile simulation\n");
+		free_simulation(sim);
+		return 3;
+	}
+
+	// stop reading jobs when interrupted, writing the results of those already read
+	struct sigaction sa = {.sa_handler = cancel_signal_func};
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	bool res = pipeline_run(sim, spec, stdin, stdout, &exit_signal);
+	if (!res) eprintf("Pipeline failed\n");
+	free_simulation(sim);
+	return res ? 0 : 1;
+}
+
+static bool parse_pipeline_format(enum pipeline_format *format, const char *str) {
+	if (!strcmp(str, "ndjson"))
+		*format = PIPELINE_NDJSON;
+	else if (!strcmp(str, "binary"))
+		*format = PIPELINE_BINARY;
+	else
+		return false;
+	return true;
+}
+
+// samples are taken at about a quarter of the corners of the finest grid, unless the budget runs out first
+static double basin_calls(const struct basin_spec *spec) {
+	double corners = 1;
+	for (size_t i = 0; i < spec->samples->parameters_len && i < 2; ++i) corners *= ((spec->samples->parameters[i].count - 1) << spec->max_depth) + 1;
+	return 4 * (spec->budget && spec->budget < corners / 4 ? spec->budget : corners / 4) * spec->samples->steps;
+}
+
+static int run_basin(struct basin_spec *spec, bool color, enum display_graphics graphics) {
+	struct sim_simulation *sim = init_simulation(false);
+	if (!sim) {
+		eprintf("Failed to initialise simulation\n");
+		return 3;
+	}
+	if (!recompile_simulation(sim, false, basin_calls(spec))) {
+		eprintf("Failed to compile simulation\n");
+		free_simulation(sim);
+		return 3;
+	}
+
+	// save the samples so far to the cache when interrupted
+	struct sigaction sa = {.sa_handler = cancel_signal_func};
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	display = init_display();
+	display.mode = color ? DISPLAY_COLOR : DISPLAY_SHADES;
+	display.graphics = graphics;
+	if (spec->live && !display_enable(&display)) {
+		eprintf("Failed to initialise display\n");
+		free_simulation(sim);
+		return 3;
+	}
+	bool res = basin_run(sim, spec, &display, &exit_signal);
+	if (spec->live) display_disable(&display);
+	if (!res) eprintf("Basin map failed\n");
+	free_simulation(sim);
+	return res ? 0 : 1;
+}
+
+static void cleanup(void) {
+	shm_close(publish_segment);
+	shm_close(view_segment);
+	publish_segment = view_segment = NULL;
+	FREE(initial_args);
+	ensemble_free(ensemble);
+	ensemble = NULL;
+	if (!trajectory_close(recording)) eprintf("Failed to finish recording\n");
+	recording = NULL;
+	checkpoint_writer_free(checkpoint_writer);
+	checkpoint_writer = NULL;
+	metrics_close(stderr);
+}
+
+int main(int argc, char **argv) {
+	struct sweep_spec sweep = {
+	        .sampling = SWEEP_GRID,
+	        .steps = 10000,
+	        .time_span = 10,
+	        .threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1,
+	        .output = "sweep.dpcol",
+	        .verify = 16,
+	};
+	struct poincare_spec poincare = {.trajectories = &sweep};
+	struct parareal_spec parareal = {.tolerance = 1e-10};
+	struct basin_spec basin = {.samples = &sweep, .max_depth = 4, .threshold = NAN};
+	struct export_spec export = {.width = 1920, .height = 1080, .frames = 600, .time_step = 1 / 60.0};
+	struct pipeline_spec pipeline = {0};
+	bool poincare_set = false, pipeline_set = false, pipeline_output_set = false;
+	size_t lyapunov = 0, ensemble_members = 0;
+	double ensemble_spread = 1e-3, record_quantum = 0;
+	bool color = false;
+	enum display_graphics graphics = DISPLAY_TEXT;
+	const char *publish_name = NULL, *restore_path = NULL, *record_path = NULL;
+	nsec_t checkpoint_interval = 60 * SEC;
+	int renormalise_steps = 10;
+	int res = 2;
+
+	static const struct option options[] = {
+	        {"sweep",               required_argument, NULL, 's'},
+	        {"lhs",                 required_argument, NULL, 'l'},
+	        {"seed",                required_argument, NULL, 'S'},
+	        {"steps",               required_argument, NULL, 'n'},
+	        {"time",                required_argument, NULL, 't'},
+	        {"threads",             required_argument, NULL, 'j'},
+	        {"batch",               required_argument, NULL, 'b'},
+	        {"output",              required_argument, NULL, 'o'},
+	        {"float",               no_argument,       NULL, 'f'},
+	        {"verify",              required_argument, NULL, 'V'},
+	        {"poincare",            required_argument, NULL, 'P'},
+	        {"plane",               required_argument, NULL, 'A'},
+	        {"live",                no_argument,       NULL, 'I'},
+	        {"basin",               required_argument, NULL, 'B'},
+	        {"depth",               required_argument, NULL, 'D'},
+	        {"threshold",           required_argument, NULL, 'H'},
+	        {"budget",              required_argument, NULL, 'U'},
+	        {"basin-cache",         required_argument, NULL, 'K'},
+	        {"lyapunov",            required_argument, NULL, 'L'},
+	        {"renormalise",         required_argument, NULL, 'R'},
+	        {"parareal",            required_argument, NULL, 'a'},
+	        {"coarse",              required_argument, NULL, 'O'},
+	        {"parareal-tolerance",  required_argument, NULL, 'Z'},
+	        {"ensemble",            required_argument, NULL, 'e'},
+	        {"spread",              required_argument, NULL, 'E'},
+	        {"color",               no_argument,       NULL, 'k'},
+	        {"graphics",            required_argument, NULL, 'g'},
+	        {"frame-budget",        required_argument, NULL, 'W'},
+	        {"record",              required_argument, NULL, 'w'},
+	        {"quantum",             required_argument, NULL, 'Q'},
+	        {"export",              required_argument, NULL, 'x'},
+	        {"size",                required_argument, NULL, 'G'},
+	        {"frames",              required_argument, NULL, 'F'},
+	        {"fps",                 required_argument, NULL, 'Y'},
+	        {"from",                required_argument, NULL, 'i'},
+	        {"pipeline",            required_argument, NULL, 'N'},
+	        {"pipeline-output",     required_argument, NULL, 'M'},
+	        {"fields",              required_argument, NULL, 'd'},
+	        {"samples",             required_argument, NULL, 'y'},
+	        {"autotune",            required_argument, NULL, 'u'},
+	        {"metrics",             no_argument,       NULL, 'm'},
+	        {"trace",               required_argument, NULL, 'T'},
+	        {"publish",             required_argument, NULL, 'p'},
+	        {"view",                required_argument, NULL, 'v'},
+	        {"checkpoint",          required_argument, NULL, 'c'},
+	        {"checkpoint-interval", required_argument, NULL, 'C'},
+	        {"restore",             required_argument, NULL, 'r'},
+	        {"self-check",          no_argument,       NULL, 'X'},
+	        {"help",                no_argument,       NULL, 'h'},
+	        {0},
+	};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "s:l:n:t:j:o:fP:B:L:e:g:w:x:mp:v:c:r:h", options, NULL)) != -1) {
+		switch (opt) {
+			case 's': {
+				struct sweep_parameter *params = realloc(sweep.parameters, (sweep.parameters_len + 1) * sizeof(*params));
+				if (!params) goto usage_fail;
+				sweep.parameters = params;
+				if (!sweep_parse_parameter(&params[sweep.parameters_len++], optarg)) {
+					eprintf("Invalid sweep parameter: %s\n", optarg);
+					goto usage_fail;
+				}
+				break;
+			}
+			case 'l':
+				sweep.sampling = SWEEP_LATIN_HYPERCUBE;
+				sweep.points = strtoull(optarg, NULL, 0);
+				break;
+			case 'S': sweep.seed = strtoull(optarg, NULL, 0); break;
+			case 'n': sweep.steps = atoi(optarg); break;
+			case 't': sweep.time_span = atof(optarg); break;
+			case 'j': sweep.threads = atoi(optarg); break;
+			case 'b': sweep.batch_size = strtoull(optarg, NULL, 0); break;
+			case 'o': sweep.output = poincare.output = optarg; break;
+			case 'f': sweep.precision = SIM_PRECISION_FLOAT; break;
+			case 'V': sweep.verify = strtoull(optarg, NULL, 0); break;
+			case 'P':
+				if (!poincare_parse_section(&poincare, optarg)) {
+					eprintf("Invalid Poincaré section: %s\n", optarg);
+					goto usage_fail;
+				}
+				poincare_set = true;
+				break;
+			case 'A':
+				if (!poincare_parse_plane(&poincare, optarg)) {
+					eprintf("Invalid Poincaré plane: %s\n", optarg);
+					goto usage_fail;
+				}
+				break;
+			case 'I': poincare.live = basin.live = true; break;
+			case 'B': basin.output = optarg; break;
+			case 'D': basin.max_depth = atoi(optarg); break;
+			case 'H': basin.threshold = atof(optarg); break;
+			case 'U': basin.budget = strtoull(optarg, NULL, 0); break;
+			case 'K': basin.cache = optarg; break;
+			case 'L': lyapunov = strtoull(optarg, NULL, 0); break;
+			case 'a': parareal.slices = strtoull(optarg, NULL, 0); break;
+			case 'O': parareal.coarse_steps = atoi(optarg); break;
+			case 'Z': parareal.tolerance = atof(optarg); break;
+			case 'R': renormalise_steps = atoi(optarg); break;
+			case 'e': ensemble_members = strtoull(optarg, NULL, 0); break;
+			case 'E': ensemble_spread = atof(optarg); break;
+			case 'k': color = true; break;
+			case 'g':
+				if (!strcmp(optarg, "sixel")) {
+					graphics = DISPLAY_SIXEL;
+				} else if (!strcmp(optarg, "kitty")) {
+					graphics = DISPLAY_KITTY;
+				} else {
+					eprintf("Unknown graphics protocol: %s\n", optarg);
+					goto usage_fail;
+				}
+				break;
+			case 'W': frame_budget = atof(optarg); break;
+			case 'w': record_path = optarg; break;
+			case 'Q': record_quantum = atof(optarg); break;
+			case 'x': export.output = optarg; break;
+			case 'G':
+				if (sscanf(optarg, "%zux%zu", &export.width, &export.height) != 2) {
+					eprintf("Invalid size: %s\n", optarg);
+					goto usage_fail;
+				}
+				break;
+			case 'F': export.frames = strtoull(optarg, NULL, 0); break;
+			case 'Y': export.time_step = 1 / atof(optarg); break;
+			case 'i': export.input = optarg; break;
+			case 'N':
+			case 'M':
+				if (!parse_pipeline_format(opt == 'N' ? &pipeline.input : &pipeline.output, optarg)) {
+					eprintf("Unknown pipeline format: %s\n", optarg);
+					goto usage_fail;
+				}
+				pipeline_set |= opt == 'N';
+				pipeline_output_set |= opt == 'M';
+				break;
+			case 'd': pipeline.fields = optarg; break;
+			case 'y': pipeline.samples = strtoull(optarg, NULL, 0); break;
+			case 'u': autotune_cache = optarg; break;
+			case 'm': metrics_enabled = true; break;
+			case 'p': publish_name = optarg; break;
+			case 'c': checkpoint_path = optarg; break;
+			case 'C': checkpoint_interval = atof(optarg) * SEC; break;
+			case 'r': restore_path = optarg; break;
+			case 'v':
+				if (!(view_segment = shm_view_open(optarg))) {
+					eprintf("Failed to attach to shared memory segment: %s\n", optarg);
+					return 3;
+				}
+				break;
+			case 'T':
+				if (!metrics_trace_open(optarg)) {
+					eprintf("Failed to open trace file: %s\n", optarg);
+					goto usage_fail;
+				}
+				break;
+			case 'X':
+				if (!trajectory_self_check(stderr)) return 1;
+				eprintf("Trajectory self-check passed\n");
+				return 0;
+			case 'h': res = 0; // fallthrough
+			default: goto usage_fail;
+		}
+	}
+	if (optind != argc) goto usage_fail;
+	atexit(cleanup);
+
+	if (lyapunov) {
+		free(sweep.parameters);
+		return run_lyapunov(lyapunov, sweep.steps, sweep.time_span, renormalise_steps);
+	}
+
+	if (parareal.slices) {
+		parareal.threads = sweep.threads;
+		free(sweep.parameters);
+		return run_parareal(&parareal, sweep.steps, sweep.time_span);
+	}
+
+	if (basin.output || basin.cache) {
+		if (isnan(basin.threshold)) basin.threshold = sweep.time_span / 100;
+		res = run_basin(&basin, color, graphics);
+		free(sweep.parameters);
+		return res;
+	}
+
+	if (poincare_set) {
+		if (!poincare.output) poincare.output = "poincare.dppnc";
+		if (!poincare.plane[0].name[0]) poincare_parse_plane(&poincare, "pos1.0,vel1.0");
+		res = run_poincare(&poincare);
+		free(sweep.parameters);
+		return res;
+	}
+
+	if (export.output) {
+		export.threads = sweep.threads;
+		export.time_step *= simulation_speed;
+		free(sweep.parameters);
+		return run_export(&export);
+	}
+
+	if (pipeline_set) {
+		if (!pipeline_output_set) pipeline.output = pipeline.input;
+		pipeline.steps = sweep.steps;
+		pipeline.time_span = sweep.time_span;
+		pipeline.threads = sweep.threads;
+		free(sweep.parameters);
+		return run_pipeline(&pipeline);
+	}
+
+	if (sweep.parameters_len) {
+		res = run_sweep(&sweep);
+		free(sweep.parameters);
+		return res;
+	}
+
+	// the loop signals are only received through the signalfd
+	sigset_t signals;
+	sigemptyset(&signals);
+	for (size_t i = 0; i < LENGTHOF(loop_signals); ++i) sigaddset(&signals, loop_signals[i]);
+	if (sigprocmask(SIG_BLOCK, &signals, NULL)) return 2;
+
+	struct sigaction sa = {.sa_handler = fatal_signal_func, .sa_flags = SA_RESETHAND};
 	if (sigemptyset(&sa.sa_mask)) return 2;
-	sa.sa_handler = signal_func;
-	sa.sa_flags = 0;
 	for (int signal = 1; signal < NSIG; ++signal) {
 		if (signal == SIGTRAP) continue;
-		if (signal == SIGCHLD || signal == SIGURG) continue;  // signals that are ignored by default (excl. SIGCONT, SIGWINCH)
+		if (signal == SIGCHLD || signal == SIGURG) continue;  // signals that are ignored by default
 		if (signal == SIGKILL || signal == SIGSTOP) continue; // can't handle these
+		if (sigismember(&signals, signal)) continue;
 		sigaction(signal, &sa, NULL);
 	}
 
 	display = init_display();
+	if (ensemble_members && !view_segment) display.mode = color ? DISPLAY_COLOR : DISPLAY_SHADES;
+	display.graphics = graphics;
 	if (!start(true)) return 3;
 
+	if (restore_path && !view_segment && !checkpoint_restore(simulation, restore_path)) {
+		stop(true);
+		eprintf("Failed to restore checkpoint: %s\n", restore_path);
+		return 3;
+	}
+
+	if (checkpoint_path && !view_segment && !(checkpoint_writer = checkpoint_writer_new(checkpoint_path))) {
+		stop(true);
+		eprintf("Failed to start writing checkpoints: %s\n", checkpoint_path);
+		return 3;
+	}
+
+	if (publish_name && !view_segment && !(publish_segment = shm_publish_open(publish_name, simulation, 64))) {
+		int error = errno;
+		stop(true);
+		eprintf("Failed to create shared memory segment %s: %s\n", publish_name, error == EEXIST ? "another process is publishing to it" : strerror(error));
+		return 3;
+	}
+
+	if (!view_segment) {
+		if (!(initial_args = calloc(simulation->internal_args_len, sizeof(*initial_args)))) goto fail;
+		sim_pack_args(simulation, initial_args);
+		initial_time = simulation->time;
+		if (record_path && !(recording = trajectory_open(record_path, SIM_STATE_LEN(simulation), 0, record_quantum))) {
+			stop(true);
+			eprintf("Failed to open recording: %s\n", record_path);
+			return 3;
+		}
+		if (recording && !record_frame()) goto fail;
+		if (ensemble_members && !(ensemble = ensemble_new(simulation, ensemble_members, ensemble_spread, sweep.seed, sweep.threads))) goto fail;
+	}
+
+	// frame ticks, key presses, signals and the terminal accepting more output all wake the same epoll loop
 	const nsec_t wait_time = SEC / max_fps;
-	nsec_t dest = get_time(), dest_last = dest;
-	struct timing_info timing = {.first = true};
+	const struct itimerspec tick = {
+	        .it_interval = {.tv_sec = wait_time / SEC, .tv_nsec = wait_time % SEC},
+	        .it_value = {.tv_sec = wait_time / SEC, .tv_nsec = wait_time % SEC},
+	};
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC), timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC), signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (epoll_fd < 0 || timer_fd < 0 || signal_fd < 0) goto fail;
+	struct epoll_event event = {.events = EPOLLIN};
+	event.data.fd = timer_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event)) goto fail;
+	event.data.fd = signal_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event)) goto fail;
+	event.data.fd = STDIN_FILENO;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event); // fails if stdin isn't pollable, e.g. /dev/null, so there are just no keys
+	bool watching_output = false;
+
+	// without a budget the steps stay put, and are measured against the whole frame
+	struct pacing pacing;
+	if (frame_budget > 0)
+		pacing_init(&pacing, steps_per_frame, min_steps_per_frame, max_steps_per_frame, frame_budget * wait_time);
+	else
+		pacing_init(&pacing, steps_per_frame, steps_per_frame, steps_per_frame, wait_time);
+
+	nsec_t start_time = get_time(), ticks = 0;
+	struct timing_info timing = {.first = true, .steps = pacing.steps};
+	nsec_t next_checkpoint = start_time + checkpoint_interval;
+	bool checkpoint_failed = false;
+	if (timerfd_settime(timer_fd, 0, &tick, NULL)) goto fail;
 
 	while (1) {
-		timing.time = get_time();
-
-		if (timing.time > dest) dest = timing.time + wait_time; // if more than one second has elapsed, reset the offset and wait until 1 second has passed since now
-		nsec_t delay = dest - timing.time;                      // wait until destination time
+		struct epoll_event events[4];
+		int events_len = epoll_wait(epoll_fd, events, LENGTHOF(events), -1);
+		if (events_len < 0) {
+			if (errno == EINTR) continue;
+			goto fail;
+		}
 
-		if (dest == timing.time + wait_time || nsleep(delay)) {
-			timing.frame_time = dest - dest_last;
-			double time_advance = simulation_speed * (((frame_skip ? timing.frame_time : wait_time) / (double) SEC));
+		uint64_t expirations = 0;
+		for (int i = 0; i < events_len; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == timer_fd) {
+				if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) expirations = 0;
+			} else if (fd == signal_fd) {
+				struct signalfd_siginfo info;
+				while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) handle_signal(info.ssi_signo);
+			} else if (fd == STDIN_FILENO) {
+				char keys[64];
+				ssize_t keys_len = read(STDIN_FILENO, keys, sizeof(keys));
+				if (keys_len <= 0) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL); // end of input
+				for (ssize_t k = 0; k < keys_len; ++k) handle_key(keys[k]);
+			} else if (fd == display.fd) {
+				if (!display_flush(&display)) goto fail;
+			}
+		}
 
+		if (expirations && running) {
 			timing.time = get_time();
-			if (!timing.first) {
-				if (!sim_step(simulation, steps_per_frame, time_advance)) goto fail;
+			ticks += expirations;
+			// how late this wake-up was compared to when the tick was due
+			if (metrics_enabled) metrics_record(METRICS_WAKE_NS, timing.time - (start_time + ticks * wait_time));
 
-				if (timing.frame_time != wait_time) {
+			timing.frame_time = expirations * wait_time;
+			double time_advance = simulation_speed * (((frame_skip ? timing.frame_time : wait_time) / (double) SEC));
+
+			if (view_segment) shm_view_read(view_segment, simulation);
+			else if (!timing.first && (!paused || step_frames)) {
+				if (step_frames) {
+					--step_frames;
+					time_advance = simulation_speed * wait_time / (double) SEC;
+				}
+				nsec_t step_start = get_time();
+				timing.steps = pacing.steps;
+				if (!sim_step(simulation, pacing.steps, time_advance)) goto fail;
+				if (ensemble && !ensemble_step(ensemble, pacing.steps, time_advance)) goto fail;
+				pacing_update(&pacing, get_time() - step_start);
+				if (metrics_tracing) metrics_trace_counter("steps per frame", pacing.steps);
+				timing.utilisation = pacing.utilisation;
+				if (recording && !record_frame()) goto fail;
+
+				if (expirations > 1) {
 					timing.lag = true;
 					timing.last_lag_time = timing.time;
+					METRICS_COUNT(METRICS_FRAMES_DROPPED, expirations - 1);
 				}
 			}
 
+			if (publish_segment) shm_publish(publish_segment, simulation);
+
+			// a failed checkpoint is shown in the overlay and retried on the next interval rather than ending the run
+			if (checkpoint_writer && timing.time >= next_checkpoint) {
+				checkpoint_failed = !checkpoint_writer_save(checkpoint_writer, simulation);
+				next_checkpoint = timing.time + checkpoint_interval;
+			}
+			timing.warning = checkpoint_writer && (checkpoint_failed || checkpoint_writer_failed(checkpoint_writer)) ? "failed to write checkpoint" : NULL;
+
 			timing.show_lag = timing.lag && timing.time < timing.last_lag_time + SEC;
+			timing.paused = paused;
 			timing.sim_time = get_time() - timing.time;
+			METRICS_END(timing.time, METRICS_SIM_NS, "simulate", "frame");
 
-			if (!update_display_func(simulation, &display,&timing)) goto fail;
-
-			dest_last = dest;
-			dest += wait_time; // add delay amount to destination time so we can precisely run the code on that interval
+			if (!update_display_func(simulation, &display, &timing)) goto fail;
 			timing.first = false;
+
+			nsec_t render_start = get_time();
+			if (!display_render(&display, main_render_func, simulation)) goto fail;
+			timing.render_time = get_time() - render_start;
+			METRICS_END(render_start, METRICS_RENDER_NS, "render", "frame");
+			if (metrics_enabled) {
+				metrics_count(METRICS_FRAMES, 1);
+				metrics_record(METRICS_FRAME_NS, timing.sim_time + timing.render_time);
+			}
+		}
+
+		// only wake up for the terminal while a frame is still being written
+		if (running && DISPLAY_PENDING(&display) != watching_output) {
+			watching_output = !watching_output;
+			event.events = EPOLLOUT;
+			event.data.fd = display.fd;
+			if (epoll_ctl(epoll_fd, watching_output ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, display.fd, &event)) watching_output = false;
 		}
-		timing.render_time = get_time();
-		if (!display_render(&display, main_render_func, simulation)) goto fail;
-		timing.render_time = get_time() - timing.render_time;
 	}
 
 	return 0;
 fail:
 	if (!stop(true)) return 3;
 	return 1;
+usage_fail:
+	usage(argv[0]);
+	free(sweep.parameters);
+	return res;
 }
@@ -0,0 +1,138 @@
+#include "metrics.h"
+#include <time.h>
+#include <pthread.h>
+#include <inttypes.h>
+
+bool metrics_enabled = false, metrics_tracing = false;
+
+static uint64_t counters[METRICS_COUNTERS_LEN];
+static uint64_t histograms[METRICS_HISTOGRAMS_LEN][METRICS_BUCKETS];
+
+static const char *counter_names[METRICS_COUNTERS_LEN] = {
+        [METRICS_DYDT_CALLS] = "dydt calls",
+        [METRICS_JACOBIAN_CALLS] = "Jacobian calls",
+        [METRICS_RK_STEPS] = "integrator steps",
+        [METRICS_TTY_BYTES] = "bytes written to tty",
+        [METRICS_FRAMES] = "frames",
+        [METRICS_FRAMES_DROPPED] = "frames dropped",
+        [METRICS_FRAMES_COALESCED] = "frames coalesced",
+};
+static const char *histogram_names[METRICS_HISTOGRAMS_LEN] = {
+        [METRICS_VISITOR_NS] = "kernel call",
+        [METRICS_SIM_NS] = "frame simulation",
+        [METRICS_RENDER_NS] = "frame render",
+        [METRICS_FRAME_NS] = "frame latency",
+        [METRICS_COMPILE_NS] = "compile phase",
+        [METRICS_WAKE_NS] = "frame wake-up lateness",
+};
+
+static FILE *trace_file = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t trace_start;
+static bool trace_first = true;
+
+uint64_t metrics_now(void) {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t) tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+void metrics_count(enum metrics_counter counter, uint64_t n) {
+	__atomic_fetch_add(&counters[counter], n, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_counter_value(enum metrics_counter counter) {
+	return __atomic_load_n(&counters[counter], __ATOMIC_RELAXED);
+}
+
+static unsigned bucket_index(uint64_t value) {
+	if (value < (1 << METRICS_SUB_BITS)) return value;
+	unsigned exponent = 63 - __builtin_clzll(value); // >= METRICS_SUB_BITS
+	unsigned sub = (value >> (exponent - METRICS_SUB_BITS)) & ((1 << METRICS_SUB_BITS) - 1);
+	return ((exponent - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) + sub;
+}
+
+// lowest value that lands in the bucket
+static uint64_t bucket_value(unsigned index) {
+	if (index < (1 << METRICS_SUB_BITS)) return index;
+	unsigned exponent = (index >> METRICS_SUB_BITS) + METRICS_SUB_BITS - 1;
+	uint64_t sub = index & ((1 << METRICS_SUB_BITS) - 1);
+	return ((uint64_t) 1 << exponent) | (sub << (exponent - METRICS_SUB_BITS));
+}
+
+void metrics_record(enum metrics_histogram histogram, uint64_t value) {
+	__atomic_fetch_add(&histograms[histogram][bucket_index(value)], 1, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_percentile(enum metrics_histogram histogram, double fraction) {
+	uint64_t total = 0;
+	for (unsigned i = 0; i < METRICS_BUCKETS; ++i) total += __atomic_load_n(&histograms[histogram][i], __ATOMIC_RELAXED);
+	if (!total) return 0;
+
+	uint64_t target = fraction * total, seen = 0;
+	if (target >= total) target = total - 1;
+	for (unsigned i = 0; i < METRICS_BUCKETS; ++i) {
+		seen += __atomic_load_n(&histograms[histogram][i], __ATOMIC_RELAXED);
+		if (seen > target) return bucket_value(i);
+	}
+	return bucket_value(METRICS_BUCKETS - 1);
+}
+
+static unsigned thread_id(void) {
+	static unsigned next_id = 0;
+	static _Thread_local unsigned id = 0;
+	if (!id) id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+	return id;
+}
+
+bool metrics_trace_open(const char *path) {
+	if (!(trace_file = fopen(path, "w"))) return false;
+	trace_start = metrics_now();
+	fputs("{\"traceEvents\":[\n", trace_file);
+	metrics_enabled = metrics_tracing = true;
+	return true;
+}
+
+// timestamps are in microseconds relative to when the trace was opened
+#define TRACE_US(ns) (((ns) - trace_start) / 1000.0)
+
+// trace_file is only read under trace_lock, as metrics_close may close it from another thread meanwhile
+void metrics_trace_event(const char *name, const char *category, uint64_t start, uint64_t end) {
+	unsigned tid = thread_id();
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file) {
+		fprintf(trace_file, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+		        trace_first ? "" : ",\n", name, category, tid, TRACE_US(start), (end - start) / 1000.0);
+		trace_first = false;
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void metrics_trace_counter(const char *name, double value) {
+	uint64_t now = metrics_now();
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file) {
+		fprintf(trace_file, "%s{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{\"value\":%.17g}}",
+		        trace_first ? "" : ",\n", name, TRACE_US(now), value);
+		trace_first = false;
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void metrics_close(FILE *summary) {
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file) {
+		fputs("\n]}\n", trace_file);
+		fclose(trace_file);
+		trace_file = NULL;
+		metrics_tracing = false;
+	}
+	pthread_mutex_unlock(&trace_lock);
+
+	if (!metrics_enabled || !summary) return;
+	for (int i = 0; i < METRICS_COUNTERS_LEN; ++i)
+		fprintf(summary, "%24s: %" PRIu64 "\n", counter_names[i], metrics_counter_value(i));
+	for (int i = 0; i < METRICS_HISTOGRAMS_LEN; ++i)
+		fprintf(summary, "%24s: p50 %10" PRIu64 " ns, p90 %10" PRIu64 " ns, p99 %10" PRIu64 " ns, max %10" PRIu64 " ns\n", histogram_names[i],
+		        metrics_percentile(i, 0.5), metrics_percentile(i, 0.9), metrics_percentile(i, 0.99), metrics_percentile(i, 1));
+}
@@ -0,0 +1,81 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// in-process counters and log-linear histograms, with optional Chrome trace event output (chrome://tracing, ui.perfetto.dev)
+// everything is behind a check of metrics_enabled, and compiled out entirely with SIM_NO_METRICS
+
+enum metrics_counter {
+	METRICS_DYDT_CALLS,
+	METRICS_JACOBIAN_CALLS,
+	METRICS_RK_STEPS,
+	METRICS_TTY_BYTES,
+	METRICS_FRAMES,
+	METRICS_FRAMES_DROPPED,
+	METRICS_FRAMES_COALESCED, // frames skipped because the terminal was still writing the previous one
+	METRICS_COUNTERS_LEN,
+};
+
+enum metrics_histogram {
+	METRICS_VISITOR_NS, // time spent in a single compiled kernel call
+	METRICS_SIM_NS,     // time spent simulating each frame
+	METRICS_RENDER_NS,  // time spent rendering each frame
+	METRICS_FRAME_NS,   // simulation and render time of each frame
+	METRICS_COMPILE_NS, // time spent in each sim_compile phase
+	METRICS_WAKE_NS,    // lateness of each frame tick
+	METRICS_HISTOGRAMS_LEN,
+};
+
+// values are bucketed by their power of two, which is split into 2^METRICS_SUB_BITS linear sub-buckets,
+// giving a relative error of at most 1/2^METRICS_SUB_BITS
+#define METRICS_SUB_BITS 4
+#define METRICS_BUCKETS (64 << METRICS_SUB_BITS)
+
+extern bool metrics_enabled, metrics_tracing;
+
+uint64_t metrics_now(void); // CLOCK_MONOTONIC in nanoseconds
+
+void metrics_count(enum metrics_counter counter, uint64_t n);
+void metrics_record(enum metrics_histogram histogram, uint64_t value);
+uint64_t metrics_counter_value(enum metrics_counter counter);
+// approximate value below which the given fraction (0 to 1) of the recorded values lie, 0 if nothing was recorded
+uint64_t metrics_percentile(enum metrics_histogram histogram, double fraction);
+
+// writes a complete event spanning start to end to the trace, with name and category being string literals
+void metrics_trace_event(const char *name, const char *category, uint64_t start, uint64_t end);
+// writes the value of a counter track to the trace, with name being a string literal
+void metrics_trace_counter(const char *name, double value);
+
+// enables tracing, writing to path
+bool metrics_trace_open(const char *path);
+// finishes the trace if it is open, and prints a summary of all metrics if enabled
+void metrics_close(FILE *summary);
+
+#ifdef SIM_NO_METRICS
+#define METRICS_COUNT(counter, n) \
+	do {                          \
+	} while (0)
+#define METRICS_START(var)
+#define METRICS_END(var, histogram, name, category) \
+	do {                                            \
+	} while (0)
+#else
+#define METRICS_COUNT(counter, n)                       \
+	do {                                                \
+		if (metrics_enabled) metrics_count(counter, n); \
+	} while (0)
+// measures the time from METRICS_START to METRICS_END, recording it in the histogram and the trace
+#define METRICS_START(var) uint64_t var = metrics_enabled ? metrics_now() : 0
+// name may be NULL to only record the histogram, for events too frequent to trace
+#define METRICS_END(var, histogram, name, category)                                                   \
+	do {                                                                                              \
+		if (metrics_enabled) {                                                                        \
+			uint64_t metrics_end_var = metrics_now();                                                 \
+			metrics_record(histogram, metrics_end_var - (var));                                       \
+			if (metrics_tracing && (name)) metrics_trace_event(name, category, var, metrics_end_var); \
+		}                                                                                             \
+	} while (0)
+#endif
+#endif
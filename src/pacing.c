@@ -0,0 +1,45 @@
+#include "pacing.h"
+#include "util.h"
+#include <string.h>
+#include <math.h>
+
+#define PACING_BAND 0.25       // the steps are kept while they take within this fraction of the budget either way
+#define PACING_RAISE_FRAMES 30 // frames in a row with room to spare before the steps are raised
+#define PACING_GROWTH 2        // most the steps are multiplied by at once, in case the room was a fluke
+
+static int pacing_clamp(const struct pacing *pacing, double steps) {
+	return fmin(fmax(steps, pacing->min_steps), pacing->max_steps);
+}
+
+void pacing_init(struct pacing *pacing, int steps, int min_steps, int max_steps, double budget) {
+	*pacing = (struct pacing) {.budget = budget, .min_steps = min_steps, .max_steps = max_steps};
+	pacing->steps = pacing_clamp(pacing, steps);
+}
+
+static double pacing_median(const struct pacing *pacing) {
+	double sorted[PACING_WINDOW];
+	size_t len = pacing->costs_len;
+	memcpy(sorted, pacing->costs, len * sizeof(*sorted));
+	// insertion sort, it's a handful of items
+	for (size_t i = 1; i < len; ++i)
+		for (size_t j = i; j > 0 && sorted[j - 1] > sorted[j]; --j) SWAP(double, sorted[j - 1], sorted[j]);
+	return len % 2 ? sorted[len / 2] : (sorted[len / 2 - 1] + sorted[len / 2]) / 2;
+}
+
+void pacing_update(struct pacing *pacing, uint64_t elapsed) {
+	if (pacing->costs_len == PACING_WINDOW) memmove(pacing->costs, pacing->costs + 1, --pacing->costs_len * sizeof(*pacing->costs));
+	pacing->costs[pacing->costs_len++] = (double) elapsed / pacing->steps;
+	pacing->step_ns = pacing_median(pacing);
+	pacing->utilisation = elapsed / pacing->budget;
+
+	double target = pacing->budget / pacing->step_ns;
+	if (target < pacing->steps * (1 - PACING_BAND)) {
+		pacing->steps = pacing_clamp(pacing, target);
+		pacing->raise_frames = 0;
+	} else if (target > pacing->steps * (1 + PACING_BAND)) {
+		if (++pacing->raise_frames < PACING_RAISE_FRAMES) return;
+		pacing->steps = pacing_clamp(pacing, fmin(target, (double) pacing->steps * PACING_GROWTH));
+		pacing->raise_frames = 0;
+	} else
+		pacing->raise_frames = 0;
+}
@@ -0,0 +1,27 @@
+#ifndef PACING_H
+#define PACING_H
+#include <stdint.h>
+#include <stddef.h>
+
+#define PACING_WINDOW 8 // frames the cost of a step is the median of, so a frame delayed by something else doesn't move the steps
+
+// chooses the integration steps of each frame so they take about a budget of time, from the cost of a step measured as it runs,
+// so a fast machine spends its spare time on smaller, more accurate steps and a loaded one takes fewer before frames are dropped
+// the steps are lowered as soon as they would overrun the budget, but only raised once there has been room for more for a while
+struct pacing {
+	double budget; // nanoseconds of stepping per frame aimed for
+	int min_steps, max_steps;
+	int steps;          // of the next frame
+	double step_ns;     // cost of a step, 0 until measured
+	double utilisation; // of the budget by the last frame's steps
+	int raise_frames;   // frames in a row with room for more steps
+
+	double costs[PACING_WINDOW]; // of a step in the latest frames, oldest first once full
+	size_t costs_len;
+};
+
+// steps is what the first frame takes
+void pacing_init(struct pacing *pacing, int steps, int min_steps, int max_steps, double budget);
+// records that the last frame's steps took elapsed nanoseconds, choosing the steps of the next frame
+void pacing_update(struct pacing *pacing, uint64_t elapsed);
+#endif
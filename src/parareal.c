@@ -0,0 +1,131 @@
+#include "parareal.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+struct parareal_worker {
+	pthread_t thread;
+	bool started, failed;
+	const struct sim_simulation *sim;
+	const double *args; // for the variables
+	const double *starts;
+	double *ends;
+	size_t start, end; // slices
+	int steps;
+	double time_span;
+};
+
+// integrates state (SIM_STATE_LEN items) into out with args holding the variables, which is overwritten
+static bool parareal_propagate(const struct sim_simulation *sim, double *args, const double *state, double *out, int steps, double time_span) {
+	size_t state_len = SIM_STATE_LEN(sim);
+	memcpy(args + sim->internal_coordinates_start, state, state_len * sizeof(*state));
+	if (!sim_integrate(sim, args, steps, time_span, NULL, NULL)) return false;
+	memcpy(out, args + sim->internal_coordinates_start, state_len * sizeof(*out));
+	return true;
+}
+
+static void *parareal_worker_func(void *data) {
+	struct parareal_worker *worker = data;
+	const struct sim_simulation *sim = worker->sim;
+	size_t state_len = SIM_STATE_LEN(sim);
+	double args[sim->internal_args_len];
+	memcpy(args, worker->args, sizeof(args));
+	for (size_t i = worker->start; i < worker->end; ++i)
+		if (!parareal_propagate(sim, args, worker->starts + i * state_len, worker->ends + i * state_len, worker->steps, worker->time_span)) {
+			worker->failed = true;
+			break;
+		}
+	return NULL;
+}
+
+// fine propagation of slices first to slices - 1, as contiguous ranges on each thread
+static bool parareal_fine(const struct sim_simulation *sim, const double *args, const struct parareal_spec *spec, size_t first,
+                          const double *starts, double *ends, double time_span) {
+	size_t slices = spec->slices - first;
+	unsigned threads = spec->threads ? spec->threads : 1;
+	if (threads > slices) threads = slices;
+
+	struct parareal_worker workers[threads];
+	for (unsigned i = 0; i < threads; ++i) {
+		workers[i] = (struct parareal_worker) {
+		        .sim = sim,
+		        .args = args,
+		        .starts = starts,
+		        .ends = ends,
+		        .start = first + slices * i / threads,
+		        .end = first + slices * (i + 1) / threads,
+		        .steps = spec->fine_steps,
+		        .time_span = time_span,
+		};
+		if (i > 0) workers[i].started = !pthread_create(&workers[i].thread, NULL, parareal_worker_func, &workers[i]);
+	}
+	for (unsigned i = 0; i < threads; ++i)
+		if (!workers[i].started) parareal_worker_func(&workers[i]);
+
+	bool res = true;
+	for (unsigned i = 0; i < threads; ++i) {
+		if (workers[i].started) pthread_join(workers[i].thread, NULL);
+		if (workers[i].failed) res = false;
+	}
+	return res;
+}
+
+bool parareal_integrate(const struct sim_simulation *sim, double *args, double time_span, const struct parareal_spec *spec, double *boundaries, struct parareal_stats *stats) {
+	bool res = false;
+	size_t state_len = SIM_STATE_LEN(sim), slices = spec->slices;
+	if (!slices || spec->fine_steps < 1 || spec->coarse_steps < 1 || time_span <= 0) return false;
+	int max_iterations = spec->max_iterations > 0 && (size_t) spec->max_iterations < slices ? spec->max_iterations : (int) slices;
+	double slice_span = time_span / slices;
+	double propagate_args[sim->internal_args_len], next[state_len];
+	memcpy(propagate_args, args, sizeof(propagate_args));
+
+	// u holds the state at each slice boundary, coarse and fine the end of each slice propagated from its start in the previous iteration
+	double *u = boundaries, *coarse = NULL, *fine = NULL;
+	ASSERT(u || (u = malloc((slices + 1) * state_len * sizeof(*u))));
+	ASSERT(coarse = malloc(slices * state_len * sizeof(*coarse)));
+	ASSERT(fine = malloc(slices * state_len * sizeof(*fine)));
+
+	// initial guess from the coarse propagator alone
+	memcpy(u, args + sim->internal_coordinates_start, state_len * sizeof(*u));
+	for (size_t n = 0; n < slices; ++n) {
+		ASSERT(parareal_propagate(sim, propagate_args, u + n * state_len, coarse + n * state_len, spec->coarse_steps, slice_span));
+		memcpy(u + (n + 1) * state_len, coarse + n * state_len, state_len * sizeof(*u));
+	}
+
+	struct parareal_stats local_stats;
+	if (!stats) stats = &local_stats;
+	*stats = (struct parareal_stats) {.change = INFINITY};
+	for (int iteration = 1; iteration <= max_iterations; ++iteration) {
+		// the first slices start from exact states, one more each iteration, so they are already done
+		size_t first = iteration - 1;
+		ASSERT(parareal_fine(sim, args, spec, first, u, fine, slice_span));
+
+		// correct the boundaries in order: U[n + 1] = G(U[n]) + F(U_old[n]) - G(U_old[n])
+		double change = 0;
+		for (size_t n = first; n < slices; ++n) {
+			ASSERT(parareal_propagate(sim, propagate_args, u + n * state_len, next, spec->coarse_steps, slice_span));
+			double *boundary = u + (n + 1) * state_len;
+			for (size_t i = 0; i < state_len; ++i) {
+				double value = next[i] + fine[n * state_len + i] - coarse[n * state_len + i];
+				ASSERT(isfinite(value));
+				change = fmax(change, fabs(value - boundary[i]) / (1 + fabs(value)));
+				boundary[i] = value;
+			}
+			memcpy(coarse + n * state_len, next, sizeof(next));
+		}
+
+		stats->iterations = iteration;
+		stats->change = change;
+		if (change <= spec->tolerance) break;
+	}
+
+	memcpy(args + sim->internal_coordinates_start, u + slices * state_len, state_len * sizeof(*args));
+	res = true;
+fail:
+	if (u != boundaries) free(u);
+	free(coarse);
+	free(fine);
+	return res;
+}
@@ -0,0 +1,30 @@
+#ifndef PARAREAL_H
+#define PARAREAL_H
+#include "sim.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+struct parareal_spec {
+	size_t slices; // of the time span, each integrated by the fine propagator on one of the threads
+	unsigned threads;
+
+	int fine_steps;   // steps of the accurate propagator per slice
+	int coarse_steps; // steps of the cheap propagator per slice, swept serially over the whole time span every iteration
+
+	// converged once no slice boundary moves by more than tolerance (relative to 1 + its magnitude) in an iteration,
+	// or after max_iterations, 0 for slices, after which the result always equals the serial fine integration
+	double tolerance;
+	int max_iterations;
+};
+
+struct parareal_stats {
+	int iterations;
+	double change; // largest relative change of a slice boundary in the last iteration
+};
+
+// integrates the state in args over time_span with Parareal (Lions, Maday & Turinici 2001)
+// the coarse and fine propagators are sim_integrate with coarse_steps and fine_steps, so this suits the fixed-step integrators,
+// and the fine ones run in parallel only with the LLVM backend, as the lambda backend serialises the calls
+// args is advanced to the final state, boundaries is NULL or has room for (slices + 1) * SIM_STATE_LEN(sim) items to receive the state at each
+bool parareal_integrate(const struct sim_simulation *sim, double *args, double time_span, const struct parareal_spec *spec, double *boundaries, struct parareal_stats *stats);
+#endif
@@ -0,0 +1,565 @@
+#include "pipeline.h"
+#include "sweep.h"
+#include "linked_list.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+
+#define PIPELINE_SLOTS_PER_THREAD 64 // jobs in flight for each worker, so reading and writing them overlaps with integrating
+#define PIPELINE_FIELDS_MAX 64       // NDJSON keys resolved once and remembered, others are resolved for every job
+#define PIPELINE_ID_SIZE 64          // longest NDJSON id, with its terminator
+#define PIPELINE_OUTPUT_BUFFER (1 << 20)
+
+enum pipeline_field_kind {
+	PIPELINE_FIELD_ARG,
+	PIPELINE_FIELD_TIME,
+	PIPELINE_FIELD_STEPS,
+};
+
+struct pipeline_field {
+	char name[32];
+	enum pipeline_field_kind kind;
+	size_t arg; // index into args
+};
+
+struct pipeline_slot {
+	size_t job;
+	const char *error; // why the job failed, or NULL
+	char id[PIPELINE_ID_SIZE]; // JSON of the id, or empty
+
+	int steps;
+	double time_span;
+	double *args; // initial, then final variables and coordinates
+
+	double time;
+	double *energy;
+	unsigned long *event_counts; // crossings during the job
+	const char *stopped;         // name of the event which stopped the job, or NULL
+	size_t samples_len;
+	double *trajectory; // time then state of each sample
+
+	bool done;
+};
+
+// ring of slots, from the calling thread reading jobs to the workers, and back to the writer in order
+struct pipeline_context {
+	const struct sim_simulation *sim;
+	const struct pipeline_spec *spec;
+	FILE *out;
+	size_t args_len, state_len, energy_len, events_len;
+	double base_time, base_step_size;
+
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty, not_full, ready;
+	struct pipeline_slot *slots;
+	// jobs read, taken by the workers and written, so written <= taken <= read <= written + slots_len
+	size_t slots_len, read, taken, written, errors;
+	bool done, failed;
+};
+
+struct pipeline_worker {
+	pthread_t thread;
+	struct pipeline_context *ctx;
+	struct sim_state *state;
+};
+
+struct pipeline_reader {
+	const struct sim_simulation *sim;
+	FILE *in;
+	struct pipeline_field *fields, scratch;
+	size_t fields_len, fields_size;
+	char *line;
+	size_t line_size;
+	double *record;
+};
+
+static bool pipeline_resolve_field(const struct sim_simulation *sim, struct pipeline_field *field, const char *name) {
+	if (strlen(name) >= sizeof(field->name)) return false;
+	strcpy(field->name, name);
+	if (!strcmp(name, "time")) {
+		field->kind = PIPELINE_FIELD_TIME;
+		return true;
+	}
+	if (!strcmp(name, "steps")) {
+		field->kind = PIPELINE_FIELD_STEPS;
+		return true;
+	}
+	struct sweep_parameter param;
+	if (!sweep_parse_target(&param, name) || !sweep_resolve_parameters(sim, &param, 1, &field->arg)) return false;
+	field->kind = PIPELINE_FIELD_ARG;
+	return true;
+}
+
+// the fields of each binary record, from a comma separated list or every coordinate's position and velocity
+static bool pipeline_binary_fields(struct pipeline_reader *reader, const char *list) {
+	const struct sim_simulation *sim = reader->sim;
+	if (!list) {
+		reader->fields_size = SIM_STATE_LEN(sim);
+		if (!(reader->fields = calloc(reader->fields_size + 1, sizeof(*reader->fields)))) return false;
+		size_t body_i = 0;
+		LL_LOOP(struct sim_body *, body, sim->bodies) {
+			for (size_t i = 0; i < body->coordinates_len * 2; ++i) {
+				struct pipeline_field *field = &reader->fields[reader->fields_len];
+				snprintf(field->name, sizeof(field->name), "%s%zu.%zu", i % 2 ? "vel" : "pos", body_i, i / 2);
+				field->kind = PIPELINE_FIELD_ARG;
+				field->arg = sim->internal_coordinates_start + reader->fields_len++;
+			}
+			++body_i;
+		}
+		return true;
+	}
+
+	reader->fields_size = 1;
+	for (const char *c = list; *c; ++c) reader->fields_size += *c == ',';
+	if (!(reader->fields = calloc(reader->fields_size, sizeof(*reader->fields)))) return false;
+	char name[sizeof(reader->fields->name)];
+	for (const char *c = list;; ++c) {
+		size_t len = strcspn(c, ",");
+		if (len >= sizeof(name)) len = sizeof(name) - 1; // too long to be a field, so it fails to resolve
+		memcpy(name, c, len);
+		name[len] = '\0';
+		if (!pipeline_resolve_field(sim, &reader->fields[reader->fields_len++], name)) {
+			fprintf(stderr, "Unknown pipeline field: %s\n", name);
+			return false;
+		}
+		if (!(c = strchr(c, ','))) break;
+	}
+	return true;
+}
+
+// the NDJSON field of a key, remembering it to not parse and resolve it again, or NULL if it isn't one
+static const struct pipeline_field *pipeline_find_field(struct pipeline_reader *reader, const char *key, size_t key_len) {
+	char name[sizeof(reader->fields->name)];
+	if (key_len >= sizeof(name)) return NULL;
+	memcpy(name, key, key_len);
+	name[key_len] = '\0';
+	for (size_t i = 0; i < reader->fields_len; ++i)
+		if (!strcmp(reader->fields[i].name, name)) return &reader->fields[i];
+
+	struct pipeline_field *field = reader->fields_len < reader->fields_size ? &reader->fields[reader->fields_len] : &reader->scratch;
+	if (!pipeline_resolve_field(reader->sim, field, name)) return NULL;
+	if (field != &reader->scratch) ++reader->fields_len;
+	return field;
+}
+
+static void pipeline_apply(struct pipeline_slot *slot, const struct pipeline_field *field, double value) {
+	switch (field->kind) {
+		case PIPELINE_FIELD_ARG: slot->args[field->arg] = value; break;
+		case PIPELINE_FIELD_TIME: slot->time_span = value; break;
+		case PIPELINE_FIELD_STEPS: slot->steps = value >= 1 && value <= INT_MAX ? (int) value : 0; break;
+	}
+}
+
+static const char *pipeline_skip_space(const char *c) {
+	while (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n') ++c;
+	return c;
+}
+
+// past the closing quote of the JSON string starting at c, or NULL if it isn't closed
+static const char *pipeline_skip_string(const char *c) {
+	for (++c; *c != '"'; ++c) {
+		if (!*c) return NULL;
+		if (*c == '\\' && !*++c) return NULL;
+	}
+	return c + 1;
+}
+
+// parses a flat JSON object into the slot, returning why it couldn't, or NULL
+static const char *pipeline_parse_job(struct pipeline_reader *reader, struct pipeline_slot *slot, const char *c) {
+	c = pipeline_skip_space(c);
+	if (*c++ != '{') return "expected an object";
+	c = pipeline_skip_space(c);
+	if (*c != '}')
+		while (1) {
+			if (*c != '"') return "expected a key";
+			const char *key = c + 1, *key_end = pipeline_skip_string(c);
+			if (!key_end) return "unterminated string";
+			size_t key_len = key_end - 1 - key;
+			c = pipeline_skip_space(key_end);
+			if (*c++ != ':') return "expected a colon";
+			c = pipeline_skip_space(c);
+
+			if (key_len == 2 && !memcmp(key, "id", 2)) {
+				// copied into the results as is, so only a string or a finite number in JSON's characters (no nan, inf or hex)
+				const char *end;
+				if (*c == '"')
+					end = pipeline_skip_string(c);
+				else {
+					char *number_end;
+					double number = strtod(c, &number_end);
+					end = number_end > c && isfinite(number) && strspn(c, "0123456789+-.eE") >= (size_t) (number_end - c) ? number_end : NULL;
+				}
+				if (!end) return "invalid id";
+				if (end - c >= PIPELINE_ID_SIZE) return "id too long";
+				memcpy(slot->id, c, end - c);
+				slot->id[end - c] = '\0';
+				c = end;
+			} else {
+				const struct pipeline_field *field = pipeline_find_field(reader, key, key_len);
+				if (!field) return "unknown field";
+				char *end;
+				double value = strtod(c, &end);
+				if (end == c) return "expected a number";
+				pipeline_apply(slot, field, value);
+				c = end;
+			}
+
+			c = pipeline_skip_space(c);
+			if (*c == '}') break;
+			if (*c++ != ',') return "expected a comma";
+			c = pipeline_skip_space(c);
+		}
+	if (*pipeline_skip_space(c + 1)) return "trailing characters";
+	return NULL;
+}
+
+// reads the next job into the slot, returning 1, or 0 at the end of the input, or -1 if reading failed
+static int pipeline_read_job(struct pipeline_reader *reader, const struct pipeline_spec *spec, struct pipeline_slot *slot) {
+	if (spec->input == PIPELINE_BINARY) {
+		size_t read = fread(reader->record, sizeof(*reader->record), reader->fields_len, reader->in);
+		if (read != reader->fields_len) {
+			if (ferror(reader->in)) return -1;
+			if (read) fprintf(stderr, "Truncated pipeline job record\n");
+			return read ? -1 : 0;
+		}
+		for (size_t i = 0; i < reader->fields_len; ++i) pipeline_apply(slot, &reader->fields[i], reader->record[i]);
+		return 1;
+	}
+
+	while (1) {
+		ssize_t len = getline(&reader->line, &reader->line_size, reader->in);
+		if (len < 0) return ferror(reader->in) ? -1 : 0;
+		if (!*pipeline_skip_space(reader->line)) continue;
+		slot->error = pipeline_parse_job(reader, slot, reader->line);
+		return 1;
+	}
+}
+
+static void pipeline_integrate(struct pipeline_worker *worker, struct pipeline_slot *slot) {
+	struct pipeline_context *ctx = worker->ctx;
+	struct sim_state *state = worker->state;
+	size_t samples = ctx->spec->samples, segments = samples ? samples : 1, sample_len = 1 + ctx->state_len;
+	if (slot->error) return;
+	if (slot->steps <= 0 || (size_t) slot->steps < segments || !(slot->time_span > 0)) {
+		slot->error = "invalid steps or time";
+		return;
+	}
+
+	memcpy(state->args, slot->args, ctx->args_len * sizeof(*state->args));
+	state->time = ctx->base_time;
+	state->step_size = ctx->base_step_size;
+	memset(state->event_counts, 0, ctx->events_len * sizeof(*state->event_counts));
+
+	// each sample ends a segment of the steps and time
+	double *sample = slot->trajectory;
+	for (size_t k = 1; k <= segments; ++k) {
+		int steps = (size_t) slot->steps * k / segments - (size_t) slot->steps * (k - 1) / segments;
+		double time_span = slot->time_span * k / segments - slot->time_span * (k - 1) / segments;
+		if (!sim_state_step(state, steps, time_span)) {
+			slot->error = "integration failed";
+			return;
+		}
+		if (samples) {
+			*sample++ = state->time;
+			memcpy(sample, state->args + ctx->sim->internal_coordinates_start, ctx->state_len * sizeof(*sample));
+			sample += ctx->state_len;
+			++slot->samples_len;
+		}
+		if (state->out_event) {
+			slot->stopped = state->out_event->name;
+			break;
+		}
+	}
+	for (size_t i = slot->samples_len * sample_len; i < samples * sample_len; ++i) slot->trajectory[i] = NAN;
+
+	memcpy(slot->args, state->args, ctx->args_len * sizeof(*slot->args));
+	slot->time = state->time;
+	memcpy(slot->energy, state->energy, ctx->energy_len * sizeof(*slot->energy));
+	memcpy(slot->event_counts, state->event_counts, ctx->events_len * sizeof(*slot->event_counts));
+}
+
+static void *pipeline_worker_func(void *data) {
+	struct pipeline_worker *worker = data;
+	struct pipeline_context *ctx = worker->ctx;
+
+	while (1) {
+		pthread_mutex_lock(&ctx->lock);
+		while (ctx->taken == ctx->read && !ctx->done) pthread_cond_wait(&ctx->not_empty, &ctx->lock);
+		if (ctx->taken == ctx->read) {
+			pthread_mutex_unlock(&ctx->lock);
+			break;
+		}
+		struct pipeline_slot *slot = &ctx->slots[ctx->taken++ % ctx->slots_len];
+		pthread_mutex_unlock(&ctx->lock);
+
+		pipeline_integrate(worker, slot);
+
+		pthread_mutex_lock(&ctx->lock);
+		slot->done = true;
+		if (slot == &ctx->slots[ctx->written % ctx->slots_len]) pthread_cond_signal(&ctx->ready);
+		pthread_mutex_unlock(&ctx->lock);
+	}
+	return NULL;
+}
+
+// JSON has no NaN or infinities
+static void pipeline_write_number(FILE *out, double value) {
+	if (isfinite(value))
+		fprintf(out, "%.17g", value);
+	else
+		fputs("null", out);
+}
+
+static void pipeline_write_array(FILE *out, const double *values, size_t len) {
+	fputc('[', out);
+	for (size_t i = 0; i < len; ++i) {
+		if (i) fputc(',', out);
+		pipeline_write_number(out, values[i]);
+	}
+	fputc(']', out);
+}
+
+static void pipeline_write_string(FILE *out, const char *str) {
+	fputc('"', out);
+	for (; *str; ++str) {
+		if (*str == '"' || *str == '\\') fputc('\\', out);
+		if ((unsigned char) *str < 0x20)
+			fprintf(out, "\\u%04x", *str);
+		else
+			fputc(*str, out);
+	}
+	fputc('"', out);
+}
+
+static bool pipeline_write_result(struct pipeline_context *ctx, const struct pipeline_slot *slot, double *record) {
+	FILE *out = ctx->out;
+	size_t state_len = ctx->state_len, samples = ctx->spec->samples;
+
+	if (ctx->spec->output == PIPELINE_BINARY) {
+		size_t record_len = 1 + state_len + ctx->energy_len + ctx->events_len + samples * (1 + state_len);
+		if (slot->error) {
+			for (size_t i = 0; i < record_len; ++i) record[i] = NAN;
+		} else {
+			double *value = record;
+			*value++ = slot->time;
+			memcpy(value, slot->args + ctx->sim->internal_coordinates_start, state_len * sizeof(*value));
+			value += state_len;
+			memcpy(value, slot->energy, ctx->energy_len * sizeof(*value));
+			value += ctx->energy_len;
+			for (size_t e = 0; e < ctx->events_len; ++e) *value++ = slot->event_counts[e];
+			memcpy(value, slot->trajectory, samples * (1 + state_len) * sizeof(*value));
+		}
+		return fwrite(record, sizeof(*record), record_len, out) == record_len;
+	}
+
+	fprintf(out, "{\"job\":%zu", slot->job);
+	if (slot->id[0]) fprintf(out, ",\"id\":%s", slot->id);
+	if (slot->error) {
+		fputs(",\"error\":", out);
+		pipeline_write_string(out, slot->error);
+	} else {
+		fputs(",\"time\":", out);
+		pipeline_write_number(out, slot->time);
+		fputs(",\"state\":", out);
+		pipeline_write_array(out, slot->args + ctx->sim->internal_coordinates_start, state_len);
+		fputs(",\"energy\":", out);
+		pipeline_write_array(out, slot->energy, ctx->energy_len);
+		fputs(",\"events\":[", out);
+		for (size_t e = 0; e < ctx->events_len; ++e) fprintf(out, e ? ",%lu" : "%lu", slot->event_counts[e]);
+		fputc(']', out);
+		if (slot->stopped) {
+			fputs(",\"stopped\":", out);
+			pipeline_write_string(out, slot->stopped);
+		}
+		if (samples) {
+			fputs(",\"trajectory\":[", out);
+			for (size_t i = 0; i < slot->samples_len; ++i) {
+				if (i) fputc(',', out);
+				pipeline_write_array(out, slot->trajectory + i * (1 + state_len), 1 + state_len);
+			}
+			fputc(']', out);
+		}
+	}
+	fputs("}\n", out);
+	return !ferror(out);
+}
+
+// writes the results in the order the jobs were read, as each becomes the oldest one done
+static void *pipeline_writer_func(void *data) {
+	struct pipeline_context *ctx = data;
+	double *record = calloc(1 + ctx->state_len + ctx->energy_len + ctx->events_len + ctx->spec->samples * (1 + ctx->state_len), sizeof(*record));
+
+	pthread_mutex_lock(&ctx->lock);
+	if (!record) ctx->failed = true;
+	while (1) {
+		struct pipeline_slot *slot = &ctx->slots[ctx->written % ctx->slots_len];
+		while (!slot->done && !(ctx->done && ctx->written == ctx->read)) pthread_cond_wait(&ctx->ready, &ctx->lock);
+		if (!slot->done) break;
+		// after failing, the results are only discarded, so the calling thread doesn't wait for room forever
+		bool failed = ctx->failed;
+		pthread_mutex_unlock(&ctx->lock);
+
+		bool ok = failed || pipeline_write_result(ctx, slot, record);
+
+		pthread_mutex_lock(&ctx->lock);
+		if (!ok) ctx->failed = true;
+		if (slot->error) ++ctx->errors;
+		slot->done = false;
+		++ctx->written;
+		pthread_cond_signal(&ctx->not_full);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (fflush(ctx->out)) {
+		pthread_mutex_lock(&ctx->lock);
+		ctx->failed = true;
+		pthread_mutex_unlock(&ctx->lock);
+	}
+	free(record);
+	return NULL;
+}
+
+bool pipeline_run(const struct sim_simulation *sim, const struct pipeline_spec *spec, FILE *in, FILE *out, volatile sig_atomic_t *cancel) {
+	bool res = false, lock = false, conds = false, read_failed = false;
+	unsigned threads = spec->threads ? spec->threads : 1, started = 0;
+	struct pipeline_context ctx = {.sim = sim, .spec = spec, .out = out};
+	struct pipeline_reader reader = {.sim = sim, .in = in};
+	struct pipeline_worker *workers = NULL;
+	pthread_t writer;
+	double *base_args = NULL;
+
+	ASSERT(sim->internal_model);
+	ctx.args_len = sim->internal_args_len;
+	ctx.state_len = SIM_STATE_LEN(sim);
+	ctx.energy_len = SIM_ENERGY_LEN(sim);
+	ctx.events_len = sim->internal_model->events_len;
+	ctx.base_time = sim->time;
+	ctx.base_step_size = sim->internal_step_size;
+
+	if (spec->input == PIPELINE_BINARY) {
+		if (!pipeline_binary_fields(&reader, spec->fields)) goto fail;
+		ASSERT(reader.record = calloc(reader.fields_len + 1, sizeof(*reader.record)));
+	} else {
+		reader.fields_size = PIPELINE_FIELDS_MAX;
+		ASSERT(reader.fields = calloc(reader.fields_size, sizeof(*reader.fields)));
+	}
+	if (spec->output == PIPELINE_BINARY)
+		fprintf(stderr, "Pipeline results are records of %zu doubles: time, %zu state, %zu energy, %zu event counts, %zu samples of time and state\n",
+		        1 + ctx.state_len + ctx.energy_len + ctx.events_len + spec->samples * (1 + ctx.state_len), ctx.state_len, ctx.energy_len,
+		        ctx.events_len, spec->samples);
+	setvbuf(out, NULL, _IOFBF, PIPELINE_OUTPUT_BUFFER);
+
+	ASSERT(!pthread_mutex_init(&ctx.lock, NULL));
+	lock = true;
+	ASSERT(!pthread_cond_init(&ctx.not_empty, NULL));
+	if (pthread_cond_init(&ctx.not_full, NULL)) {
+		pthread_cond_destroy(&ctx.not_empty);
+		goto fail;
+	}
+	if (pthread_cond_init(&ctx.ready, NULL)) {
+		pthread_cond_destroy(&ctx.not_empty);
+		pthread_cond_destroy(&ctx.not_full);
+		goto fail;
+	}
+	conds = true;
+
+	// every buffer is allocated once, so memory doesn't grow with the jobs
+	ASSERT(base_args = calloc(ctx.args_len, sizeof(*base_args)));
+	sim_pack_args(sim, base_args);
+	ctx.slots_len = threads * PIPELINE_SLOTS_PER_THREAD;
+	ASSERT(ctx.slots = calloc(ctx.slots_len, sizeof(*ctx.slots)));
+	for (size_t i = 0; i < ctx.slots_len; ++i) {
+		struct pipeline_slot *slot = &ctx.slots[i];
+		ASSERT(slot->args = calloc(ctx.args_len, sizeof(*slot->args)));
+		ASSERT(slot->energy = calloc(ctx.energy_len + 1, sizeof(*slot->energy)));
+		ASSERT(slot->event_counts = calloc(ctx.events_len + 1, sizeof(*slot->event_counts)));
+		ASSERT(slot->trajectory = calloc(spec->samples * (1 + ctx.state_len) + 1, sizeof(*slot->trajectory)));
+	}
+	ASSERT(workers = calloc(threads, sizeof(*workers)));
+	for (unsigned i = 0; i < threads; ++i) {
+		workers[i].ctx = &ctx;
+		ASSERT(workers[i].state = sim_state_new(sim));
+	}
+
+	for (; started < threads; ++started)
+		if (pthread_create(&workers[started].thread, NULL, pipeline_worker_func, &workers[started])) break;
+	if (started == 0 || pthread_create(&writer, NULL, pipeline_writer_func, &ctx)) {
+		fprintf(stderr, "Failed to start pipeline threads\n");
+		pthread_mutex_lock(&ctx.lock);
+		ctx.done = true;
+		pthread_cond_broadcast(&ctx.not_empty);
+		pthread_mutex_unlock(&ctx.lock);
+		for (unsigned i = 0; i < started; ++i) pthread_join(workers[i].thread, NULL);
+		goto fail;
+	}
+
+	// this thread reads the jobs into the free slots, in order
+	while (!*cancel) {
+		pthread_mutex_lock(&ctx.lock);
+		while (ctx.read - ctx.written == ctx.slots_len && !ctx.failed) pthread_cond_wait(&ctx.not_full, &ctx.lock);
+		bool failed = ctx.failed;
+		pthread_mutex_unlock(&ctx.lock);
+		if (failed) break;
+
+		struct pipeline_slot *slot = &ctx.slots[ctx.read % ctx.slots_len];
+		slot->job = ctx.read;
+		slot->error = slot->stopped = NULL;
+		slot->id[0] = '\0';
+		slot->steps = spec->steps;
+		slot->time_span = spec->time_span;
+		slot->samples_len = 0;
+		memcpy(slot->args, base_args, ctx.args_len * sizeof(*base_args));
+		int read = pipeline_read_job(&reader, spec, slot);
+		if (read <= 0) {
+			// interrupted reads end the input like cancelling
+			read_failed = read < 0 && !*cancel;
+			break;
+		}
+
+		pthread_mutex_lock(&ctx.lock);
+		++ctx.read;
+		pthread_cond_signal(&ctx.not_empty);
+		pthread_mutex_unlock(&ctx.lock);
+	}
+
+	pthread_mutex_lock(&ctx.lock);
+	ctx.done = true;
+	pthread_cond_broadcast(&ctx.not_empty);
+	pthread_cond_broadcast(&ctx.ready);
+	pthread_mutex_unlock(&ctx.lock);
+	for (unsigned i = 0; i < started; ++i) pthread_join(workers[i].thread, NULL);
+	pthread_join(writer, NULL);
+
+	fprintf(stderr, "Pipeline ran %zu jobs, %zu failed\n", ctx.written, ctx.errors);
+	if (read_failed) fprintf(stderr, "Failed to read pipeline jobs\n");
+	if (ctx.failed) fprintf(stderr, "Failed to write pipeline results\n");
+	ASSERT(!read_failed && !ctx.failed);
+
+	res = true;
+fail:
+	if (workers)
+		for (unsigned i = 0; i < threads; ++i) sim_state_free(workers[i].state);
+	free(workers);
+	if (ctx.slots)
+		for (size_t i = 0; i < ctx.slots_len; ++i) {
+			free(ctx.slots[i].args);
+			free(ctx.slots[i].energy);
+			free(ctx.slots[i].event_counts);
+			free(ctx.slots[i].trajectory);
+		}
+	free(ctx.slots);
+	free(base_args);
+	free(reader.fields);
+	free(reader.line);
+	free(reader.record);
+	if (conds) {
+		pthread_cond_destroy(&ctx.not_empty);
+		pthread_cond_destroy(&ctx.not_full);
+		pthread_cond_destroy(&ctx.ready);
+	}
+	if (lock) pthread_mutex_destroy(&ctx.lock);
+	return res;
+}
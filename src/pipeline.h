@@ -0,0 +1,41 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+#include "sim.h"
+#include <stdio.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+enum pipeline_format {
+	PIPELINE_NDJSON, // one JSON object per line
+	PIPELINE_BINARY, // fixed-size records of native doubles
+};
+
+// a stream of jobs, each integrating the compiled simulation from its initial state with some of its variables and coordinates
+// overridden, to a stream of results in the same order
+//
+// NDJSON jobs are flat objects of sweep targets (see sweep.h) to their values, e.g. {"id":7,"sim.0":9.8,"pos0.0":1.5}, where
+// "time" and "steps" override time_span and steps, and "id" (a string or number) is copied to the result
+// binary jobs are records of the doubles of fields in order
+//
+// NDJSON results are {"job":<index>,"id":...,"time":...,"state":[...],"energy":[...],"events":[...],"trajectory":[[...],...]},
+// with "stopped":<name> when an event stopped the integration early, or {"job":<index>,"error":<message>} if it failed
+// binary results are records of the time, the state, energies, event counts, then the time and state of each sample,
+// all NaN if it failed, and samples after an event stopped it NaN too
+struct pipeline_spec {
+	enum pipeline_format input, output;
+	// comma separated targets of the doubles of each binary job, which may also be "time" or "steps", NULL for the whole state
+	const char *fields;
+
+	int steps;        // integration steps per job
+	double time_span; // simulated time per job
+	size_t samples;   // states in the trajectory of each result, evenly spaced in time and ending at the final state
+
+	unsigned threads; // each integrates whole jobs, while the calling thread reads them and another writes the results
+};
+
+// runs every job read from in, writing the results to out, cancel stops reading (finishing the jobs already read) once it becomes non-zero
+// the callbacks of events are called from the worker threads
+// memory doesn't grow with the jobs, as they are read, integrated and written through a fixed number of slots
+bool pipeline_run(const struct sim_simulation *sim, const struct pipeline_spec *spec, FILE *in, FILE *out, volatile sig_atomic_t *cancel);
+#endif
@@ -0,0 +1,313 @@
+#include "poincare.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+
+#define POINCARE_CHUNK_STEPS 256      // steps integrated at once, bounds the trajectory buffer
+#define POINCARE_FLUSH_RECORDS 1024   // crossings buffered by each worker before writing them out
+#define POINCARE_LIVE_POINTS (1 << 16) // latest crossings kept for the live plot
+#define POINCARE_LIVE_INTERVAL 33333333      // nanoseconds between live plot frames
+#define POINCARE_PROGRESS_INTERVAL 250000000 // nanoseconds between progress updates otherwise
+
+bool poincare_parse_section(struct poincare_spec *spec, const char *str) {
+	const char *equals = strchr(str, '=');
+	char name[sizeof(spec->section.name)];
+	if (!equals || equals - str >= (long) sizeof(name)) return false;
+	memcpy(name, str, equals - str);
+	name[equals - str] = '\0';
+	if (!sweep_parse_target(&spec->section, name)) return false;
+	if (spec->section.target != SWEEP_POSITION && spec->section.target != SWEEP_VELOCITY) return false;
+
+	int n = 0;
+	if (sscanf(equals + 1, "%lf%n", &spec->value, &n) != 1) return false;
+	const char *direction = equals + 1 + n;
+	spec->direction = 0;
+	if (!strcmp(direction, ":+")) spec->direction = 1;
+	else if (!strcmp(direction, ":-")) spec->direction = -1;
+	else if (*direction) return false;
+	return true;
+}
+
+bool poincare_parse_plane(struct poincare_spec *spec, const char *str) {
+	const char *comma = strchr(str, ',');
+	char name[sizeof(spec->plane[0].name)];
+	if (!comma || comma - str >= (long) sizeof(name)) return false;
+	memcpy(name, str, comma - str);
+	name[comma - str] = '\0';
+	if (!sweep_parse_target(&spec->plane[0], name) || !sweep_parse_target(&spec->plane[1], comma + 1)) return false;
+	for (int i = 0; i < 2; ++i)
+		if (spec->plane[i].target != SWEEP_POSITION && spec->plane[i].target != SWEEP_VELOCITY) return false;
+	return true;
+}
+
+struct poincare_context {
+	const struct sim_simulation *sim;
+	const struct poincare_spec *spec;
+	volatile sig_atomic_t *cancel;
+
+	// indices into the state, rather than the args
+	size_t section_i, plane_i[2];
+	bool section_wraps, plane_wraps[2];
+
+	const double *base_args;
+	size_t *param_args, trajectories;
+	atomic_size_t next, done;
+	atomic_uint running;
+	atomic_bool failed;
+
+	pthread_mutex_t lock; // protects everything below
+	FILE *file;
+	bool csv;
+	uint64_t crossings;
+	double (*live)[2], live_min[2], live_max[2];
+	size_t live_len, live_next;
+	char info[256];
+};
+
+struct poincare_worker {
+	pthread_t thread;
+	struct poincare_context *ctx;
+	double *args, *scratch, *trajectory, *f0, *f1;
+	size_t records_len;
+	struct poincare_record records[POINCARE_FLUSH_RECORDS];
+};
+
+static double section_value(const struct poincare_context *ctx, double x) {
+	x -= ctx->spec->value;
+	return ctx->section_wraps ? remainder(x, 2 * M_PI) : x;
+}
+
+struct poincare_root {
+	const struct poincare_context *ctx;
+	const double *y0, *y1, *f0, *f1;
+	double dt;
+};
+
+// section coordinate on the step's interpolant, relative to the section, wrapped by sim_find_root for angles
+static double poincare_root_func(double theta, void *custom) {
+	const struct poincare_root *root = custom;
+	return sim_hermite(root->y0, root->y1, root->f0, root->f1, root->dt, theta, root->ctx->section_i) - root->ctx->spec->value;
+}
+
+static bool crosses(const struct poincare_context *ctx, double g0, double g1) {
+	if (ctx->section_wraps && fabs(g1 - g0) > M_PI) return false; // wrapped around the far side rather than crossing
+	if (g0 < 0 && g1 >= 0) return ctx->spec->direction >= 0;
+	if (g0 > 0 && g1 <= 0) return ctx->spec->direction <= 0;
+	return false;
+}
+
+static bool poincare_flush(struct poincare_worker *worker) {
+	struct poincare_context *ctx = worker->ctx;
+	bool res = true;
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->csv) {
+		for (size_t i = 0; i < worker->records_len && res; ++i) {
+			const struct poincare_record *record = &worker->records[i];
+			res = fprintf(ctx->file, "%" PRIu64 ",%.17g,%.17g,%.17g\n", record->trajectory, record->time, record->x, record->y) > 0;
+		}
+	} else
+		res = fwrite(worker->records, sizeof(*worker->records), worker->records_len, ctx->file) == worker->records_len;
+
+	if (ctx->live)
+		for (size_t i = 0; i < worker->records_len; ++i) {
+			double point[2] = {worker->records[i].x, worker->records[i].y};
+			for (int k = 0; k < 2; ++k) {
+				if (!ctx->crossings && !i) ctx->live_min[k] = ctx->live_max[k] = point[k];
+				ctx->live_min[k] = fmin(ctx->live_min[k], point[k]);
+				ctx->live_max[k] = fmax(ctx->live_max[k], point[k]);
+				ctx->live[ctx->live_next][k] = point[k];
+			}
+			ctx->live_next = (ctx->live_next + 1) % POINCARE_LIVE_POINTS;
+			if (ctx->live_len < POINCARE_LIVE_POINTS) ++ctx->live_len;
+		}
+	ctx->crossings += worker->records_len;
+	pthread_mutex_unlock(&ctx->lock);
+	worker->records_len = 0;
+	return res;
+}
+
+static bool poincare_trajectory(struct poincare_worker *worker, size_t trajectory) {
+	struct poincare_context *ctx = worker->ctx;
+	const struct sim_simulation *sim = ctx->sim;
+	const struct sweep_spec *trajectories = ctx->spec->trajectories;
+	size_t state_len = SIM_STATE_LEN(sim), start = sim->internal_coordinates_start;
+
+	memcpy(worker->args, ctx->base_args, sim->internal_args_len * sizeof(*worker->args));
+	for (size_t i = 0; i < trajectories->parameters_len; ++i)
+		worker->args[ctx->param_args[i]] = sweep_grid_value(trajectories, trajectory, i);
+	memcpy(worker->scratch, worker->args, sim->internal_args_len * sizeof(*worker->args));
+
+	double dt = trajectories->time_span / trajectories->steps, step_size = 0;
+	for (int step = 0; step < trajectories->steps; step += POINCARE_CHUNK_STEPS) {
+		if (*ctx->cancel || atomic_load_explicit(&ctx->failed, memory_order_relaxed)) break;
+		int steps = trajectories->steps - step < POINCARE_CHUNK_STEPS ? trajectories->steps - step : POINCARE_CHUNK_STEPS;
+		if (!sim_integrate(sim, worker->args, steps, steps * dt, worker->trajectory, &step_size)) return false;
+
+		double g0 = section_value(ctx, worker->trajectory[ctx->section_i]);
+		for (int j = 1; j <= steps; ++j) {
+			const double *y0 = worker->trajectory + (j - 1) * state_len, *y1 = y0 + state_len;
+			double g1 = section_value(ctx, y1[ctx->section_i]), ga = g0, gb = g1;
+			g0 = g1;
+			if (!crosses(ctx, ga, gb)) continue;
+
+			memcpy(worker->scratch + start, y0, state_len * sizeof(*y0));
+			sim_dydt(sim, worker->scratch, worker->f0);
+			memcpy(worker->scratch + start, y1, state_len * sizeof(*y1));
+			sim_dydt(sim, worker->scratch, worker->f1);
+
+			struct poincare_root root = {.ctx = ctx, .y0 = y0, .y1 = y1, .f0 = worker->f0, .f1 = worker->f1, .dt = dt};
+			double theta = sim_find_root(poincare_root_func, &root, ga, gb, ctx->section_wraps);
+
+			struct poincare_record *record = &worker->records[worker->records_len++];
+			record->trajectory = trajectory;
+			record->time = sim->time + (step + j - 1 + theta) * dt;
+			double *plane[2] = {&record->x, &record->y};
+			for (int k = 0; k < 2; ++k) {
+				*plane[k] = sim_hermite(y0, y1, worker->f0, worker->f1, dt, theta, ctx->plane_i[k]);
+				if (ctx->plane_wraps[k]) *plane[k] = remainder(*plane[k], 2 * M_PI);
+			}
+			if (worker->records_len == POINCARE_FLUSH_RECORDS && !poincare_flush(worker)) return false;
+		}
+	}
+	return true;
+}
+
+static void *poincare_worker_func(void *data) {
+	struct poincare_worker *worker = data;
+	struct poincare_context *ctx = worker->ctx;
+	while (!atomic_load_explicit(&ctx->failed, memory_order_relaxed) && !*ctx->cancel) {
+		size_t trajectory = atomic_fetch_add_explicit(&ctx->next, 1, memory_order_relaxed);
+		if (trajectory >= ctx->trajectories) break;
+		if (!poincare_trajectory(worker, trajectory)) atomic_store(&ctx->failed, true);
+		atomic_fetch_add(&ctx->done, 1);
+	}
+	if (!poincare_flush(worker)) atomic_store(&ctx->failed, true);
+	atomic_fetch_sub(&ctx->running, 1);
+	return NULL;
+}
+
+static bool poincare_render(struct display_screen screen, void *data) {
+	struct poincare_context *ctx = data;
+	pthread_mutex_lock(&ctx->lock);
+	double scale[2];
+	for (int k = 0; k < 2; ++k) scale[k] = ctx->live_max[k] > ctx->live_min[k] ? 1 / (ctx->live_max[k] - ctx->live_min[k]) : 0;
+	for (size_t i = 0; i < ctx->live_len; ++i) {
+		struct poss cell = POSS((ctx->live[i][0] - ctx->live_min[0]) * scale[0] * (screen.w - 1),
+		                        (ctx->live_max[1] - ctx->live[i][1]) * scale[1] * (screen.h - 1));
+		DISPLAY_SET_CELL(cell, 1, screen);
+	}
+	snprintf(ctx->info, sizeof(ctx->info), "Poincaré section %s: %zu/%zu trajectories, %" PRIu64 " crossings\n%s: %.3f to %.3f, %s: %.3f to %.3f",
+	         ctx->spec->section.name, atomic_load(&ctx->done), ctx->trajectories, ctx->crossings,
+	         ctx->spec->plane[0].name, ctx->live_min[0], ctx->live_max[0], ctx->spec->plane[1].name, ctx->live_min[1], ctx->live_max[1]);
+	pthread_mutex_unlock(&ctx->lock);
+	return true;
+}
+
+bool poincare_run(const struct sim_simulation *sim, const struct poincare_spec *spec, struct display_data *display, volatile sig_atomic_t *cancel) {
+	bool res = false, lock = false;
+	const struct sweep_spec *trajectories = spec->trajectories;
+	struct poincare_context ctx = {.sim = sim, .spec = spec, .cancel = cancel, .trajectories = 1};
+	struct poincare_worker *workers = NULL;
+	double *base_args = NULL;
+	unsigned threads = trajectories->threads ? trajectories->threads : 1, started = 0;
+	size_t state_len = SIM_STATE_LEN(sim), coordinate_args[3];
+
+	if (trajectories->steps < 1 || trajectories->time_span <= 0 || !sim->internal_model) return false;
+	if (trajectories->sampling != SWEEP_GRID) return false;
+	for (size_t i = 0; i < trajectories->parameters_len; ++i) {
+		if (trajectories->parameters[i].count > SIZE_MAX / ctx.trajectories) return false; // overflow
+		ctx.trajectories *= trajectories->parameters[i].count;
+	}
+	if (threads > ctx.trajectories) threads = ctx.trajectories;
+
+	struct sweep_parameter coordinates[3] = {spec->section, spec->plane[0], spec->plane[1]};
+	ASSERT(ctx.param_args = calloc(trajectories->parameters_len + 1, sizeof(*ctx.param_args)));
+	if (!sweep_resolve_parameters(sim, coordinates, 3, coordinate_args) ||
+	    !sweep_resolve_parameters(sim, trajectories->parameters, trajectories->parameters_len, ctx.param_args)) {
+		fprintf(stderr, "Poincaré section coordinate or trajectory parameter does not exist in the simulation\n");
+		goto fail;
+	}
+	ctx.section_i = coordinate_args[0] - sim->internal_coordinates_start;
+	ctx.section_wraps = spec->section.target == SWEEP_POSITION;
+	for (int k = 0; k < 2; ++k) {
+		ctx.plane_i[k] = coordinate_args[k + 1] - sim->internal_coordinates_start;
+		ctx.plane_wraps[k] = spec->plane[k].target == SWEEP_POSITION;
+	}
+
+	ASSERT(ctx.base_args = base_args = calloc(sim->internal_args_len, sizeof(*base_args)));
+	sim_pack_args(sim, base_args);
+	if (spec->live) ASSERT(ctx.live = calloc(POINCARE_LIVE_POINTS, sizeof(*ctx.live)));
+
+	size_t output_len = strlen(spec->output);
+	ctx.csv = output_len >= 4 && !strcmp(spec->output + output_len - 4, ".csv");
+	ASSERT(ctx.file = fopen(spec->output, "wb"));
+	if (ctx.csv)
+		ASSERT(fprintf(ctx.file, "trajectory,time,%s,%s\n", spec->plane[0].name, spec->plane[1].name) > 0)
+	else
+		ASSERT(fwrite(POINCARE_MAGIC, 8, 1, ctx.file) == 1);
+
+	ASSERT(!pthread_mutex_init(&ctx.lock, NULL));
+	lock = true;
+
+	ASSERT(workers = calloc(threads, sizeof(*workers)));
+	for (unsigned i = 0; i < threads; ++i) {
+		workers[i].ctx = &ctx;
+		ASSERT(workers[i].args = calloc(sim->internal_args_len, sizeof(*workers[i].args)));
+		ASSERT(workers[i].scratch = calloc(sim->internal_args_len, sizeof(*workers[i].scratch)));
+		ASSERT(workers[i].trajectory = calloc(state_len * (POINCARE_CHUNK_STEPS + 1), sizeof(*workers[i].trajectory)));
+		ASSERT(workers[i].f0 = calloc(state_len, sizeof(*workers[i].f0)));
+		ASSERT(workers[i].f1 = calloc(state_len, sizeof(*workers[i].f1)));
+	}
+
+	atomic_store(&ctx.running, threads);
+	for (; started < threads; ++started)
+		if (pthread_create(&workers[started].thread, NULL, poincare_worker_func, &workers[started])) break;
+	atomic_fetch_sub(&ctx.running, threads - started);
+	if (started == 0) {
+		atomic_store(&ctx.running, 1);
+		poincare_worker_func(&workers[0]); // fall back to running on this thread
+	}
+
+	// the workers only need the main thread for showing progress
+	const struct timespec interval = {.tv_nsec = spec->live ? POINCARE_LIVE_INTERVAL : POINCARE_PROGRESS_INTERVAL};
+	while (atomic_load(&ctx.running)) {
+		if (spec->live) {
+			display->info = ctx.info;
+			if (!display_render(display, poincare_render, &ctx)) atomic_store(&ctx.failed, true);
+			display->info = NULL;
+		} else {
+			pthread_mutex_lock(&ctx.lock);
+			uint64_t crossings = ctx.crossings;
+			pthread_mutex_unlock(&ctx.lock);
+			fprintf(stderr, "\rPoincaré section: %zu/%zu trajectories, %" PRIu64 " crossings", atomic_load(&ctx.done), ctx.trajectories, crossings);
+		}
+		nanosleep(&interval, NULL);
+	}
+	for (unsigned i = 0; i < started; ++i) pthread_join(workers[i].thread, NULL);
+	if (!spec->live) fprintf(stderr, "\rPoincaré section: %zu/%zu trajectories, %" PRIu64 " crossings\n", atomic_load(&ctx.done), ctx.trajectories, ctx.crossings);
+	ASSERT(!atomic_load(&ctx.failed));
+
+	res = true;
+fail:
+	if (ctx.file && fclose(ctx.file)) res = false;
+	if (lock) pthread_mutex_destroy(&ctx.lock);
+	if (workers)
+		for (unsigned i = 0; i < threads; ++i) {
+			free(workers[i].args);
+			free(workers[i].scratch);
+			free(workers[i].trajectory);
+			free(workers[i].f0);
+			free(workers[i].f1);
+		}
+	free(workers);
+	free(ctx.live);
+	free(ctx.param_args);
+	free(base_args);
+	return res;
+}
@@ -0,0 +1,40 @@
+#ifndef POINCARE_H
+#define POINCARE_H
+#include "sim.h"
+#include "sweep.h"
+#include "display.h"
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define POINCARE_MAGIC "DPPNC001"
+
+// binary output is POINCARE_MAGIC followed by one record per crossing, in the order they were found
+struct poincare_record {
+	uint64_t trajectory;
+	double time, x, y;
+};
+
+struct poincare_spec {
+	struct sweep_parameter section; // coordinate defining the section, crossed where it equals value (modulo 2π for positions)
+	double value;
+	int direction;                  // 1 to only record rising crossings, -1 falling, 0 both
+	struct sweep_parameter plane[2]; // coordinates recorded at each crossing, positions wrapped to [-π, π]
+
+	// grid of initial conditions (parameters), with steps, time_span and threads per trajectory, only the current state if it has no parameters
+	const struct sweep_spec *trajectories;
+
+	const char *output; // CSV if it ends in ".csv", otherwise binary records
+	bool live;          // scatter plot the latest crossings on the display while running
+};
+
+// parses "<target>=<value>[:+|:-]", e.g. "pos0.0=0:+"
+bool poincare_parse_section(struct poincare_spec *spec, const char *str);
+// parses "<target>,<target>", e.g. "pos1.0,vel1.0"
+bool poincare_parse_plane(struct poincare_spec *spec, const char *str);
+
+// integrates every trajectory, locating crossings on each step's cubic Hermite interpolant and streaming them to spec->output,
+// so memory doesn't grow with the number of crossings
+// display must be enabled if spec->live is set, cancel stops early (keeping what was written) once it becomes non-zero
+bool poincare_run(const struct sim_simulation *sim, const struct poincare_spec *spec, struct display_data *display, volatile sig_atomic_t *cancel);
+#endif
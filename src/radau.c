@@ -0,0 +1,249 @@
+#include "radau.h"
+#include <math.h>
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SQ6 2.449489742783178
+#define NEWTON_MAX_ITERATIONS 7
+
+// Butcher tableau of Radau IIA, order 5
+static const double radau_c[3] = {(4 - SQ6) / 10, (4 + SQ6) / 10, 1};
+static const double radau_a[3][3] = {
+        {(88 - 7 * SQ6) / 360,     (296 - 169 * SQ6) / 1800, (-2 + 3 * SQ6) / 225},
+        {(296 + 169 * SQ6) / 1800, (88 + 7 * SQ6) / 360,     (-2 - 3 * SQ6) / 225},
+        {(16 - SQ6) / 36,          (16 + SQ6) / 36,          1.0 / 9             },
+};
+// coefficients of the embedded error estimate, and the inverse of the real eigenvalue of radau_a
+static const double radau_e[3] = {-(13 + 7 * SQ6) / 3, (-13 + 7 * SQ6) / 3, -1.0 / 3};
+#define RADAU_U1 3.6378342527444957
+
+// LU decomposition with partial pivoting, in place
+static bool lu_decompose(double *a, int *pivot, int n) {
+	for (int k = 0; k < n; ++k) {
+		int p = k;
+		for (int i = k + 1; i < n; ++i)
+			if (fabs(a[i * n + k]) > fabs(a[p * n + k])) p = i;
+		pivot[k] = p;
+		if (a[p * n + k] == 0) return false;
+		if (p != k)
+			for (int j = 0; j < n; ++j) {
+				double temp = a[k * n + j];
+				a[k * n + j] = a[p * n + j];
+				a[p * n + j] = temp;
+			}
+		for (int i = k + 1; i < n; ++i) {
+			double factor = a[i * n + k] /= a[k * n + k];
+			for (int j = k + 1; j < n; ++j) a[i * n + j] -= factor * a[k * n + j];
+		}
+	}
+	return true;
+}
+
+static void lu_solve(const double *lu, const int *pivot, int n, double *b) {
+	// rows were swapped entirely while decomposing, so apply every swap before substituting
+	for (int k = 0; k < n; ++k)
+		if (pivot[k] != k) {
+			double temp = b[k];
+			b[k] = b[pivot[k]];
+			b[pivot[k]] = temp;
+		}
+	for (int k = 0; k < n; ++k)
+		for (int i = k + 1; i < n; ++i) b[i] -= lu[i * n + k] * b[k];
+	for (int k = n - 1; k >= 0; --k) {
+		for (int j = k + 1; j < n; ++j) b[k] -= lu[k * n + j] * b[j];
+		b[k] /= lu[k * n + k];
+	}
+}
+
+// writes the outputs within the accepted step from t to t + hs, from the collocation polynomial through y at 0 and y + z at c
+// (Hairer & Wanner, Solving ODEs II, section IV.8), or y + z3 itself at the end of the step
+static void dense_output(double t, double hs, const double *y, const double *z, int m, double t0, double t1, int outputs, double *y_out, int *output) {
+	for (; *output < outputs; ++*output) {
+		double time = *output + 1 == outputs ? t1 : t0 + (t1 - t0) * (*output + 1) / outputs;
+		double *out = y_out + *output * m;
+		double s = (time - t) / hs;
+		if (s > 1) break;
+		if (s == 1) {
+			for (int i = 0; i < m; ++i) out[i] = y[i] + z[2 * m + i];
+			continue;
+		}
+		// Lagrange basis on the nodes 0, c1, c2, 1, the node at 0 only adding y
+		double basis[3];
+		for (int j = 0; j < 3; ++j) {
+			basis[j] = s / radau_c[j];
+			for (int k = 0; k < 3; ++k)
+				if (k != j) basis[j] *= (s - radau_c[k]) / (radau_c[j] - radau_c[k]);
+		}
+		for (int i = 0; i < m; ++i) out[i] = y[i] + basis[0] * z[i] + basis[1] * z[m + i] + basis[2] * z[2 * m + i];
+	}
+}
+
+// root mean square of x / scale, where scale repeats every m items
+static double scaled_norm(const double *x, const double *scale, int n, int m) {
+	double sum = 0;
+	for (int i = 0; i < n; ++i) {
+		double v = x[i] / scale[i % m];
+		sum += v * v;
+	}
+	return sqrt(sum / n);
+}
+
+bool radau5(void dydt(double t, double y[], double f[], void *custom), void jacobian(double t, double y[], double j[], void *custom),
+            double t0, double t1, double y[], int m, int outputs, double y_out[], double *h, double rtol, double atol, void *custom,
+            struct radau_stats *stats) {
+	if (t1 <= t0) return t1 == t0;
+
+	struct radau_stats local_stats = {0};
+	if (!stats) stats = &local_stats;
+
+	bool res = false;
+	int n3 = 3 * m;
+	double *work = malloc(sizeof(double) * (m * m * 2 + n3 * n3 + n3 * 3 + m * 6));
+	int *pivot = malloc(sizeof(int) * (n3 + m));
+	if (!work || !pivot) goto fail;
+
+	double *jac = work, *err_matrix = jac + m * m, *newton = err_matrix + m * m;
+	double *z = newton + n3 * n3, *dz = z + n3, *f = dz + n3;
+	double *f0 = f + n3, *yt = f0 + m, *scale = yt + m, *err = scale + m, *err_f = err + m, *temp = err_f + m;
+	int *newton_pivot = pivot, *err_pivot = pivot + n3;
+
+	double t = t0, step = *h > 0 ? *h : fmin(t1 - t0, 1e-3), lu_step = 0, eta_old = 1;
+	double newton_tolerance = fmax(10 * DBL_EPSILON / rtol, fmin(0.03, sqrt(rtol)));
+	bool need_jacobian = true, need_lu = true, jacobian_fresh = false, first = true, rejected = false;
+	int output = 0;
+
+	dydt(t, y, f0, custom);
+	++stats->dydt_calls;
+
+	while (t < t1) {
+		if (step < 1e-14 * fmax(fabs(t), 1)) goto fail; // step size underflow
+
+		double hs = step;
+		bool last = false;
+		if (t + hs >= t1 - 1e-14 * fabs(t1)) hs = t1 - t, last = true;
+
+		if (need_jacobian) {
+			jacobian(t, y, jac, custom);
+			++stats->jacobian_calls;
+			need_jacobian = false, need_lu = true, jacobian_fresh = true;
+		}
+
+		if (need_lu || hs != lu_step) {
+			// Newton matrix I - h (A ⊗ J) for the stages, and (U1 / h) I - J for the error estimate
+			for (int bi = 0; bi < 3; ++bi)
+				for (int bj = 0; bj < 3; ++bj)
+					for (int i = 0; i < m; ++i)
+						for (int j = 0; j < m; ++j)
+							newton[(bi * m + i) * n3 + bj * m + j] = (bi == bj && i == j) - hs * radau_a[bi][bj] * jac[i * m + j];
+			for (int i = 0; i < m; ++i)
+				for (int j = 0; j < m; ++j)
+					err_matrix[i * m + j] = (i == j) * RADAU_U1 / hs - jac[i * m + j];
+
+			++stats->decompositions;
+			if (!lu_decompose(newton, newton_pivot, n3) || !lu_decompose(err_matrix, err_pivot, m)) {
+				step *= 0.5, need_lu = true;
+				continue;
+			}
+			lu_step = hs, need_lu = false;
+		}
+
+		// solve the stage equations Z = h (A ⊗ I) F(y + Z) with simplified Newton iterations
+		for (int i = 0; i < m; ++i) scale[i] = atol + rtol * fabs(y[i]);
+		memset(z, 0, sizeof(*z) * n3);
+		double norm_old = 0, theta = 0, eta = pow(fmax(eta_old, DBL_EPSILON), 0.8);
+		int iterations = 0;
+		bool converged = false;
+		while (iterations < NEWTON_MAX_ITERATIONS) {
+			++iterations;
+			for (int s = 0; s < 3; ++s) {
+				for (int i = 0; i < m; ++i) yt[i] = y[i] + z[s * m + i];
+				dydt(t + radau_c[s] * hs, yt, f + s * m, custom);
+			}
+			stats->dydt_calls += 3;
+
+			for (int s = 0; s < 3; ++s)
+				for (int i = 0; i < m; ++i)
+					dz[s * m + i] = hs * (radau_a[s][0] * f[i] + radau_a[s][1] * f[m + i] + radau_a[s][2] * f[2 * m + i]) - z[s * m + i];
+			lu_solve(newton, newton_pivot, n3, dz);
+
+			double norm = scaled_norm(dz, scale, n3, m);
+			if (!isfinite(norm)) break;
+			if (iterations > 1) {
+				theta = norm / norm_old;
+				if (theta >= 0.99) break; // diverging
+				eta = theta / (1 - theta);
+			}
+			for (int i = 0; i < n3; ++i) z[i] += dz[i];
+			norm_old = norm;
+			if (eta * norm <= newton_tolerance) {
+				converged = true;
+				break;
+			}
+		}
+
+		if (!converged) {
+			// retry with a smaller step, and a fresh Jacobian if it was stale
+			if (jacobian_fresh) step *= 0.5;
+			need_jacobian = !jacobian_fresh;
+			rejected = true;
+			++stats->rejected;
+			continue;
+		}
+		eta_old = fmax(eta, DBL_EPSILON);
+
+		// error estimate, (U1 / h I - J)^-1 (f(t, y) + (e ⋅ Z) / h)
+		const double *z3 = z + 2 * m;
+		for (int i = 0; i < m; ++i) {
+			err_f[i] = (radau_e[0] * z[i] + radau_e[1] * z[m + i] + radau_e[2] * z3[i]) / hs;
+			err[i] = f0[i] + err_f[i];
+			scale[i] = atol + rtol * fmax(fabs(y[i]), fabs(y[i] + z3[i]));
+		}
+		lu_solve(err_matrix, err_pivot, m, err);
+		double error = scaled_norm(err, scale, m, m);
+		if (error >= 1 && (first || rejected)) {
+			// the estimate is unreliable for stiff components on the first or a rejected step, so refine it once
+			for (int i = 0; i < m; ++i) yt[i] = y[i] + err[i];
+			dydt(t, yt, temp, custom);
+			++stats->dydt_calls;
+			for (int i = 0; i < m; ++i) err[i] = temp[i] + err_f[i];
+			lu_solve(err_matrix, err_pivot, m, err);
+			error = scaled_norm(err, scale, m, m);
+		}
+		if (!isfinite(error)) error = 1e10;
+		error = fmax(error, 1e-10);
+
+		double safety = 0.9 * (2 * NEWTON_MAX_ITERATIONS + 1) / (2 * NEWTON_MAX_ITERATIONS + iterations);
+		double quot = fmin(5, fmax(0.125, safety * pow(error, -0.25)));
+
+		if (error < 1) {
+			if (outputs) dense_output(t, hs, y, z, m, t0, t1, outputs, y_out, &output);
+			t = last ? t1 : t + hs;
+			for (int i = 0; i < m; ++i) y[i] += z3[i];
+			dydt(t, y, f0, custom);
+			++stats->dydt_calls;
+			++stats->steps;
+			first = false, rejected = false, jacobian_fresh = false;
+
+			// keep the Jacobian if Newton converged quickly, and the step (so also the LU decompositions) if it would barely grow
+			need_jacobian = theta > 1e-3;
+			if (last)
+				step = quot < 1 ? fmin(step, hs * quot) : fmax(step, hs * quot);
+			else if (need_jacobian || quot < 1 || quot > 1.2)
+				step = hs * quot;
+			else
+				step = hs;
+		} else {
+			step = hs * (first ? 0.1 : quot);
+			rejected = true;
+			++stats->rejected;
+		}
+	}
+
+	*h = step;
+	res = true;
+fail:
+	free(work);
+	free(pivot);
+	return res;
+}
@@ -0,0 +1,22 @@
+#ifndef RADAU_H
+#define RADAU_H
+#include <stdbool.h>
+
+struct radau_stats {
+	unsigned long steps, rejected, dydt_calls, jacobian_calls, decompositions;
+};
+
+// integrates y from t0 to t1 with the 3-stage Radau IIA method (order 5), which is L-stable, for stiff problems
+// uses a simplified Newton iteration, reusing the Jacobian and its LU decomposition across steps while they keep converging,
+// and chooses step sizes from an embedded error estimate (Hairer & Wanner, Solving ODEs II, section IV.8)
+//
+// dydt and jacobian evaluate the right hand side and its m*m row-major Jacobian w.r.t. y
+// h is the initial step size (0 to guess), and receives the step size to continue with
+// outputs is 0, or the number of evenly spaced times after t0 up to t1 at which y is written to y_out (outputs * m items),
+// interpolated with each step's collocation polynomial, so the steps are still left to the error control
+// stats may be NULL, otherwise the counts are added to it
+// returns false if the step size underflows or the Newton matrix is singular
+bool radau5(void dydt(double t, double y[], double f[], void *custom), void jacobian(double t, double y[], double j[], void *custom),
+            double t0, double t1, double y[], int m, int outputs, double y_out[], double *h, double rtol, double atol, void *custom,
+            struct radau_stats *stats);
+#endif
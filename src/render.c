@@ -1,7 +1,11 @@
 #include <math.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "render.h"
 
-void draw_line(struct posf pos1, struct posf pos2, bool set, struct display_screen screen) {
+// visits each cell of the line within rows [row_start, row_end), either setting it or adding one to its count
+static void trace_line(struct posf pos1, struct posf pos2, bool set, bool count, size_t row_start, size_t row_end, struct display_screen screen) {
+	if (!(fabsf(pos1.x) < 1e9f && fabsf(pos1.y) < 1e9f && fabsf(pos2.x) < 1e9f && fabsf(pos2.y) < 1e9f)) return; // also NaN
 	struct posf delta = posf_sub(pos1, pos2);
 
 	bool swap = fabsf(delta.y) > fabsf(delta.x);
@@ -12,9 +16,130 @@ void draw_line(struct posf pos1, struct posf pos2, bool set, struct display_scre
 	}
 	float gradient = delta.x != 0 ? delta.y / delta.x : 0;
 	if (delta.x < 0) SWAP(struct posf, pos2, pos1); // swap from/to values to make it easier to loop
-	for (size_t x = floorf(pos2.x); x <= ceilf(pos1.x); ++x) {
-		struct poss cell = POSS(x, roundf(gradient * (cell.x - pos2.x) + pos2.y)); // y=m*(x-x1)+y1
+
+	// only loop over the part of the major axis on the screen, or the band of rows if that is the major axis,
+	// so each band of draw_lines_density walks its own share of a steep line rather than all of it
+	long first = floorf(pos2.x), last = ceilf(pos1.x);
+	long lower = swap ? (long) row_start : 0, upper = swap ? (long) (row_end < screen.h ? row_end : screen.h) : (long) screen.w;
+	if (first < lower) first = lower;
+	if (last > upper - 1) last = upper - 1;
+	for (long x = first; x <= last; ++x) {
+		struct poss cell = POSS(x, (long) roundf(gradient * (x - pos2.x) + pos2.y)); // y=m*(x-x1)+y1
 		if (swap) SWAP_POSS(cell);
-		DISPLAY_SET_CELL(cell, set, screen);
+		if (cell.y < row_start || cell.y >= row_end) continue;
+		if (!count) {
+			DISPLAY_SET_CELL(cell, set, screen);
+		} else if (DISPLAY_CELL_IN_BOUNDS(cell, screen))
+			++((uint32_t *) screen.buf)[DISPLAY_INDEX(cell, screen)];
+	}
+}
+
+static void plot_coverage(long x, long y, float coverage, bool swap, size_t row_start, size_t row_end, struct display_screen screen) {
+	if (swap) SWAP(long, x, y);
+	if (x < 0 || y < 0 || (size_t) x >= screen.w || (size_t) y >= screen.h) return;
+	if ((size_t) y < row_start || (size_t) y >= row_end) return;
+	((float *) screen.buf)[DISPLAY_INDEX(POSS(x, y), screen)] += coverage;
+}
+
+static float fractional(float x) { return x - floorf(x); }
+
+// Xiaolin Wu's anti-aliased line, adding the coverage of each cell within rows [row_start, row_end)
+// cells are centred on integer coordinates, like trace_line rounding to them
+static void trace_line_coverage(struct posf pos1, struct posf pos2, size_t row_start, size_t row_end, struct display_screen screen) {
+	if (!(fabsf(pos1.x) < 1e9f && fabsf(pos1.y) < 1e9f && fabsf(pos2.x) < 1e9f && fabsf(pos2.y) < 1e9f)) return; // also NaN
+
+	bool swap = fabsf(pos2.y - pos1.y) > fabsf(pos2.x - pos1.x);
+	if (swap) { // loop over the major axis, as in trace_line
+		SWAP_POSF(pos1);
+		SWAP_POSF(pos2);
+	}
+	if (pos1.x > pos2.x) SWAP(struct posf, pos1, pos2);
+	float dx = pos2.x - pos1.x, gradient = dx != 0 ? (pos2.y - pos1.y) / dx : 0;
+
+	// the end cells are covered in proportion to how much of them the line spans
+	float x_end = roundf(pos1.x), y_end = pos1.y + gradient * (x_end - pos1.x), x_gap = 1 - fractional(pos1.x + 0.5f);
+	long x_start = x_end;
+	plot_coverage(x_start, floorf(y_end), (1 - fractional(y_end)) * x_gap, swap, row_start, row_end, screen);
+	plot_coverage(x_start, floorf(y_end) + 1, fractional(y_end) * x_gap, swap, row_start, row_end, screen);
+	float y = y_end + gradient;
+
+	x_end = roundf(pos2.x), y_end = pos2.y + gradient * (x_end - pos2.x), x_gap = fractional(pos2.x + 0.5f);
+	long x_stop = x_end;
+	plot_coverage(x_stop, floorf(y_end), (1 - fractional(y_end)) * x_gap, swap, row_start, row_end, screen);
+	plot_coverage(x_stop, floorf(y_end) + 1, fractional(y_end) * x_gap, swap, row_start, row_end, screen);
+
+	// only loop over the part of the major axis on the screen, or the band of rows if that is the major axis
+	long first = x_start + 1, limit = swap ? (long) (row_end < screen.h ? row_end : screen.h) : (long) screen.w;
+	long lower = swap ? (long) row_start - 1 : -1;
+	if (first < lower) {
+		y += gradient * (lower - first);
+		first = lower;
+	}
+	if (x_stop > limit + 1) x_stop = limit + 1;
+	for (long x = first; x < x_stop; ++x, y += gradient) {
+		plot_coverage(x, floorf(y), 1 - fractional(y), swap, row_start, row_end, screen);
+		plot_coverage(x, floorf(y) + 1, fractional(y), swap, row_start, row_end, screen);
+	}
+}
+
+void draw_line(struct posf pos1, struct posf pos2, bool set, struct display_screen screen) {
+	if (screen.mode == DISPLAY_COVERAGE) {
+		if (set) trace_line_coverage(pos1, pos2, 0, SIZE_MAX, screen);
+		return;
+	}
+	trace_line(pos1, pos2, set, false, 0, SIZE_MAX, screen);
+}
+
+void draw_lines_density_band(const struct posf *points, size_t segments_len, struct display_screen screen, unsigned band, unsigned bands) {
+	size_t row_start = screen.h * band / bands, row_end = screen.h * (band + 1) / bands;
+	for (size_t i = 0; i < segments_len; ++i) {
+		struct posf pos1 = points[2 * i], pos2 = points[2 * i + 1];
+		// rows are rounded, so a segment can reach half a row past its ends
+		float top = fminf(pos1.y, pos2.y), bottom = fmaxf(pos1.y, pos2.y);
+		if (!(bottom + 1 >= row_start && top - 1 < row_end)) continue;
+		if (screen.mode == DISPLAY_COVERAGE)
+			trace_line_coverage(pos1, pos2, row_start, row_end, screen);
+		else
+			trace_line(pos1, pos2, 1, true, row_start, row_end, screen);
+	}
+}
+
+struct density_band {
+	pthread_t thread;
+	bool started;
+	const struct posf *points;
+	size_t segments_len;
+	struct display_screen screen;
+	unsigned band, bands;
+};
+
+static void *density_band_func(void *data) {
+	struct density_band *band = data;
+	draw_lines_density_band(band->points, band->segments_len, band->screen, band->band, band->bands);
+	return NULL;
+}
+
+bool draw_lines_density(const struct posf *points, size_t segments_len, struct display_screen screen, unsigned threads) {
+	if (screen.mode == DISPLAY_BLOCKS) return false;
+	if (threads < 1) threads = 1;
+	if (threads > screen.h) threads = screen.h ? screen.h : 1;
+
+	// each band only writes its own rows, so no counts are shared between threads
+	struct density_band bands[threads];
+	for (unsigned i = 0; i < threads; ++i) {
+		bands[i] = (struct density_band) {
+		        .points = points,
+		        .segments_len = segments_len,
+		        .screen = screen,
+		        .band = i,
+		        .bands = threads,
+		};
+		// the first band runs on this thread, as do any that couldn't start one
+		if (i > 0) bands[i].started = !pthread_create(&bands[i].thread, NULL, density_band_func, &bands[i]);
 	}
+	for (unsigned i = 0; i < threads; ++i)
+		if (!bands[i].started) density_band_func(&bands[i]);
+	for (unsigned i = 0; i < threads; ++i)
+		if (bands[i].started) pthread_join(bands[i].thread, NULL);
+	return true;
 }
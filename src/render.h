@@ -1,4 +1,10 @@
 #include "display.h"
 
+// in DISPLAY_COVERAGE mode the line is anti-aliased, adding its coverage to each cell if set
 void draw_line(struct posf pos1, struct posf pos2, bool set, struct display_screen screen);
 
+// adds one to every cell the segments from points[2i] to points[2i+1] cross (or their coverage), for a screen in a density mode
+// the screen is split into a horizontal band per thread, each rasterising only the segments reaching it
+bool draw_lines_density(const struct posf *points, size_t segments_len, struct display_screen screen, unsigned threads);
+// rasterises only the rows of one of bands horizontal bands, for callers with their own threads, each band only writing its own rows
+void draw_lines_density_band(const struct posf *points, size_t segments_len, struct display_screen screen, unsigned band, unsigned bands);
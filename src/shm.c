@@ -0,0 +1,231 @@
+#include "shm.h"
+#include "linked_list.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHM_SLOT_ALIGN 64 // keep slots on separate cache lines
+#define SHM_READ_RETRIES 16 // reads of a slot being written before giving up on the frame, yielding to the publisher between them
+
+static size_t frame_len(const struct sim_simulation *sim) {
+	size_t len = sim->variables_len;
+	LL_LOOP(struct sim_body *, body, sim->bodies) len += body->variables_len + body->coordinates_len * 2 + 2;
+	return len;
+}
+
+static struct shm_slot *get_slot(const struct shm_segment *segment, uint64_t index) {
+	const struct shm_header *header = segment->header;
+	return (struct shm_slot *) ((char *) header + header->slots_offset + (index % header->slots_len) * header->slot_size);
+}
+
+// whether an existing segment was left behind by a publisher that is no longer running, or isn't one at all
+static bool shm_stale(const char *name) {
+	bool stale = true;
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) return errno == ENOENT;
+	struct stat st;
+	if (!fstat(fd, &st) && st.st_size >= (off_t) sizeof(struct shm_header)) {
+		const struct shm_header *header = mmap(NULL, sizeof(*header), PROT_READ, MAP_SHARED, fd, 0);
+		if (header != MAP_FAILED) {
+			if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == SHM_MAGIC && header->version == SHM_VERSION) {
+				pid_t pid = header->publisher;
+				stale = kill(pid, 0) && errno == ESRCH;
+			}
+			munmap((void *) header, sizeof(*header));
+		}
+	}
+	close(fd);
+	return stale;
+}
+
+struct shm_segment *shm_publish_open(const char *name, const struct sim_simulation *sim, size_t slots_len) {
+	struct shm_segment *segment = calloc(1, sizeof(*segment));
+	int fd = -1, error;
+	if (!segment) return NULL;
+	ASSERT(slots_len > 0);
+	ASSERT(segment->name = strdup(name));
+
+	size_t bodies_len = 0;
+	LL_LOOP(struct sim_body *, body, sim->bodies) ++bodies_len;
+
+	size_t layout_offset = sizeof(struct shm_header);
+	size_t slots_offset = (layout_offset + bodies_len * 2 * sizeof(uint32_t) + SHM_SLOT_ALIGN - 1) / SHM_SLOT_ALIGN * SHM_SLOT_ALIGN;
+	size_t slot_size = (sizeof(struct shm_slot) + frame_len(sim) * sizeof(double) + SHM_SLOT_ALIGN - 1) / SHM_SLOT_ALIGN * SHM_SLOT_ALIGN;
+	segment->size = slots_offset + slot_size * slots_len;
+
+	// only replace a segment left behind by a previous run, not one still being published to
+	if ((fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644)) < 0 && errno == EEXIST) {
+		ASSERT(shm_stale(name));
+		shm_unlink(name);
+		fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	}
+	ASSERT(fd >= 0);
+	segment->owner = true;
+	ASSERT(!ftruncate(fd, segment->size));
+	void *map = mmap(NULL, segment->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	ASSERT(map != MAP_FAILED);
+	segment->header = map;
+	close(fd), fd = -1;
+
+	struct shm_header *header = segment->header;
+	*header = (struct shm_header) {
+	        .version = SHM_VERSION,
+	        .header_size = sizeof(struct shm_header),
+	        .variables_len = sim->variables_len,
+	        .bodies_len = bodies_len,
+	        .slots_len = slots_len,
+	        .frame_len = frame_len(sim),
+	        .slot_size = slot_size,
+	        .layout_offset = layout_offset,
+	        .slots_offset = slots_offset,
+	        .publisher = getpid(),
+	};
+	uint32_t *layout = (uint32_t *) ((char *) header + layout_offset);
+	LL_LOOP(struct sim_body *, body, sim->bodies) {
+		*layout++ = body->coordinates_len;
+		*layout++ = body->variables_len;
+	}
+
+	// the magic number is written last so viewers never see a partially initialised header
+	__atomic_store_n(&header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+	return segment;
+fail:
+	error = errno;
+	if (fd >= 0) close(fd);
+	shm_close(segment);
+	errno = error;
+	return NULL;
+}
+
+void shm_publish(struct shm_segment *segment, const struct sim_simulation *sim) {
+	struct shm_header *header = segment->header;
+	uint64_t frames = __atomic_load_n(&header->frames, __ATOMIC_RELAXED);
+	struct shm_slot *slot = get_slot(segment, frames);
+
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+
+	uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->published = (uint64_t) tp.tv_sec * 1000000000 + tp.tv_nsec;
+	slot->time = sim->time;
+	double *frame = slot->frame;
+	for (size_t i = 0; i < sim->variables_len; ++i) *frame++ = sim->in_variables[i];
+	LL_LOOP(struct sim_body *, body, sim->bodies) {
+		for (size_t i = 0; i < body->variables_len; ++i) *frame++ = body->in_variables[i];
+		for (size_t i = 0; i < body->coordinates_len; ++i) {
+			*frame++ = body->coordinates[i].position;
+			*frame++ = body->coordinates[i].velocity;
+		}
+		*frame++ = body->out_kinetic;
+		*frame++ = body->out_potential;
+	}
+
+	__atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&header->frames, frames + 1, __ATOMIC_RELEASE);
+}
+
+struct shm_segment *shm_view_open(const char *name) {
+	struct shm_segment *segment = calloc(1, sizeof(*segment));
+	int fd = -1;
+	if (!segment) return NULL;
+	ASSERT(segment->name = strdup(name));
+
+	ASSERT((fd = shm_open(name, O_RDONLY, 0)) >= 0);
+	struct stat st;
+	ASSERT(!fstat(fd, &st) && st.st_size >= (off_t) sizeof(struct shm_header));
+	segment->size = st.st_size;
+	void *map = mmap(NULL, segment->size, PROT_READ, MAP_SHARED, fd, 0);
+	ASSERT(map != MAP_FAILED);
+	segment->header = map;
+	close(fd), fd = -1;
+
+	const struct shm_header *header = segment->header;
+	ASSERT(__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == SHM_MAGIC && header->version == SHM_VERSION);
+	ASSERT(header->slots_len > 0 && header->slots_offset + header->slot_size * header->slots_len <= segment->size);
+	ASSERT(header->layout_offset + header->bodies_len * 2 * sizeof(uint32_t) <= header->slots_offset);
+	return segment;
+fail:
+	if (fd >= 0) close(fd);
+	shm_close(segment);
+	return NULL;
+}
+
+struct sim_simulation *shm_view_simulation(const struct shm_segment *segment) {
+	const struct shm_header *header = segment->header;
+	const uint32_t *layout = (const uint32_t *) ((const char *) header + header->layout_offset);
+
+	struct sim_simulation *sim = sim_new(NULL, header->variables_len);
+	if (!sim) return NULL;
+	for (uint32_t i = 0; i < header->bodies_len; ++i) {
+		if (!sim_new_body(NULL, sim, layout[i * 2], layout[i * 2 + 1], NULL)) {
+			sim_remove(sim);
+			return NULL;
+		}
+	}
+	if (frame_len(sim) != header->frame_len) {
+		sim_remove(sim);
+		return NULL;
+	}
+	return sim;
+}
+
+bool shm_view_read(struct shm_segment *segment, struct sim_simulation *sim) {
+	const struct shm_header *header = segment->header;
+	double frame[header->frame_len + 1];
+	double time;
+
+	for (int retries = 0;; ++retries) {
+		// the publisher may be lapping us, or may have died mid-write, so try again next frame
+		if (retries == SHM_READ_RETRIES) return false;
+		if (retries) sched_yield();
+
+		uint64_t frames = __atomic_load_n(&header->frames, __ATOMIC_ACQUIRE);
+		if (frames == 0) return false; // nothing published yet
+		const struct shm_slot *slot = get_slot(segment, frames - 1);
+
+		uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		if (sequence & 1) continue; // being written
+		if (frames == segment->last_frames && sequence == segment->last_sequence) return false;
+
+		memcpy(frame, slot->frame, header->frame_len * sizeof(*frame));
+		time = slot->time;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence) continue; // torn read
+
+		segment->last_frames = frames, segment->last_sequence = sequence;
+		break;
+	}
+
+	const double *value = frame;
+	sim->time = time;
+	for (size_t i = 0; i < sim->variables_len; ++i) sim->in_variables[i] = *value++;
+	LL_LOOP(struct sim_body *, body, sim->bodies) {
+		for (size_t i = 0; i < body->variables_len; ++i) body->in_variables[i] = *value++;
+		for (size_t i = 0; i < body->coordinates_len; ++i) {
+			body->coordinates[i].position = *value++;
+			body->coordinates[i].velocity = *value++;
+		}
+		body->out_kinetic = *value++;
+		body->out_potential = *value++;
+	}
+	return true;
+}
+
+void shm_close(struct shm_segment *segment) {
+	if (!segment) return;
+	if (segment->header) munmap(segment->header, segment->size);
+	if (segment->owner) shm_unlink(segment->name);
+	free(segment->name);
+	free(segment);
+}
@@ -0,0 +1,58 @@
+#ifndef SHM_H
+#define SHM_H
+#include "sim.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// publishes simulation state into a POSIX shared memory ring buffer, so any number of local viewers can render one simulation
+//
+// layout: struct shm_header, then a u32 (coordinates_len, variables_len) pair for each body, then the slots
+// each slot is a struct shm_slot followed by frame_len doubles:
+//   simulation variables, then for each body: variables, (position, velocity) for each coordinate, kinetic and potential energy
+// every slot is guarded by a seqlock, its sequence number is odd while it is being written
+
+#define SHM_MAGIC 0x314d48534450444eULL // "NDPDSHM1"
+#define SHM_VERSION 2
+
+struct shm_header {
+	uint64_t magic;
+	uint32_t version, header_size;
+	uint32_t variables_len, bodies_len;
+	uint32_t slots_len, frame_len;
+	uint64_t slot_size, layout_offset, slots_offset;
+	uint64_t frames;    // number of frames published, the latest is in slot (frames - 1) % slots_len
+	uint64_t publisher; // pid of the publishing process, so a segment it left behind when it died can be replaced
+};
+
+struct shm_slot {
+	uint64_t sequence;
+	uint64_t published; // CLOCK_MONOTONIC nanoseconds
+	double time;        // simulation time
+	double frame[];
+};
+
+struct shm_segment {
+	char *name;
+	bool owner;
+	size_t size;
+	struct shm_header *header;
+	uint64_t last_sequence, last_frames; // for viewers, to tell whether a new frame arrived
+};
+
+// creates the segment name (e.g. "/dpend") sized for sim, which must stay the same shape while publishing
+// fails with errno EEXIST if another process is still publishing to it
+struct shm_segment *shm_publish_open(const char *name, const struct sim_simulation *sim, size_t slots_len);
+void shm_publish(struct shm_segment *segment, const struct sim_simulation *sim);
+
+// attaches to an existing segment read-only
+struct shm_segment *shm_view_open(const char *name);
+// creates a simulation with the bodies and variables described by the segment, which is only usable with shm_view_read, not sim_step
+struct sim_simulation *shm_view_simulation(const struct shm_segment *segment);
+// copies the latest frame into sim, returning whether it differs from the last one read, or false if the publisher kept
+// writing it (or died while writing it) for longer than a few retries
+bool shm_view_read(struct shm_segment *segment, struct sim_simulation *sim);
+
+// unmaps the segment, and removes it if it was created by shm_publish_open
+void shm_close(struct shm_segment *segment);
+#endif
@@ -1,8 +1,13 @@
 #include "sim.h"
 #include "rk4.h"
+#include "radau.h"
 #include "util.h"
 #include "linked_list.h"
+#include "metrics.h"
+#include "autotune.h"
 #include <stdint.h>
+#include <string.h>
+#include <math.h>
 
 static unsigned log10i(size_t x) {
 	unsigned i;
@@ -10,10 +15,28 @@ static unsigned log10i(size_t x) {
 	return i;
 }
 
+static void sim_remove_unlinked_observable(struct sim_observable *observable) {
+	if (!observable) return;
+	// removes observable without modifying prev/next
+	BASIC_FREE(observable->expr);
+	free(observable->name);
+	free(observable);
+}
+
+static void sim_remove_unlinked_event(struct sim_event *event) {
+	if (!event) return;
+	BASIC_FREE(event->expr);
+	free(event->name);
+	free(event);
+}
+
 static void sim_remove_unlinked_body(struct sim_body *body) {
 	if (!body) return;
 	// removes body without modifying prev/next
 
+	struct sim_observable *remove_observable;
+	LL_REMOVE_ALL(body->observables, remove_observable, sim_remove_unlinked_observable(remove_observable));
+
 	BASIC_FREE(body->sym_kinetic);
 	BASIC_FREE(body->sym_potential);
 
@@ -65,6 +88,14 @@ struct sim_simulation *sim_new(CWRAPPER_OUTPUT_TYPE *error, size_t variables_len
 	}
 	for (size_t i = 0; i < variables_len; ++i) sim->in_variables[i] = 0.0;
 
+	sim->integrator = SIM_INTEGRATOR_RK4;
+	sim->tolerance = 1e-8;
+#ifdef SIM_USE_LLVM
+	sim->kernel = (struct sim_kernel) {.backend = SIM_BACKEND_LLVM, .opt_level = 2, .cse = true};
+#else
+	sim->kernel = (struct sim_kernel) {.backend = SIM_BACKEND_LAMBDA, .opt_level = 2, .cse = true};
+#endif
+
 	BASIC_NEW(sim->sym_time);
 	ASSERT_SYM(symbol_set(sim->sym_time, "t"));
 
@@ -79,6 +110,161 @@ fail:
 	return NULL;
 }
 
+struct sim_visitor {
+	enum sim_backend backend;
+	union {
+		CLambdaRealDoubleVisitor *lambda;
+#ifdef HAVE_SYMENGINE_LLVM
+		CLLVMDoubleVisitor *llvm;
+#endif
+	};
+};
+
+struct sim_visitor *sim_visitor_new(const struct sim_kernel *kernel, const CVecBasic *args, const CVecBasic *exprs) {
+	struct sim_visitor *visitor = calloc(1, sizeof(*visitor));
+	ASSERT(visitor);
+	visitor->backend = kernel->backend;
+	switch (kernel->backend) {
+		case SIM_BACKEND_LAMBDA:
+			ASSERT(visitor->lambda = lambda_real_double_visitor_new());
+			lambda_real_double_visitor_init(visitor->lambda, args, exprs, kernel->cse);
+			return visitor;
+		case SIM_BACKEND_LLVM:
+#ifdef HAVE_SYMENGINE_LLVM
+			ASSERT(visitor->llvm = llvm_double_visitor_new());
+			llvm_double_visitor_init(visitor->llvm, args, exprs, kernel->cse, kernel->opt_level);
+			return visitor;
+#else
+			break;
+#endif
+	}
+fail:
+	free(visitor);
+	return NULL;
+}
+
+void sim_visitor_call(const struct sim_visitor *visitor, double *out, const double *args) {
+#ifdef HAVE_SYMENGINE_LLVM
+	if (visitor->backend == SIM_BACKEND_LLVM) {
+		llvm_double_visitor_call(visitor->llvm, out, args);
+		return;
+	}
+#endif
+	lambda_real_double_visitor_call(visitor->lambda, out, args);
+}
+
+void sim_visitor_free(struct sim_visitor *visitor) {
+	if (!visitor) return;
+#ifdef HAVE_SYMENGINE_LLVM
+	if (visitor->backend == SIM_BACKEND_LLVM && visitor->llvm) llvm_double_visitor_free(visitor->llvm);
+#endif
+	if (visitor->backend == SIM_BACKEND_LAMBDA && visitor->lambda) lambda_real_double_visitor_free(visitor->lambda);
+	free(visitor);
+}
+
+// the kernels of tiered compilation, compiled on a background thread then swapped in for the lambda ones
+#define SIM_TIER_KERNELS 6
+struct sim_tier {
+	pthread_t thread;
+	bool started;
+	struct sim_model *model;
+	struct sim_kernel kernel;
+	CVecBasic *args, *exprs[SIM_TIER_KERNELS];
+	struct sim_visitor **slots[SIM_TIER_KERNELS];
+	size_t len;
+	atomic_bool cancel, done;
+};
+
+static void *sim_tier_func(void *data) {
+	struct sim_tier *tier = data;
+	struct sim_model *model = tier->model;
+	struct sim_visitor *visitors[SIM_TIER_KERNELS] = {0};
+	METRICS_START(phase_tier);
+	size_t compiled = 0;
+	for (; compiled < tier->len && !atomic_load(&tier->cancel); ++compiled)
+		if (!(visitors[compiled] = sim_visitor_new(&tier->kernel, tier->args, tier->exprs[compiled]))) break;
+	if (compiled == tier->len) {
+		// swapped under the lock, so calls of the lambda kernels have finished, and the lock is only skipped once they're gone
+		pthread_mutex_lock(&model->internal_call_lock);
+		for (size_t i = 0; i < tier->len; ++i) {
+			struct sim_visitor *lambda = *tier->slots[i];
+			*tier->slots[i] = visitors[i];
+			visitors[i] = lambda;
+		}
+		atomic_store_explicit(&model->internal_lock_calls, tier->kernel.backend == SIM_BACKEND_LAMBDA, memory_order_release);
+		pthread_mutex_unlock(&model->internal_call_lock);
+		METRICS_END(phase_tier, METRICS_COMPILE_NS, "compile tiered kernels", "compile");
+	}
+	for (size_t i = 0; i < tier->len; ++i) {
+		sim_visitor_free(visitors[i]);
+		vecbasic_free(tier->exprs[i]);
+	}
+	vecbasic_free(tier->args);
+	tier->len = 0;
+	tier->args = NULL;
+	atomic_store(&tier->done, true);
+	return NULL;
+}
+
+// waits for the kernel being compiled, if any, leaving the lambda kernels in place
+static void sim_tier_stop(struct sim_model *model) {
+	struct sim_tier *tier = model->internal_tier;
+	if (!tier) return;
+	atomic_store(&tier->cancel, true);
+	if (tier->started) pthread_join(tier->thread, NULL);
+	free(tier);
+	model->internal_tier = NULL;
+}
+
+bool sim_tiering(const struct sim_simulation *sim) {
+	return sim->internal_model && sim->internal_model->internal_tier && !atomic_load(&sim->internal_model->internal_tier->done);
+}
+
+static struct sim_model *sim_model_new(struct sim_simulation *sim) {
+	struct sim_model *model = calloc(1, sizeof(*model));
+	if (!model) return NULL;
+	if (pthread_mutex_init(&model->internal_call_lock, NULL)) {
+		free(model);
+		return NULL;
+	}
+	atomic_init(&model->refs, 1);
+	model->sim = sim;
+	model->substeps = 1;
+	return model;
+}
+
+struct sim_model *sim_model_ref(struct sim_model *model) {
+	atomic_fetch_add_explicit(&model->refs, 1, memory_order_relaxed);
+	return model;
+}
+
+void sim_model_unref(struct sim_model *model) {
+	if (!model || atomic_fetch_sub_explicit(&model->refs, 1, memory_order_acq_rel) != 1) return;
+	sim_tier_stop(model); // it swaps the visitors
+	sim_visitor_free(model->dydt_func);
+	sim_visitor_free(model->energy_func);
+	sim_visitor_free(model->jacobian_func);
+	sim_visitor_free(model->event_func);
+	sim_visitor_free(model->dydt_slow_func);
+	sim_visitor_free(model->dydt_fast_func);
+#ifdef SIM_USE_LLVM
+	if (model->dydt_func_float) sim_float_visitor_free(model->dydt_func_float);
+#endif
+	pthread_mutex_destroy(&model->internal_call_lock);
+	free(model->slow_state);
+	free(model->fast_state);
+	free(model->events);
+	free(model);
+}
+
+// lets go of the compiled model, which lives on in any states still referencing it
+static void sim_release_model(struct sim_simulation *sim) {
+	sim_state_free(sim->internal_state);
+	sim->internal_state = NULL;
+	sim_model_unref(sim->internal_model);
+	sim->internal_model = NULL;
+}
+
 static void sim_remove_unlinked_constraint(struct sim_basic_list *constraint) {
 	if (!constraint) return;
 	// removes constraint without modifying prev/next
@@ -95,20 +281,24 @@ void sim_remove(struct sim_simulation *sim) {
 	struct sim_basic_list *remove_constraint;
 	LL_REMOVE_ALL(sim->constraints, remove_constraint, sim_remove_unlinked_constraint(remove_constraint));
 
+	struct sim_observable *remove_observable;
+	LL_REMOVE_ALL(sim->observables, remove_observable, sim_remove_unlinked_observable(remove_observable));
+
+	struct sim_event *remove_event;
+	LL_REMOVE_ALL(sim->events, remove_event, sim_remove_unlinked_event(remove_event));
+
 	if (sim->sym_variables)
 		for (size_t i = 0; i < sim->variables_len; ++i)
 			BASIC_FREE(sim->sym_variables[i]);
 
-	// free visitor functions
-	if (sim->internal_dydt_func) sim_visitor_free(sim->internal_dydt_func);
-	if (sim->internal_energy_func) sim_visitor_free(sim->internal_energy_func);
+	sim_release_model(sim);
 
 	BASIC_FREE(sim->sym_time);
 	BASIC_FREE(sim->sym_lagrangian);
 
 	free(sim->in_variables);
 	free(sim->sym_variables);
-	free(sim->internal_func_args);
+	free(sim->out_observables);
 	free(sim);
 }
 
@@ -137,6 +327,75 @@ void sim_remove_constraint(struct sim_simulation *sim, struct sim_basic_list *co
 	sim_remove_unlinked_constraint(constraint);
 }
 
+struct sim_observable *sim_new_observable(CWRAPPER_OUTPUT_TYPE *error, struct sim_simulation *sim, struct sim_body *body, const char *name, sim_basic expr) {
+	CWRAPPER_OUTPUT_TYPE sym_error = 0;
+
+	struct sim_observable *observable = calloc(1, sizeof(*observable));
+	ASSERT(observable);
+
+	ASSERT(observable->name = strdup(name));
+	BASIC_NEW(observable->expr);
+	ASSERT_SYM(basic_assign(observable->expr, expr));
+
+	// add to linked list
+	if (body)
+		LL_ADD(observable, body->observables, body->observables_last)
+	else
+		LL_ADD(observable, sim->observables, sim->observables_last)
+	return observable;
+
+fail:
+	if (sym_error) *error = sym_error;
+	sim_remove_unlinked_observable(observable);
+	return NULL;
+}
+
+void sim_remove_observable(struct sim_simulation *sim, struct sim_body *body, struct sim_observable *observable) {
+	if (!observable) return;
+	if (body)
+		LL_REMOVE(observable, body->observables, body->observables_last)
+	else
+		LL_REMOVE(observable, sim->observables, sim->observables_last)
+	sim_remove_unlinked_observable(observable);
+}
+
+struct sim_observable *sim_find_observable(struct sim_simulation *sim, struct sim_body *body, const char *name) {
+	LL_LOOP(struct sim_observable *, observable, body ? body->observables : sim->observables) {
+		if (!strcmp(observable->name, name)) return observable;
+	}
+	return NULL;
+}
+
+struct sim_event *sim_new_event(CWRAPPER_OUTPUT_TYPE *error, struct sim_simulation *sim, const char *name, sim_basic expr, int direction, sim_event_callback *callback, void *custom) {
+	CWRAPPER_OUTPUT_TYPE sym_error = 0;
+
+	struct sim_event *event = calloc(1, sizeof(*event));
+	ASSERT(event);
+
+	ASSERT(event->name = strdup(name));
+	BASIC_NEW(event->expr);
+	ASSERT_SYM(basic_assign(event->expr, expr));
+	event->direction = direction;
+	event->callback = callback;
+	event->custom = custom;
+	event->last_time = NAN;
+
+	// add to linked list
+	LL_ADD(event, sim->events, sim->events_last);
+	return event;
+
+fail:
+	if (sym_error) *error = sym_error;
+	sim_remove_unlinked_event(event);
+	return NULL;
+}
+
+void sim_remove_event(struct sim_simulation *sim, struct sim_event *event) {
+	if (!event) return;
+	LL_REMOVE(event, sim->events, sim->events_last);
+	sim_remove_unlinked_event(event);
+}
+
 struct sim_body *sim_new_body(CWRAPPER_OUTPUT_TYPE *error, struct sim_simulation *sim, size_t coordinates_len, size_t variables_len, struct sim_body *insert_before) {
 	// buffer string for defining symbols
 	const size_t str_length = 16 + log10i(SIZE_MAX);
@@ -201,6 +460,98 @@ void sim_remove_body(struct sim_simulation *sim, struct sim_body *body) {
 	sim_remove_unlinked_body(body);
 }
 
+#define SIM_MULTIRATE_RATIO 4 // times faster than the slowest body a body has to be for SIM_MULTIRATE_AUTO to sub-cycle it
+
+// estimates the substeps of each body from the rates of change of its accelerations at the current state, using the compiled dydt
+// ∂a/∂q of a coordinate is its squared angular frequency, and ∂a/∂v its damping rate
+static void sim_estimate_substeps(struct sim_simulation *sim) {
+	size_t state_len = SIM_STATE_LEN(sim);
+	double args[sim->internal_args_len], base[state_len], out[state_len], rates[sim->internal_bodies_len];
+	sim_pack_args(sim, args);
+	sim_dydt(sim, args, base);
+
+	double slowest = INFINITY;
+	size_t body_i = 0, state_i = 0;
+	LL_LOOP(struct sim_body *, body, sim->bodies) {
+		double rate = 0;
+		for (size_t i = 0; i < body->coordinates_len; ++i, state_i += 2)
+			for (size_t v = 0; v < 2; ++v) {
+				double *arg = &args[sim->internal_coordinates_start + state_i + v], saved = *arg;
+				double delta = 1e-6 * fmax(1, fabs(saved));
+				*arg += delta;
+				sim_dydt(sim, args, out);
+				*arg = saved;
+				double change = fabs(out[state_i + 1] - base[state_i + 1]) / delta;
+				if (isfinite(change)) rate = fmax(rate, v ? change : sqrt(change));
+			}
+		rates[body_i++] = rate;
+		if (rate > 0 && rate < slowest) slowest = rate;
+	}
+
+	body_i = 0;
+	LL_LOOP(struct sim_body *, body, sim->bodies) {
+		double ratio = rates[body_i++] / slowest; // 0 if no body has a rate
+		body->substeps = 1;
+		if (ratio >= SIM_MULTIRATE_RATIO)
+			while (body->substeps < ratio) body->substeps *= 2;
+	}
+}
+
+// splits dydt_output into the slow and fast groups, compiling a visitor for each, groups is NULL or receives the expressions of each
+static bool sim_compile_multirate(CWRAPPER_OUTPUT_TYPE *error, struct sim_simulation *sim, const struct sim_kernel *kernel, CVecBasic *visitor_args, CVecBasic *dydt_output, CVecBasic **groups) {
+	CWRAPPER_OUTPUT_TYPE sym_error = 0;
+	bool res = false;
+	CVecBasic *slow_output = NULL, *fast_output = NULL;
+	sim_basic temp = NULL;
+	struct sim_model *model = sim->internal_model;
+
+	if (sim->multirate == SIM_MULTIRATE_AUTO) sim_estimate_substeps(sim);
+
+	size_t state_len = SIM_STATE_LEN(sim), fast_len = 0;
+	unsigned substeps = 1;
+	LL_LOOP(struct sim_body *, body, sim->bodies) {
+		if (body->substeps <= 1) continue;
+		fast_len += 2 * body->coordinates_len;
+		if (body->substeps > substeps) substeps = body->substeps;
+	}
+	if (fast_len == 0 || fast_len == state_len) return true; // a single group, integrated as usual
+
+	BASIC_NEW(temp);
+	ASSERT(model->slow_state = calloc(state_len - fast_len, sizeof(*model->slow_state)));
+	ASSERT(model->fast_state = calloc(fast_len, sizeof(*model->fast_state)));
+	ASSERT(slow_output = vecbasic_new());
+	ASSERT(fast_output = vecbasic_new());
+	size_t state_i = 0;
+	LL_LOOP(struct sim_body *, body, sim->bodies) {
+		bool fast = body->substeps > 1;
+		for (size_t i = 0; i < 2 * body->coordinates_len; ++i, ++state_i) {
+			ASSERT_SYM(vecbasic_get(dydt_output, state_i, temp));
+			ASSERT_SYM(vecbasic_push_back(fast ? fast_output : slow_output, temp));
+			if (fast)
+				model->fast_state[model->fast_len++] = state_i;
+			else
+				model->slow_state[model->slow_len++] = state_i;
+		}
+	}
+	model->substeps = substeps + (substeps & 1); // even, so the fast group passes through the middle of the step
+
+	ASSERT(model->dydt_slow_func = sim_visitor_new(kernel, visitor_args, slow_output));
+	ASSERT(model->dydt_fast_func = sim_visitor_new(kernel, visitor_args, fast_output));
+	if (groups) {
+		groups[0] = slow_output;
+		groups[1] = fast_output;
+		slow_output = fast_output = NULL;
+	}
+
+	res = true;
+fail:
+	BASIC_FREE(temp);
+	vecbasic_free(slow_output);
+	vecbasic_free(fast_output);
+	if (sym_error) *error = sym_error;
+	return res;
+}
+
 bool sim_compile(CWRAPPER_OUTPUT_TYPE *error, struct sim_simulation *sim) {
 	// buffer string for defining symbols
 	const size_t str_length = 16 + log10i(SIZE_MAX);
@@ -208,19 +559,30 @@ bool sim_compile(CWRAPPER_OUTPUT_TYPE *error, struct sim_simulation *sim) {
 	bool res = false;
 
 	CWRAPPER_OUTPUT_TYPE sym_error = 0;
+	METRICS_START(phase_equations);
 
-	free(sim->internal_func_args);
-	sim->internal_func_args = NULL;
+	free(sim->out_observables);
+	sim->out_observables = NULL;
+	sim->observables_len = 0;
+	sim->events_len = 0;
+	sim->out_event = NULL;
+	sim->internal_step_size = 0;
+	sim->internal_args_len = sim->internal_coordinates_start = sim->internal_bodies_len = 0;
 
-	// free visitor functions
-	sim_visitor_free(sim->internal_dydt_func);
-	sim_visitor_free(sim->internal_energy_func);
-	sim->internal_dydt_func = NULL;
-	sim->internal_energy_func = NULL;
+	// states of the previous model keep it
+	sim_release_model(sim);
+	struct sim_model *model = sim->internal_model = sim_model_new(sim);
+	if (!model) return false;
 
 	// initialise variables
 
-	CVecBasic *visitor_args = NULL, *system_equations = NULL, *acc_solutions = NULL, *acc_vars = NULL, *dydt_output = NULL, *energy_output = NULL, *time_args = NULL;
+	CVecBasic *visitor_args = NULL, *system_equations = NULL, *acc_solutions = NULL, *acc_vars = NULL, *dydt_output = NULL, *energy_output = NULL, *time_args = NULL, *jacobian_output = NULL, *event_output = NULL;
+	CVecBasic *groups[2] = {NULL, NULL};
+
+	// tiered compilation starts with every kernel on the lambda backend, the autotuner settles the backend of those after the time derivative
+	bool tiered = sim->tiered && sim->kernel.backend != SIM_BACKEND_LAMBDA && !(sim->autotune_calls > 0);
+	struct sim_kernel lambda_kernel = {.backend = SIM_BACKEND_LAMBDA, .opt_level = sim->kernel.opt_level, .cse = sim->kernel.cse};
+	const struct sim_kernel *kernel = tiered ? &lambda_kernel : &sim->kernel;
 	CMapBasicBasic *to_func_subs = NULL, *to_sym_subs = NULL;
 	sim_basic lagrangian = NULL, temp = NULL, temp2 = NULL;
 	size_t coordinates_len = 0;
@@ -242,7 +604,9 @@ bool sim_compile(CWRAPPER_OUTPUT_TYPE *error, struct sim_simulation *sim) {
 	LL_LOOP(struct sim_body *, body, sim->bodies) {
 		// add body other variables
 		for (size_t i = 0; i < body->variables_len; ++i) ASSERT_SYM(vecbasic_push_back(visitor_args, body->sym_variables[i]));
+		++sim->internal_bodies_len;
 	}
+	sim->internal_coordinates_start = vecbasic_size(visitor_args);
 
 	LL_LOOP(struct sim_body *, body, sim->bodies) {
 		// add body coordinates
@@ -253,8 +617,12 @@ bool sim_compile(CWRAPPER_OUTPUT_TYPE *error, struct sim_simulation *sim) {
 		}
 	}
 
-	// initialise args array for calling visitor functions
-	ASSERT(sim->internal_func_args = calloc(vecbasic_size(visitor_args), sizeof(*sim->internal_func_args)));
+	sim->internal_args_len = vecbasic_size(visitor_args);
+	model->args_len = sim->internal_args_len;
+	model->coordinates_start = sim->internal_coordinates_start;
+	model->bodies_len = sim->internal_bodies_len;
+	model->integrator = sim->integrator;
+	model->tolerance = sim->tolerance;
 
 	// initialise map to substitute variables with their function of time variables
 	ASSERT(to_func_subs = mapbasicbasic_new());
@@ -325,9 +693,13 @@ bool sim_compile(CWRAPPER_OUTPUT_TYPE *error, struct sim_simulation *sim) {
 		}
 	}
 
+	METRICS_END(phase_equations, METRICS_COMPILE_NS, "equations of motion", "compile");
+
 	// solve for acceleration
+	METRICS_START(phase_solve);
 	ASSERT(acc_solutions = vecbasic_new());
 	ASSERT_SYM(vecbasic_linsolve(acc_solutions, system_equations, acc_vars));
+	METRICS_END(phase_solve, METRICS_COMPILE_NS, "solve accelerations", "compile");
 
 	// initialise output for time derivative visitor function
 	ASSERT(dydt_output = vecbasic_new());
@@ -342,8 +714,29 @@ bool sim_compile(CWRAPPER_OUTPUT_TYPE *error, struct sim_simulation *sim) {
 	}
 
 	// compile time derivative visitor function
-	ASSERT(sim->internal_dydt_func = sim_visitor_new());
-	sim_visitor_init(sim->internal_dydt_func, visitor_args, dydt_output, 1);
+	METRICS_START(phase_dydt);
+	if (sim->autotune_calls > 0) {
+		// also settles the backend of the other kernels
+		ASSERT(autotune_dydt(sim, visitor_args, dydt_output));
+	} else
+		ASSERT(model->dydt_func = sim_visitor_new(kernel, visitor_args, dydt_output));
+	atomic_store(&model->internal_lock_calls, kernel->backend == SIM_BACKEND_LAMBDA);
+	METRICS_END(phase_dydt, METRICS_COMPILE_NS, "compile dydt", "compile");
+
+#ifdef SIM_USE_LLVM
+	if (sim->precision == SIM_PRECISION_FLOAT) {
+		METRICS_START(phase_dydt_float);
+		ASSERT(model->dydt_func_float = sim_float_visitor_new());
+		sim_float_visitor_init(model->dydt_func_float, visitor_args, dydt_output, sim->kernel.cse, sim->kernel.opt_level);
+		METRICS_END(phase_dydt_float, METRICS_COMPILE_NS, "compile float dydt", "compile");
+	}
+#endif
+
+	if (sim->multirate != SIM_MULTIRATE_OFF) {
+		METRICS_START(phase_multirate);
+		ASSERT(sim_compile_multirate(error, sim, kernel, visitor_args, dydt_output, tiered ? groups : NULL));
+		METRICS_END(phase_multirate, METRICS_COMPILE_NS, "compile multirate", "compile");
+	}
 
 	// initialise output for energy visitor function
 	ASSERT(energy_output = vecbasic_new());
@@ -352,9 +745,84 @@ bool sim_compile(CWRAPPER_OUTPUT_TYPE *error, struct sim_simulation *sim) {
 		ASSERT_SYM(vecbasic_push_back(energy_output, body->sym_potential));
 	}
 
+	// observables are evaluated in the same kernel, after the energies
+	LL_LOOP(struct sim_observable *, observable, sim->observables) {
+		observable->index = sim->observables_len++;
+		ASSERT_SYM(vecbasic_push_back(energy_output, observable->expr));
+	}
+	LL_LOOP(struct sim_body *, body, sim->bodies) {
+		LL_LOOP(struct sim_observable *, observable, body->observables) {
+			observable->index = sim->observables_len++;
+			ASSERT_SYM(vecbasic_push_back(energy_output, observable->expr));
+		}
+	}
+	ASSERT(sim->out_observables = calloc(sim->observables_len + 1, sizeof(*sim->out_observables)));
+	model->observables_len = sim->observables_len;
+
 	// compile energy visitor function
-	ASSERT(sim->internal_energy_func = sim_visitor_new());
-	sim_visitor_init(sim->internal_energy_func, visitor_args, energy_output, 1);
+	METRICS_START(phase_energy);
+	ASSERT(model->energy_func = sim_visitor_new(kernel, visitor_args, energy_output));
+	METRICS_END(phase_energy, METRICS_COMPILE_NS, "compile energy", "compile");
+
+	if (sim->events) {
+		// compile event visitor function
+		METRICS_START(phase_events);
+		ASSERT(event_output = vecbasic_new());
+		LL_LOOP(struct sim_event *, event, sim->events) {
+			event->index = sim->events_len++;
+			ASSERT_SYM(vecbasic_push_back(event_output, event->expr));
+		}
+		ASSERT(model->events = calloc(sim->events_len, sizeof(*model->events)));
+		LL_LOOP(struct sim_event *, event, sim->events) {
+			model->events[event->index] = event;
+		}
+		model->events_len = sim->events_len;
+		ASSERT(model->event_func = sim_visitor_new(kernel, visitor_args, event_output));
+		METRICS_END(phase_events, METRICS_COMPILE_NS, "compile events", "compile");
+	}
+
+	if (sim->compile_jacobian || sim->integrator == SIM_INTEGRATOR_RADAU) {
+		METRICS_START(phase_jacobian);
+		// differentiate each time derivative w.r.t. each state variable, in the same order as the coordinates in visitor_args
+		ASSERT(jacobian_output = vecbasic_new());
+		size_t state_len = vecbasic_size(dydt_output);
+		for (size_t row = 0; row < state_len; ++row) {
+			ASSERT_SYM(vecbasic_get(dydt_output, row, temp));
+			for (size_t col = 0; col < state_len; ++col) {
+				ASSERT_SYM(vecbasic_get(visitor_args, sim->internal_coordinates_start + col, temp2));
+				ASSERT_SYM(basic_diff(temp2, temp, temp2));
+				ASSERT_SYM(vecbasic_push_back(jacobian_output, temp2));
+			}
+		}
+
+		// compile Jacobian visitor function
+		ASSERT(model->jacobian_func = sim_visitor_new(kernel, visitor_args, jacobian_output));
+		METRICS_END(phase_jacobian, METRICS_COMPILE_NS, "compile Jacobian", "compile");
+	}
+
+	ASSERT(sim->internal_state = sim_state_new(sim));
+	sim->internal_state->internal_owner = sim;
+
+	if (tiered) {
+		ASSERT(model->internal_tier = calloc(1, sizeof(*model->internal_tier)));
+		struct sim_tier *tier = model->internal_tier;
+		tier->model = model;
+		tier->kernel = sim->kernel;
+		// the tier takes over the expressions of each kernel
+		struct sim_visitor **slots[SIM_TIER_KERNELS] = {&model->dydt_func, &model->energy_func, &model->event_func,
+		                                                &model->jacobian_func, &model->dydt_slow_func, &model->dydt_fast_func};
+		CVecBasic **exprs[SIM_TIER_KERNELS] = {&dydt_output, &energy_output, &event_output, &jacobian_output, &groups[0], &groups[1]};
+		for (size_t i = 0; i < SIM_TIER_KERNELS; ++i) {
+			if (!*slots[i]) continue;
+			tier->slots[tier->len] = slots[i];
+			tier->exprs[tier->len++] = *exprs[i];
+			*exprs[i] = NULL;
+		}
+		tier->args = visitor_args;
+		visitor_args = NULL;
+		tier->started = !pthread_create(&tier->thread, NULL, sim_tier_func, tier);
+		if (!tier->started) sim_tier_func(tier); // compile them on this thread instead
+	}
 
 	res = true;
 fail:
@@ -368,111 +836,569 @@ fail:
 	vecbasic_free(acc_vars);
 	vecbasic_free(dydt_output);
 	vecbasic_free(energy_output);
+	vecbasic_free(jacobian_output);
+	vecbasic_free(event_output);
+	vecbasic_free(groups[0]);
+	vecbasic_free(groups[1]);
 	vecbasic_free(time_args);
 	mapbasicbasic_free(to_func_subs);
 	mapbasicbasic_free(to_sym_subs);
 
-	if (res) return true;
-	sim_visitor_free(sim->internal_dydt_func);
-	sim_visitor_free(sim->internal_energy_func);
-	sim->internal_dydt_func = NULL;
-	sim->internal_energy_func = NULL;
+	if (res) {
+		sim_update_energy(sim);
+		return true;
+	}
+	sim_release_model(sim);
+	sim->events_len = 0;
 	if (sym_error) *error = sym_error;
 	return false;
 }
 
+// the lambda visitor isn't thread safe, the LLVM one is
+// whether to lock is read once, as tiered compilation stops locking (under the lock) when it swaps in the LLVM kernels,
+// so the kernels have to be read from the model after locking
+#define SIM_LOCK_CALLS(model)                                                                                  \
+	bool sim_calls_locked = atomic_load_explicit(&(model)->internal_lock_calls, memory_order_acquire);         \
+	if (sim_calls_locked) pthread_mutex_lock((pthread_mutex_t *) &(model)->internal_call_lock)
+#define SIM_UNLOCK_CALLS(model)                                                                                \
+	{                                                                                                          \
+		if (sim_calls_locked) pthread_mutex_unlock((pthread_mutex_t *) &(model)->internal_call_lock);           \
+	}
+#define SIM_CALL_UNLOCKED(func, out, args)                  \
+	{                                                       \
+		METRICS_START(start);                               \
+		sim_visitor_call(func, out, args);                  \
+		METRICS_END(start, METRICS_VISITOR_NS, NULL, NULL); \
+	}
+
+// func is where the kernel is stored in the model, read once locked
+static void sim_call(const struct sim_model *model, struct sim_visitor *const *func, double *out, const double *args) {
+	SIM_LOCK_CALLS(model);
+	SIM_CALL_UNLOCKED(*func, out, args);
+	SIM_UNLOCK_CALLS(model);
+}
+
 struct dydt_data {
-	struct sim_simulation *simulation;
-	size_t coordinates_start_index;
+	const struct sim_model *model;
+	double *args;
 };
 
 static void dydt(double t, double y[], double out[], void *custom) {
 	struct dydt_data *data = custom;
-	struct sim_simulation *sim = data->simulation;
+	const struct sim_model *model = data->model;
+
+	// copy rk4 variables to visitor arguments, the coordinates are stored last as (position, velocity) pairs
+	memcpy(data->args + model->coordinates_start, y, SIM_MODEL_STATE_LEN(model) * sizeof(*y));
+
+	// run ODE function
+	METRICS_COUNT(METRICS_DYDT_CALLS, 1);
+	sim_call(model, &model->dydt_func, out, data->args);
+}
+
+static void jacobian(double t, double y[], double out[], void *custom) {
+	struct dydt_data *data = custom;
+	const struct sim_model *model = data->model;
+	memcpy(data->args + model->coordinates_start, y, SIM_MODEL_STATE_LEN(model) * sizeof(*y));
+	METRICS_COUNT(METRICS_JACOBIAN_CALLS, 1);
+	sim_call(model, &model->jacobian_func, out, data->args);
+}
+
+// classic Runge-Kutta order 4 specialised for a state of M items, so the stages are unrolled and kept in registers
+// the weighted sum of the stages is accumulated as each one is evaluated, instead of storing all four
+// the lambda backend's lock is taken once for the whole integration rather than around every call
+#define SIM_RK4_KERNEL(M)                                                                                                 \
+	static void sim_rk4_##M(const struct sim_model *model, double *args, int steps, double dt, double *trajectory) {      \
+		double stage_args[model->args_len];                                                                               \
+		memcpy(stage_args, args, sizeof(stage_args));                                                                    \
+		double *y = args + model->coordinates_start, *stage = stage_args + model->coordinates_start;                     \
+		double y0[M], k[M], acc[M];                                                                                       \
+		const double half = dt / 2, third = dt / 3, sixth = dt / 6;                                                       \
+		for (int i = 0; i < M; ++i) y0[i] = y[i];                                                                         \
+		if (trajectory) memcpy(trajectory, y0, sizeof(y0));                                                               \
+		SIM_LOCK_CALLS(model);                                                                                            \
+		struct sim_visitor *func = model->dydt_func;                                                                      \
+		for (int step = 1; step <= steps; ++step) {                                                                       \
+			SIM_CALL_UNLOCKED(func, k, stage_args);                                                                       \
+			for (int i = 0; i < M; ++i) acc[i] = y0[i] + sixth * k[i], stage[i] = y0[i] + half * k[i];                    \
+			SIM_CALL_UNLOCKED(func, k, stage_args);                                                                       \
+			for (int i = 0; i < M; ++i) acc[i] += third * k[i], stage[i] = y0[i] + half * k[i];                           \
+			SIM_CALL_UNLOCKED(func, k, stage_args);                                                                       \
+			for (int i = 0; i < M; ++i) acc[i] += third * k[i], stage[i] = y0[i] + dt * k[i];                             \
+			SIM_CALL_UNLOCKED(func, k, stage_args);                                                                       \
+			for (int i = 0; i < M; ++i) stage[i] = y0[i] = acc[i] + sixth * k[i];                                         \
+			if (trajectory) memcpy(trajectory + M * step, y0, sizeof(y0));                                                \
+		}                                                                                                                 \
+		SIM_UNLOCK_CALLS(model);                                                                                          \
+		for (int i = 0; i < M; ++i) y[i] = y0[i];                                                                         \
+		METRICS_COUNT(METRICS_DYDT_CALLS, 4 * (uint64_t) steps);                                                          \
+		METRICS_COUNT(METRICS_RK_STEPS, steps);                                                                           \
+	}
+SIM_RK4_KERNEL(2)
+SIM_RK4_KERNEL(4)
+SIM_RK4_KERNEL(6)
+SIM_RK4_KERNEL(8)
+#undef SIM_RK4_KERNEL
+
+// multirate RK4, each step of the slow group spanning substeps RK4 steps of the fast group
+// the fast group goes first, seeing the slow coordinates extrapolated by the cubic Hermite interpolant of the previous step,
+// then the slow group takes one RK4 step, seeing the fast coordinates the fast group passed through at its stage times
+// so only the coupling from the slow to the fast group is approximated, to fourth order (second for the first step)
+static void sim_rk4_multirate(const struct sim_model *model, double *args, int steps, double dt, double *trajectory) {
+	size_t state_len = SIM_MODEL_STATE_LEN(model), slow_len = model->slow_len, fast_len = model->fast_len;
+	const size_t *slow = model->slow_state, *fast = model->fast_state;
+	unsigned substeps = model->substeps;
+	double stage_args[model->args_len];
+	memcpy(stage_args, args, sizeof(stage_args));
+	double *y = args + model->coordinates_start, *stage = stage_args + model->coordinates_start;
+	double slow_y[slow_len], slow_rate[slow_len], slow_k[slow_len], slow_acc[slow_len], slow_prev_y[slow_len], slow_prev_rate[slow_len];
+	double fast_y[fast_len], fast_k[fast_len], fast_acc[fast_len], fast_mid[fast_len];
+	const double h = dt / substeps, half = dt / 2, third = dt / 3, sixth = dt / 6;
+
+	if (trajectory) memcpy(trajectory, y, state_len * sizeof(*y));
+	SIM_LOCK_CALLS(model);
+	for (int step = 1; step <= steps; ++step) {
+		memcpy(stage, y, state_len * sizeof(*y));
+		for (size_t i = 0; i < slow_len; ++i) slow_y[i] = y[slow[i]];
+		for (size_t i = 0; i < fast_len; ++i) fast_y[i] = y[fast[i]];
+		SIM_CALL_UNLOCKED(model->dydt_slow_func, slow_rate, stage_args);
+
+		for (unsigned sub = 0; sub < substeps; ++sub) {
+			static const double stage_offset[] = {0, 0.5, 0.5, 1}, stage_weight[] = {1.0 / 6, 1.0 / 3, 1.0 / 3, 1.0 / 6};
+			for (size_t i = 0; i < fast_len; ++i) fast_acc[i] = fast_y[i];
+			for (int k = 0; k < 4; ++k) {
+				// slow positions are extrapolated to second order, as their velocities' derivative is known
+				double tau = (sub + stage_offset[k]) * h;
+				if (step > 1) {
+					// Hermite basis functions on the previous step, continued past its end
+					double s = 1 + tau / dt, s2 = s * s, s3 = s2 * s;
+					double h00 = 2 * s3 - 3 * s2 + 1, h10 = (s3 - 2 * s2 + s) * dt, h01 = 3 * s2 - 2 * s3, h11 = (s3 - s2) * dt;
+					for (size_t i = 0; i < slow_len; ++i) stage[slow[i]] = h00 * slow_prev_y[i] + h10 * slow_prev_rate[i] + h01 * slow_y[i] + h11 * slow_rate[i];
+				} else {
+					// slow positions to second order, as their velocities' derivative is known
+					for (size_t i = 0; i < slow_len; i += 2) {
+						stage[slow[i]] = slow_y[i] + tau * (slow_rate[i] + tau / 2 * slow_rate[i + 1]);
+						stage[slow[i + 1]] = slow_y[i + 1] + tau * slow_rate[i + 1];
+					}
+				}
+				if (k > 0)
+					for (size_t i = 0; i < fast_len; ++i) stage[fast[i]] = fast_y[i] + stage_offset[k] * h * fast_k[i];
+				SIM_CALL_UNLOCKED(model->dydt_fast_func, fast_k, stage_args);
+				for (size_t i = 0; i < fast_len; ++i) fast_acc[i] += stage_weight[k] * h * fast_k[i];
+			}
+			for (size_t i = 0; i < fast_len; ++i) stage[fast[i]] = fast_y[i] = fast_acc[i];
+			if (sub + 1 == substeps / 2) memcpy(fast_mid, fast_y, sizeof(fast_y));
+		}
+
+		// the first stage of the slow group is slow_rate, at the start of the step
+		for (size_t i = 0; i < fast_len; ++i) stage[fast[i]] = fast_mid[i];
+		for (size_t i = 0; i < slow_len; ++i) slow_acc[i] = slow_y[i] + sixth * slow_rate[i], stage[slow[i]] = slow_y[i] + half * slow_rate[i];
+		SIM_CALL_UNLOCKED(model->dydt_slow_func, slow_k, stage_args);
+		for (size_t i = 0; i < slow_len; ++i) slow_acc[i] += third * slow_k[i], stage[slow[i]] = slow_y[i] + half * slow_k[i];
+		SIM_CALL_UNLOCKED(model->dydt_slow_func, slow_k, stage_args);
+		for (size_t i = 0; i < slow_len; ++i) slow_acc[i] += third * slow_k[i], stage[slow[i]] = slow_y[i] + dt * slow_k[i];
+		for (size_t i = 0; i < fast_len; ++i) stage[fast[i]] = fast_y[i];
+		SIM_CALL_UNLOCKED(model->dydt_slow_func, slow_k, stage_args);
+		memcpy(slow_prev_y, slow_y, sizeof(slow_y));
+		memcpy(slow_prev_rate, slow_rate, sizeof(slow_rate));
+		for (size_t i = 0; i < slow_len; ++i) y[slow[i]] = slow_acc[i] + sixth * slow_k[i];
+		for (size_t i = 0; i < fast_len; ++i) y[fast[i]] = fast_y[i];
+		if (trajectory) memcpy(trajectory + state_len * step, y, state_len * sizeof(*y));
+	}
+	SIM_UNLOCK_CALLS(model);
+	METRICS_COUNT(METRICS_DYDT_CALLS, (4 + 4 * (uint64_t) substeps) * steps);
+	METRICS_COUNT(METRICS_RK_STEPS, steps);
+}
+
+void sim_pack_args(const struct sim_simulation *sim, double *args) {
+	size_t arg_i = 0;
+
+	for (size_t i = 0; i < sim->variables_len; ++i)
+		args[arg_i++] = sim->in_variables[i];
 
-	size_t rk4_i = 0, arg_i = data->coordinates_start_index;
+	LL_LOOP(struct sim_body *, body, sim->bodies) {
+		for (size_t i = 0; i < body->variables_len; ++i)
+			args[arg_i++] = body->in_variables[i];
+	}
 
-	// copy body coordinates to visitor arguments
 	LL_LOOP(struct sim_body *, body, sim->bodies) {
-		// copy body coordinates to rk4 variables
 		for (size_t i = 0; i < body->coordinates_len; ++i) {
-			sim->internal_func_args[arg_i++] = y[rk4_i++]; // position
-			sim->internal_func_args[arg_i++] = y[rk4_i++]; // velocity
+			args[arg_i++] = body->coordinates[i].position;
+			args[arg_i++] = body->coordinates[i].velocity;
 		}
 	}
+}
 
-	// run ODE function
-	sim_visitor_call(sim->internal_dydt_func, out, sim->internal_func_args);
+void sim_unpack_args(struct sim_simulation *sim, const double *args) {
+	size_t arg_i = sim->internal_coordinates_start;
+	LL_LOOP(struct sim_body *, body, sim->bodies) {
+		for (size_t i = 0; i < body->coordinates_len; ++i) {
+			body->coordinates[i].position = args[arg_i++];
+			body->coordinates[i].velocity = args[arg_i++];
+		}
+	}
 }
 
-bool sim_step(struct sim_simulation *sim, int steps, double time_span) {
+static bool sim_model_integrate(const struct sim_model *model, double *args, int steps, double time_span, double *trajectory, double *step_size) {
 	if (steps < 1) return false;
 	if (time_span <= 0) return false;
+	if (!model->dydt_func) return false;
 
-	size_t arg_i = 0;
+	size_t rk4_len = SIM_MODEL_STATE_LEN(model); // number of coordinates to iterate through
+	double *rk4_coordinates = args + model->coordinates_start;
+
+	// copy of args for evaluating the intermediate stages
+	double stage_args[model->args_len];
+	memcpy(stage_args, args, sizeof(stage_args));
+	struct dydt_data data = {
+	        .model = model,
+	        .args = stage_args};
+
+	if (model->integrator == SIM_INTEGRATOR_RADAU) {
+		if (!model->jacobian_func) return false;
+		double local_step_size = 0;
+		if (!step_size) step_size = &local_step_size;
+		struct radau_stats stats = {0};
+
+		// the trajectory is interpolated within the steps, which are left to the error control either way
+		if (trajectory) memcpy(trajectory, rk4_coordinates, rk4_len * sizeof(*rk4_coordinates));
+		bool res = radau5(dydt, jacobian, 0, time_span, rk4_coordinates, rk4_len, trajectory ? steps : 0, trajectory ? trajectory + rk4_len : NULL,
+		                  step_size, model->tolerance, model->tolerance, &data, &stats);
+		METRICS_COUNT(METRICS_RK_STEPS, stats.steps);
+		return res;
+	}
 
-	size_t rk4_len = 0; // number of coordinates to iterate through
+	if (model->dydt_fast_func) {
+		sim_rk4_multirate(model, args, steps, time_span / steps, trajectory);
+		return true;
+	}
 
-	size_t body_len = 0;
-	LL_LOOP(struct sim_body *, body, sim->bodies) {
-		++body_len;
-		rk4_len += body->coordinates_len * 2;
-		if (rk4_len < 0) return false; // overflow
+	// specialised kernels for the common small states
+	switch (rk4_len) {
+		case 2: sim_rk4_2(model, args, steps, time_span / steps, trajectory); return true;
+		case 4: sim_rk4_4(model, args, steps, time_span / steps, trajectory); return true;
+		case 6: sim_rk4_6(model, args, steps, time_span / steps, trajectory); return true;
+		case 8: sim_rk4_8(model, args, steps, time_span / steps, trajectory); return true;
 	}
 
 	// initialise rk4 variables
 
 	double tspan[2] = {0, time_span};
 
-	double rk4_coordinates[rk4_len * (steps + 1)];
 	double time_out[steps + 1];
+	double local_trajectory[trajectory ? 1 : rk4_len * (steps + 1)];
+	if (!trajectory) trajectory = local_trajectory;
 
-	// initialise visitor variables
+	// perform Runge-Kutta order 4
+	rk4(dydt, tspan, rk4_coordinates, steps, rk4_len, time_out, trajectory, &data);
+	METRICS_COUNT(METRICS_RK_STEPS, steps);
 
-	for (size_t i = 0; i < sim->variables_len; ++i)
-		sim->internal_func_args[arg_i++] = sim->in_variables[i];
+	// copy last set of coordinates back
+	memcpy(rk4_coordinates, trajectory + rk4_len * steps, rk4_len * sizeof(*rk4_coordinates));
+	return true;
+}
 
-	size_t rk4_i = 0;
-	LL_LOOP(struct sim_body *, body, sim->bodies) {
-		for (size_t i = 0; i < body->variables_len; ++i)
-			sim->internal_func_args[arg_i++] = body->in_variables[i];
-		// skip setting position and velocity coordinates for internal_func_args, that is done in the dydt function
+bool sim_integrate(const struct sim_simulation *sim, double *args, int steps, double time_span, double *trajectory, double *step_size) {
+	return sim->internal_model && sim_model_integrate(sim->internal_model, args, steps, time_span, trajectory, step_size);
+}
 
-		// copy body coordinates to rk4 variables
-		for (size_t i = 0; i < body->coordinates_len; ++i) {
-			rk4_coordinates[rk4_i++] = body->coordinates[i].position;
-			rk4_coordinates[rk4_i++] = body->coordinates[i].velocity;
+void sim_dydt_float(const struct sim_simulation *sim, const float *args, float *out) {
+	const struct sim_model *model = sim->internal_model;
+	METRICS_COUNT(METRICS_DYDT_CALLS, 1);
+#ifdef SIM_USE_LLVM
+	if (model->dydt_func_float) {
+		METRICS_START(start);
+		sim_float_visitor_call(model->dydt_func_float, out, args);
+		METRICS_END(start, METRICS_VISITOR_NS, NULL, NULL);
+		return;
+	}
+#endif
+	// no float kernel, so evaluate in double and round the result
+	double args_double[model->args_len], out_double[SIM_MODEL_STATE_LEN(model)];
+	for (size_t i = 0; i < model->args_len; ++i) args_double[i] = args[i];
+	sim_call(model, &model->dydt_func, out_double, args_double);
+	for (size_t i = 0; i < SIM_MODEL_STATE_LEN(model); ++i) out[i] = out_double[i];
+}
+
+bool sim_integrate_float(const struct sim_simulation *sim, float *args, int steps, double time_span, float *trajectory) {
+	if (steps < 1) return false;
+	if (time_span <= 0) return false;
+	if (!sim->internal_model) return false;
+
+	size_t len = SIM_STATE_LEN(sim);
+	float *y = args + sim->internal_coordinates_start, dt = time_span / steps;
+
+	float stage_args[sim->internal_args_len], k[4][len];
+	float *stage = stage_args + sim->internal_coordinates_start;
+	memcpy(stage_args, args, sizeof(stage_args));
+
+	if (trajectory) memcpy(trajectory, y, len * sizeof(*y));
+	for (int step = 1; step <= steps; ++step) {
+		// classic Runge-Kutta order 4, same as rk4()
+		sim_dydt_float(sim, args, k[0]);
+		for (size_t i = 0; i < len; ++i) stage[i] = y[i] + dt * k[0][i] / 2;
+		sim_dydt_float(sim, stage_args, k[1]);
+		for (size_t i = 0; i < len; ++i) stage[i] = y[i] + dt * k[1][i] / 2;
+		sim_dydt_float(sim, stage_args, k[2]);
+		for (size_t i = 0; i < len; ++i) stage[i] = y[i] + dt * k[2][i];
+		sim_dydt_float(sim, stage_args, k[3]);
+		for (size_t i = 0; i < len; ++i) y[i] += dt * (k[0][i] + 2 * k[1][i] + 2 * k[2][i] + k[3][i]) / 6;
+		if (trajectory) memcpy(trajectory + len * step, y, len * sizeof(*y));
+	}
+	METRICS_COUNT(METRICS_RK_STEPS, steps);
+	return true;
+}
+
+void sim_energy(const struct sim_simulation *sim, const double *args, double *energy) {
+	sim_call(sim->internal_model, &sim->internal_model->energy_func, energy, args);
+}
+
+static void sim_model_dydt(const struct sim_model *model, const double *args, double *out) {
+	METRICS_COUNT(METRICS_DYDT_CALLS, 1);
+	sim_call(model, &model->dydt_func, out, args);
+}
+
+void sim_dydt(const struct sim_simulation *sim, const double *args, double *out) {
+	sim_model_dydt(sim->internal_model, args, out);
+}
+
+bool sim_jacobian(const struct sim_simulation *sim, const double *args, double *jacobian) {
+	const struct sim_model *model = sim->internal_model;
+	if (!model || !model->jacobian_func) return false;
+	METRICS_COUNT(METRICS_JACOBIAN_CALLS, 1);
+	sim_call(model, &model->jacobian_func, jacobian, args);
+	return true;
+}
+
+void sim_event_values(const struct sim_simulation *sim, const double *args, double *values) {
+	sim_call(sim->internal_model, &sim->internal_model->event_func, values, args);
+}
+
+double sim_hermite(const double *y0, const double *y1, const double *f0, const double *f1, double dt, double theta, size_t i) {
+	double t2 = theta * theta, t3 = t2 * theta;
+	return (2 * t3 - 3 * t2 + 1) * y0[i] + (t3 - 2 * t2 + theta) * dt * f0[i] + (-2 * t3 + 3 * t2) * y1[i] + (t3 - t2) * dt * f1[i];
+}
+
+// the whole state interpolated at fraction theta of a step
+static void sim_hermite_state(const struct sim_model *model, double *out, const double *y0, const double *y1, const double *f0, const double *f1, double dt, double theta) {
+	for (size_t i = 0; i < SIM_MODEL_STATE_LEN(model); ++i) out[i] = sim_hermite(y0, y1, f0, f1, dt, theta, i);
+}
+
+double sim_find_root(double func(double theta, void *custom), void *custom, double g0, double g1, bool wraps) {
+	double a = 0, b = 1, ga = g0, gb = g1;
+	bool rising = g1 > g0;
+	int side = 0;
+	for (int i = 0; i < 64 && b - a > 1e-13; ++i) {
+		double c = (a * gb - b * ga) / (gb - ga);
+		if (!(c > a && c < b)) c = (a + b) / 2;
+		double gc = func(c, custom);
+		if (wraps) gc = remainder(gc, 2 * M_PI);
+		if (rising ? gc >= 0 : gc <= 0) {
+			b = c, gb = gc;
+			if (side == 1) ga /= 2; // halve the stale end's value so it can't get stuck
+			side = 1;
+		} else {
+			a = c, ga = gc;
+			if (side == -1) gb /= 2;
+			side = -1;
 		}
 	}
+	return b;
+}
 
-	// perform Runge-Kutta order 4
-	struct dydt_data data = {
-	        .simulation = sim,
-	        .coordinates_start_index = arg_i};
-	rk4(dydt, tspan, rk4_coordinates, steps, rk4_len, time_out, rk4_coordinates, &data);
+static bool sim_event_crosses(const struct sim_event *event, double g0, double g1) {
+	if (g0 < 0 && g1 >= 0) return event->direction >= 0;
+	if (g0 > 0 && g1 <= 0) return event->direction <= 0;
+	return false;
+}
 
-	rk4_i = rk4_len * steps; // index of last set of coordinates
-	LL_LOOP(struct sim_body *, body, sim->bodies) {
-		for (size_t i = 0; i < body->coordinates_len; ++i) {
-			// copy coordinates into visitor arguments again to calculate energy values
-			sim->internal_func_args[arg_i++] = rk4_coordinates[rk4_i];     // position
-			sim->internal_func_args[arg_i++] = rk4_coordinates[rk4_i + 1]; // velocity
-			// and copy back into bodies
-			body->coordinates[i].position = rk4_coordinates[rk4_i++]; // position
-			body->coordinates[i].velocity = rk4_coordinates[rk4_i++]; // velocity
+struct sim_event_root {
+	const struct sim_model *model;
+	size_t e;
+	double *args, *values;
+	const double *y0, *y1, *f0, *f1;
+	double dt;
+};
+
+// value of the event function on the step's interpolant, leaving the interpolated state in args
+static double sim_event_root_func(double theta, void *custom) {
+	struct sim_event_root *root = custom;
+	const struct sim_model *model = root->model;
+	sim_hermite_state(model, root->args + model->coordinates_start, root->y0, root->y1, root->f0, root->f1, root->dt, theta);
+	sim_call(model, &model->event_func, root->values, root->args);
+	return root->values[root->e];
+}
+
+// integrates the state's args like sim_integrate, checking the events between every step and handling their crossings in time order
+static bool sim_state_step_events(struct sim_state *state, int steps, double time_span) {
+	const struct sim_model *model = state->model;
+	if (steps < 1 || time_span <= 0 || !model->event_func) return false;
+
+	size_t len = SIM_MODEL_STATE_LEN(model), start = model->coordinates_start, events_len = model->events_len;
+	double *args = state->args, dt = time_span / steps, elapsed = 0;
+	double event_args[model->args_len], f0[len], f1[len], theta[events_len], root_values[events_len];
+	if (steps > state->internal_workspace_steps) {
+		double *trajectory = realloc(state->internal_trajectory, (steps + 1) * len * sizeof(*trajectory));
+		if (trajectory) state->internal_trajectory = trajectory;
+		double *values = realloc(state->internal_event_values, (steps + 1) * events_len * sizeof(*values));
+		if (values) state->internal_event_values = values;
+		if (!trajectory || !values) return false;
+		state->internal_workspace_steps = steps;
+	}
+	double *trajectory = state->internal_trajectory, *values = state->internal_event_values;
+	memcpy(event_args, args, sizeof(event_args));
+
+	while (steps > 0) {
+		if (!sim_model_integrate(model, args, steps, steps * dt, trajectory, &state->step_size)) return false;
+		for (int j = 0; j <= steps; ++j) {
+			memcpy(event_args + start, trajectory + j * len, len * sizeof(*args));
+			sim_call(model, &model->event_func, values + j * events_len, event_args);
+		}
+
+		bool restart = false;
+		for (int j = 1; j <= steps && !restart; ++j) {
+			const double *y0 = trajectory + (j - 1) * len, *y1 = y0 + len, *g0 = values + (j - 1) * events_len, *g1 = g0 + events_len;
+
+			// locate every crossing within this step
+			bool crossed = false;
+			for (size_t e = 0; e < events_len; ++e) {
+				theta[e] = NAN;
+				if (!sim_event_crosses(model->events[e], g0[e], g1[e])) continue;
+				if (!crossed) {
+					memcpy(event_args + start, y0, len * sizeof(*args));
+					sim_model_dydt(model, event_args, f0);
+					memcpy(event_args + start, y1, len * sizeof(*args));
+					sim_model_dydt(model, event_args, f1);
+					crossed = true;
+				}
+				struct sim_event_root root = {.model = model, .e = e, .args = event_args, .values = root_values, .y0 = y0, .y1 = y1, .f0 = f0, .f1 = f1, .dt = dt};
+				theta[e] = sim_find_root(sim_event_root_func, &root, g0[e], g1[e], false);
+			}
+
+			while (crossed && !restart) {
+				size_t first = events_len;
+				for (size_t e = 0; e < events_len; ++e)
+					if (!isnan(theta[e]) && (first == events_len || theta[e] < theta[first])) first = e;
+				if (first == events_len) break;
+				double event_theta = theta[first];
+				theta[first] = NAN;
+
+				sim_hermite_state(model, event_args + start, y0, y1, f0, f1, dt, event_theta);
+				struct sim_event *event = model->events[first];
+				double time = state->time + elapsed + (j - 1 + event_theta) * dt;
+				++state->event_counts[first];
+				state->event_times[first] = time;
+				if (state->internal_owner) {
+					++event->count;
+					event->last_time = time;
+				}
+				enum sim_event_action action = event->callback ? event->callback(model->sim, event, time, event_args) : SIM_EVENT_CONTINUE;
+				if (action == SIM_EVENT_CONTINUE) continue;
+
+				// discard the trajectory after the event, and carry on from its state if it was modified
+				memcpy(args + start, event_args + start, len * sizeof(*args));
+				elapsed += (j - 1 + event_theta) * dt;
+				steps -= j - 1;
+				if (action == SIM_EVENT_STOP) state->out_event = event;
+				if (action == SIM_EVENT_STOP || elapsed >= time_span)
+					steps = 0;
+				else
+					dt = (time_span - elapsed) / steps;
+				restart = true;
+			}
 		}
+		if (!restart) {
+			elapsed = time_span;
+			break;
+		}
+	}
+
+	state->time += elapsed;
+	return true;
+}
+
+struct sim_state *sim_state_new(const struct sim_simulation *sim) {
+	struct sim_model *model = sim->internal_model;
+	if (!model) return NULL;
+	struct sim_state *state = calloc(1, sizeof(*state));
+	if (!state) return NULL;
+	state->model = sim_model_ref(model);
+	ASSERT(state->args = calloc(model->args_len + 1, sizeof(*state->args)));
+	ASSERT(state->energy = calloc(SIM_MODEL_ENERGY_LEN(model) + 1, sizeof(*state->energy)));
+	ASSERT(state->event_counts = calloc(model->events_len + 1, sizeof(*state->event_counts)));
+	ASSERT(state->event_times = calloc(model->events_len + 1, sizeof(*state->event_times)));
+
+	sim_pack_args(sim, state->args);
+	state->time = sim->time;
+	state->step_size = sim->internal_step_size;
+	for (size_t e = 0; e < model->events_len; ++e) {
+		state->event_counts[e] = model->events[e]->count;
+		state->event_times[e] = model->events[e]->last_time;
+	}
+	sim_state_update_energy(state);
+	return state;
+fail:
+	sim_state_free(state);
+	return NULL;
+}
+
+void sim_state_free(struct sim_state *state) {
+	if (!state) return;
+	sim_model_unref(state->model);
+	free(state->args);
+	free(state->energy);
+	free(state->event_counts);
+	free(state->event_times);
+	free(state->internal_trajectory);
+	free(state->internal_event_values);
+	free(state);
+}
+
+bool sim_state_step(struct sim_state *state, int steps, double time_span) {
+	state->out_event = NULL;
+	if (state->model->events_len) {
+		if (!sim_state_step_events(state, steps, time_span)) return false;
+	} else {
+		if (!sim_model_integrate(state->model, state->args, steps, time_span, NULL, &state->step_size)) return false;
+		state->time += time_span;
 	}
+	sim_state_update_energy(state);
+	return true;
+}
 
-	// perform energy calculations
-	double energy[2 * body_len];
-	sim_visitor_call(sim->internal_energy_func, energy, sim->internal_func_args);
+void sim_state_update_energy(struct sim_state *state) {
+	sim_call(state->model, &state->model->energy_func, state->energy, state->args);
+}
 
-	// copy energy numbers into bodies
-	arg_i = 0;
+// copies the energies of the simulation's state into the bodies and out_observables
+static void sim_store_energy(struct sim_simulation *sim, const double *energy) {
+	size_t arg_i = 0;
 	LL_LOOP(struct sim_body *, body, sim->bodies) {
 		body->out_kinetic = energy[arg_i++];
 		body->out_potential = energy[arg_i++];
 	}
+	memcpy(sim->out_observables, energy + arg_i, sim->observables_len * sizeof(*energy));
+}
 
+bool sim_step(struct sim_simulation *sim, int steps, double time_span) {
+	struct sim_state *state = sim->internal_state;
+	sim->out_event = NULL;
+	if (!state) return false;
+	sim_pack_args(sim, state->args);
+	state->time = sim->time;
+	state->step_size = sim->internal_step_size;
+	bool res = sim_state_step(state, steps, time_span);
+	sim->internal_step_size = state->step_size;
+	if (!res) return false;
+
+	sim->time = state->time;
+	sim->out_event = state->out_event;
+	sim_unpack_args(sim, state->args);
+	sim_store_energy(sim, state->energy);
 	return true;
 }
+
+void sim_update_energy(struct sim_simulation *sim) {
+	sim_pack_args(sim, sim->internal_state->args);
+	sim_state_update_energy(sim->internal_state);
+	sim_store_energy(sim, sim->internal_state->energy);
+}
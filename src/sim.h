@@ -3,27 +3,24 @@
 #include <stddef.h>
 #include <symengine/cwrapper.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #ifdef HAVE_SYMENGINE_LLVM
 #ifndef SIM_NO_USE_LLVM
-#define SIM_USE_LLVM // use LLVM if supported, around 10x faster on my machine
+#define SIM_USE_LLVM // use LLVM by default if supported, around 10x faster on my machine
 #endif
 #endif
 
 #ifdef SIM_USE_LLVM
-#define SIM_JIT_TYPE(x) llvm_double_##x
-#define SIM_VISITOR_TYPE CLLVMDoubleVisitor
-#define sim_visitor_init(...) SIM_JIT_TYPE(visitor_init)(__VA_ARGS__, 2) // compile with -O2 optimisation flag
-#else
-#define SIM_JIT_TYPE(x) lambda_real_double_##x
-#define SIM_VISITOR_TYPE CLambdaRealDoubleVisitor
-#define sim_visitor_init SIM_JIT_TYPE(visitor_init)
+// single precision kernel, only LLVM can compile these
+#define SIM_FLOAT_VISITOR_TYPE CLLVMFloatVisitor
+#define sim_float_visitor_new llvm_float_visitor_new
+#define sim_float_visitor_init llvm_float_visitor_init
+#define sim_float_visitor_call llvm_float_visitor_call
+#define sim_float_visitor_free llvm_float_visitor_free
 #endif
 
-#define sim_visitor_new SIM_JIT_TYPE(visitor_new)
-#define sim_visitor_call SIM_JIT_TYPE(visitor_call)
-#define sim_visitor_free SIM_JIT_TYPE(visitor_free)
-
 typedef basic_struct *sim_basic;
 
 struct sim_sym_body_coordinate {
@@ -34,6 +31,14 @@ struct sim_num_body_coordinate {
 	double position, velocity;
 };
 
+// named quantity compiled into the same kernel as the energy, so it shares subexpressions with it
+struct sim_observable {
+	char *name;
+	sim_basic expr; // in terms of sym_coordinates, sym_variables, sym_time
+	size_t index;   // index into out_observables, set by sim_compile
+	struct sim_observable *prev, *next;
+};
+
 struct sim_body {
 	size_t coordinates_len, variables_len;
 
@@ -46,11 +51,76 @@ struct sim_body {
 	struct sim_num_body_coordinate *coordinates;
 	double *in_variables, out_kinetic, out_potential;
 
+	struct sim_observable *observables, *observables_last;
+
+	// steps of this body's coordinates per step of the simulation with SIM_MULTIRATE_BODIES, 0 or 1 for the slow group
+	// set by sim_compile with SIM_MULTIRATE_AUTO
+	unsigned substeps;
+
 	void *custom;
 
 	struct sim_body *prev, *next;
 };
 
+enum sim_integrator {
+	SIM_INTEGRATOR_RK4,   // classic fixed-step Runge-Kutta
+	SIM_INTEGRATOR_RADAU, // implicit adaptive Radau IIA for stiff models, needs the Jacobian so it is compiled automatically
+};
+
+// splitting the coordinates into a slow and a fast group for RK4, the fast group taking several substeps per step,
+// each group with its own kernel evaluating only its derivatives
+enum sim_multirate {
+	SIM_MULTIRATE_OFF,    // every coordinate takes every step
+	SIM_MULTIRATE_BODIES, // the coordinates of bodies with substeps > 1 are fast, taking the largest of their substeps
+	SIM_MULTIRATE_AUTO,   // substeps of each body estimated by sim_compile from the frequencies of its coordinates at the current state
+};
+
+// how the kernels are compiled, chosen at runtime
+enum sim_backend {
+	SIM_BACKEND_LAMBDA, // SymEngine's interpreter, quick to compile but slow to evaluate, and its calls are serialised
+	SIM_BACKEND_LLVM,   // machine code JIT compiled by LLVM, only with HAVE_SYMENGINE_LLVM
+};
+
+struct sim_kernel {
+	enum sim_backend backend;
+	int opt_level; // LLVM optimisation level, 0 to 3, also used for the single precision kernel
+	bool cse;      // eliminate common subexpressions before compiling
+};
+
+// kernel compiled from expressions in terms of the args layout, by either backend
+struct sim_visitor;
+
+enum sim_precision {
+	SIM_PRECISION_DOUBLE,
+	SIM_PRECISION_FLOAT, // also compile a single precision kernel for sim_integrate_float, twice the SIMD width for large ensembles
+};
+
+enum sim_event_action {
+	SIM_EVENT_CONTINUE, // carry on integrating
+	SIM_EVENT_STOP,     // end sim_step at the event, setting sim->out_event to it
+	SIM_EVENT_MODIFIED, // the callback changed the coordinates in args, so integrate on from them
+};
+
+struct sim_simulation;
+struct sim_event;
+// called at each zero crossing in time order, with args holding the state at the crossing, interpolated within the step
+typedef enum sim_event_action sim_event_callback(struct sim_simulation *sim, struct sim_event *event, double time, double *args);
+
+// zero crossing of a compiled function of the state, located while integrating in sim_step
+struct sim_event {
+	char *name;
+	sim_basic expr;               // in terms of sym_coordinates, sym_variables
+	int direction;                // 1 to only detect rising crossings, -1 falling, 0 both
+	sim_event_callback *callback; // may be NULL to only count crossings
+	void *custom;
+
+	size_t index; // index into the event values, set by sim_compile
+	unsigned long count;
+	double last_time; // simulation time of the latest crossing
+
+	struct sim_event *prev, *next;
+};
+
 struct sim_basic_list {
 	sim_basic basic;
 	struct sim_basic_list *prev, *next;
@@ -65,6 +135,17 @@ struct sim_simulation {
 	sim_basic *sym_variables;
 	double *in_variables;
 
+	double time; // simulation time, advanced by sim_step
+
+	struct sim_observable *observables, *observables_last;
+	// values of the simulation's observables followed by each body's, in order, updated with the energy
+	size_t observables_len;
+	double *out_observables;
+
+	struct sim_event *events, *events_last;
+	size_t events_len;
+	struct sim_event *out_event; // event which stopped the last sim_step, or NULL
+
 	void *custom;
 
 	// sym_time is used for kinetic/potential energy expressions that depend on time
@@ -72,8 +153,87 @@ struct sim_simulation {
 	// sym_lagrangian is used for constraints, using it for kinetic/potential energy is undefined
 	sim_basic sym_lagrangian;
 
-	double *internal_func_args;
-	SIM_VISITOR_TYPE *internal_dydt_func, *internal_energy_func;
+	// also compile the Jacobian of the time derivative w.r.t. the state, needed for sim_jacobian
+	bool compile_jacobian;
+
+	// both are read by sim_compile
+	enum sim_integrator integrator;
+	double tolerance; // relative and absolute error tolerance for adaptive integrators
+	// step size the adaptive integrator continues from in sim_step, 0 to estimate
+	double internal_step_size;
+
+	enum sim_precision precision;
+	enum sim_multirate multirate;
+
+	// backend of every kernel, defaults to LLVM at -O2 with CSE if SIM_USE_LLVM, otherwise the lambda backend with CSE
+	struct sim_kernel kernel;
+	// when above 0, sim_compile compiles the time derivative with each backend, optimisation level and CSE setting,
+	// keeping the one that is fastest over about this many evaluations, including its compile time, and sets kernel to it
+	double autotune_calls;
+	// file of the compile and evaluation times measured for each model, so later runs only compile the chosen kernel, NULL to not keep them
+	const char *autotune_cache;
+	// sim_compile compiles every kernel with the lambda backend, which is quick, and returns while a background thread compiles them
+	// again with kernel, swapping them in between calls once all are ready, so stepping starts at once (not with autotune_calls)
+	// SymEngine must be built with WITH_SYMENGINE_THREAD_SAFE, as the thread shares the expressions' nodes
+	bool tiered;
+
+	// layout of the args of the kernels: simulation variables, body variables, then (position, velocity) pairs for each coordinate
+	size_t internal_args_len, internal_coordinates_start, internal_bodies_len;
+	struct sim_model *internal_model; // set by sim_compile
+	struct sim_state *internal_state; // stepped by sim_step, with the variables and coordinates of the bodies copied in and out
+};
+
+// the kernels compiled by sim_compile and what they need to be integrated, shared by the simulation and its sim_state contexts,
+// which keep it alive until the last of them is freed, so recompiling or removing the simulation doesn't pull it out from under them
+// it doesn't change once compiled, except for tiered compilation swapping in the faster kernels
+struct sim_model {
+	atomic_size_t refs;
+
+	// layout of args, as in the simulation
+	size_t args_len, coordinates_start, bodies_len, observables_len, events_len;
+	enum sim_integrator integrator;
+	double tolerance;
+	// events in index order, which are counted and whose callbacks are called with sim, so states of a model with events must not
+	// outlive the simulation or its events
+	struct sim_simulation *sim;
+	struct sim_event **events;
+
+	struct sim_visitor *dydt_func, *energy_func, *jacobian_func, *event_func;
+	// multirate groups, as indices into the state of each group's (position, velocity) pairs
+	// only if both groups have coordinates, otherwise dydt_fast_func is NULL
+	size_t slow_len, fast_len, *slow_state, *fast_state;
+	unsigned substeps;
+	struct sim_visitor *dydt_slow_func, *dydt_fast_func;
+#ifdef SIM_USE_LLVM
+	SIM_FLOAT_VISITOR_TYPE *dydt_func_float;
+#endif
+	// the lambda visitors store common subexpressions inside the visitor, so calls have to be serialised
+	atomic_bool internal_lock_calls;
+	pthread_mutex_t internal_call_lock;
+	struct sim_tier *internal_tier; // compiling the kernels of tiered compilation, or NULL
+};
+
+#define SIM_MODEL_STATE_LEN(model) ((model)->args_len - (model)->coordinates_start)
+#define SIM_MODEL_ENERGY_LEN(model) (2 * (model)->bodies_len + (model)->observables_len)
+
+// one trajectory of a compiled model, holding everything that changes while stepping it, so any number of threads can each step
+// their own states of one model at once, without compiling it again or locking (except for the lambda backend's kernels)
+struct sim_state {
+	struct sim_model *model; // referenced by the state
+	double time;
+	double *args;     // variables then coordinates, model->args_len items, which may be changed between steps
+	double step_size; // adaptive integrators continue from this, 0 to estimate
+	double *energy;   // kinetic and potential energy of each body then the observables, SIM_MODEL_ENERGY_LEN items, updated by sim_state_step
+
+	// of each event, by index
+	unsigned long *event_counts;
+	double *event_times;
+	struct sim_event *out_event; // event which stopped the last sim_state_step, or NULL
+
+	struct sim_simulation *internal_owner; // the simulation whose sim_step this is, whose events are counted too, or NULL
+	// reused by sim_state_step with events, internal_workspace_steps + 1 states and event values
+	int internal_workspace_steps;
+	double *internal_trajectory, *internal_event_values;
 };
 
 struct sim_simulation *sim_new(CWRAPPER_OUTPUT_TYPE *error, size_t variables_len);
@@ -83,12 +243,77 @@ void sim_remove(struct sim_simulation *sim);
 struct sim_basic_list *sim_new_constraint(CWRAPPER_OUTPUT_TYPE *error, struct sim_simulation *sim, sim_basic constraint, struct sim_basic_list *insert_before);
 void sim_remove_constraint(struct sim_simulation *sim, struct sim_basic_list *constraint);
 
+// body = NULL to add the observable to the simulation itself, expr is copied
+struct sim_observable *sim_new_observable(CWRAPPER_OUTPUT_TYPE *error, struct sim_simulation *sim, struct sim_body *body, const char *name, sim_basic expr);
+void sim_remove_observable(struct sim_simulation *sim, struct sim_body *body, struct sim_observable *observable);
+struct sim_observable *sim_find_observable(struct sim_simulation *sim, struct sim_body *body, const char *name);
+
+// expr is copied, events are checked between every integration step of sim_step, and located with the step's cubic Hermite interpolant
+struct sim_event *sim_new_event(CWRAPPER_OUTPUT_TYPE *error, struct sim_simulation *sim, const char *name, sim_basic expr, int direction, sim_event_callback *callback, void *custom);
+void sim_remove_event(struct sim_simulation *sim, struct sim_event *event);
+
 struct sim_body *sim_new_body(CWRAPPER_OUTPUT_TYPE *error, struct sim_simulation *sim, size_t coordinates_len, size_t variables_len, struct sim_body *insert_before);
 void sim_remove_body(struct sim_simulation *sim, struct sim_body *body);
 
 // must be called before sim_step and after the last sim_[new/remove]_[body/constraint] call
 // sym_kinetic and sym_potential must be defined for all bodies prior to calling this
 bool sim_compile(CWRAPPER_OUTPUT_TYPE *error, struct sim_simulation *sim);
+// whether the kernels of tiered compilation are still being compiled, while the lambda ones are used
+bool sim_tiering(const struct sim_simulation *sim);
+
+struct sim_model *sim_model_ref(struct sim_model *model);
+// frees the model once nothing else references it
+void sim_model_unref(struct sim_model *model);
+
+// new state of the compiled simulation's model, starting from its current time, variables, coordinates and event counts
+// call it from the thread that owns sim, then step it on any thread
+struct sim_state *sim_state_new(const struct sim_simulation *sim);
+void sim_state_free(struct sim_state *state);
+// integrates the state like sim_step, locating the events between steps, then evaluates its energies
+bool sim_state_step(struct sim_state *state, int steps, double time_span);
+void sim_state_update_energy(struct sim_state *state);
+
+// compiles exprs as a function of args with the backend of kernel, NULL if it isn't available
+struct sim_visitor *sim_visitor_new(const struct sim_kernel *kernel, const CVecBasic *args, const CVecBasic *exprs);
+// not thread safe with the lambda backend
+void sim_visitor_call(const struct sim_visitor *visitor, double *out, const double *args);
+void sim_visitor_free(struct sim_visitor *visitor);
 
 bool sim_step(struct sim_simulation *system, int steps, double time_span);
+// recalculates out_kinetic and out_potential of each body and out_observables from the current state, sim_step and sim_compile already do this
+void sim_update_energy(struct sim_simulation *sim);
+
+// number of state variables integrated, i.e. a (position, velocity) pair per coordinate
+#define SIM_STATE_LEN(sim) ((sim)->internal_args_len - (sim)->internal_coordinates_start)
+
+// copies the current variables and coordinates of the simulation into args, which has internal_args_len items
+void sim_pack_args(const struct sim_simulation *sim, double *args);
+// copies the coordinates in args back into the bodies
+void sim_unpack_args(struct sim_simulation *sim, const double *args);
+
+// integrates the coordinates in args in place, only reading from sim, so it may be called from multiple threads with separate args
+// trajectory is NULL or has room for (steps + 1) * SIM_STATE_LEN(sim) items, to receive the state at every step
+// adaptive integrators choose their own steps, then steps only sets the points in trajectory, and step_size holds the step size to continue from
+bool sim_integrate(const struct sim_simulation *sim, double *args, int steps, double time_span, double *trajectory, double *step_size);
+// like sim_integrate, but with the state stored and integrated (with fixed-step RK4) in single precision
+// uses the float kernel if compiled with SIM_PRECISION_FLOAT and LLVM, otherwise the double kernel rounded to float
+bool sim_integrate_float(const struct sim_simulation *sim, float *args, int steps, double time_span, float *trajectory);
+void sim_dydt_float(const struct sim_simulation *sim, const float *args, float *out);
+// evaluates kinetic and potential energy for each body, followed by the observables, into energy, which has SIM_ENERGY_LEN(sim) items
+#define SIM_ENERGY_LEN(sim) (2 * (sim)->internal_bodies_len + (sim)->observables_len)
+void sim_energy(const struct sim_simulation *sim, const double *args, double *energy);
+// evaluates the event functions into values, which has events_len items
+void sim_event_values(const struct sim_simulation *sim, const double *args, double *values);
+// evaluates the time derivative of the state in args into out, which has SIM_STATE_LEN(sim) items
+void sim_dydt(const struct sim_simulation *sim, const double *args, double *out);
+// evaluates the Jacobian of the time derivative w.r.t. the state in args into jacobian, row-major with SIM_STATE_LEN(sim)^2 items
+// sim must have been compiled with compile_jacobian set
+bool sim_jacobian(const struct sim_simulation *sim, const double *args, double *jacobian);
+
+// item i of the cubic Hermite interpolant at fraction theta of a step of size dt, from the states and derivatives at its ends
+double sim_hermite(const double *y0, const double *y1, const double *f0, const double *f1, double dt, double theta, size_t i);
+// locates where func, of the fraction of a step, crosses zero between g0 = func(0) and g1 = func(1) with the Illinois method,
+// returning the fraction on the far side of the crossing, so integrating on from there won't detect it again
+// with wraps, the values of func are angles, wrapped to [-pi, pi] so it only crosses zero where they do
+double sim_find_root(double func(double theta, void *custom), void *custom, double g0, double g1, bool wraps);
 #endif
@@ -0,0 +1,377 @@
+#include "sweep.h"
+#include "columnar.h"
+#include "linked_list.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+bool sweep_parse_target(struct sweep_parameter *param, const char *name) {
+	if (strlen(name) >= sizeof(param->name)) return false;
+	strcpy(param->name, name);
+
+	int n = 0;
+	if (sscanf(param->name, "sim.%zu%n", &param->index, &n) == 1 && !param->name[n])
+		param->target = SWEEP_SIM_VARIABLE;
+	else if (sscanf(param->name, "body%zu.%zu%n", &param->body, &param->index, &n) == 2 && !param->name[n])
+		param->target = SWEEP_BODY_VARIABLE;
+	else if (sscanf(param->name, "pos%zu.%zu%n", &param->body, &param->index, &n) == 2 && !param->name[n])
+		param->target = SWEEP_POSITION;
+	else if (sscanf(param->name, "vel%zu.%zu%n", &param->body, &param->index, &n) == 2 && !param->name[n])
+		param->target = SWEEP_VELOCITY;
+	else
+		return false;
+	return true;
+}
+
+bool sweep_parse_parameter(struct sweep_parameter *param, const char *str) {
+	*param = (struct sweep_parameter) {.count = 1};
+
+	const char *equals = strchr(str, '=');
+	char name[sizeof(param->name)];
+	if (!equals || equals - str >= (long) sizeof(name)) return false;
+	memcpy(name, str, equals - str);
+	name[equals - str] = '\0';
+	if (!sweep_parse_target(param, name)) return false;
+
+	int n = 0;
+	int matched = sscanf(equals + 1, "%lf:%lf%n:%zu%n", &param->min, &param->max, &n, &param->count, &n);
+	if (matched < 2 || equals[1 + n]) return false;
+	return param->count > 0;
+}
+
+struct sweep_context {
+	const struct sim_simulation *sim;
+	const struct sweep_spec *spec;
+
+	const double *base_args;
+	size_t *param_args; // index into the args array for each parameter
+	uint32_t *permutations; // latin hypercube strata, points items per parameter
+
+	size_t columns_len;
+	double **columns;
+
+	size_t verify_stride; // points which are a multiple of this are re-run in double precision
+
+	size_t batch_start, batch_len;
+	atomic_size_t next;
+	atomic_bool failed;
+};
+
+struct sweep_worker {
+	pthread_t thread;
+	struct sweep_context *ctx;
+	double *args, *energy, *verify_args;
+	struct sweep_flip_buffers buffers;
+
+	// comparison of the float results with double precision, summed up after the sweep
+	size_t verified, flip_mismatches;
+	double max_divergence, max_energy_difference;
+};
+
+static double sweep_value(struct sweep_context *ctx, size_t point, size_t param_i) {
+	const struct sweep_spec *spec = ctx->spec;
+	const struct sweep_parameter *param = &spec->parameters[param_i];
+	if (spec->sampling == SWEEP_LATIN_HYPERCUBE) {
+		// jitter inside the stratum chosen by the permutation, seeded by point so results don't depend on threading
+		uint64_t state = spec->seed ^ (point * spec->parameters_len + param_i) * 0xd1b54a32d192ed03;
+		double u = (ctx->permutations[param_i * spec->points + point] + random_unit(&state)) / spec->points;
+		return param->min + (param->max - param->min) * u;
+	}
+
+	return sweep_grid_value(spec, point, param_i);
+}
+
+double sweep_grid_value(const struct sweep_spec *spec, size_t point, size_t param_i) {
+	const struct sweep_parameter *param = &spec->parameters[param_i];
+	// decompose the point index into a grid index for each parameter, the last parameter varying fastest
+	for (size_t i = spec->parameters_len - 1; i > param_i; --i) point /= spec->parameters[i].count;
+	size_t k = point % param->count;
+	if (param->count == 1) return param->min;
+	return param->min + (param->max - param->min) * k / (param->count - 1);
+}
+
+static double total_energy(struct sweep_worker *worker) {
+	const struct sim_simulation *sim = worker->ctx->sim;
+	sim_energy(sim, worker->args, worker->energy);
+	double total = 0;
+	for (size_t i = 0; i < 2 * sim->internal_bodies_len; ++i) total += worker->energy[i];
+	return total;
+}
+
+bool sweep_flip_time(const struct sim_simulation *sim, double *args, const struct sweep_flip_buffers *buffers, enum sim_precision precision,
+                     int steps, double time_span, bool stop_at_flip, double *flip_time) {
+	size_t state_len = SIM_STATE_LEN(sim);
+	double *state = args + sim->internal_coordinates_start, *trajectory = buffers->trajectory;
+
+	// an angle coordinate has flipped once it leaves [-π, π]
+	*flip_time = NAN;
+	for (size_t i = 0; i < state_len; i += 2)
+		if (fabs(state[i]) > M_PI) *flip_time = 0;
+
+	if (precision == SIM_PRECISION_FLOAT)
+		for (size_t i = 0; i < sim->internal_args_len; ++i) buffers->args_float[i] = args[i];
+
+	double dt = time_span / steps, step_size = 0;
+	for (int step = 0; step < steps && !(stop_at_flip && !isnan(*flip_time)); step += SWEEP_CHUNK_STEPS) {
+		int chunk = steps - step < SWEEP_CHUNK_STEPS ? steps - step : SWEEP_CHUNK_STEPS;
+		if (precision == SIM_PRECISION_FLOAT) {
+			if (!sim_integrate_float(sim, buffers->args_float, chunk, chunk * dt, isnan(*flip_time) ? buffers->trajectory_float : NULL)) return false;
+			if (!isnan(*flip_time)) continue;
+			for (size_t i = 0; i < state_len * (chunk + 1); ++i) trajectory[i] = buffers->trajectory_float[i];
+		} else {
+			if (!sim_integrate(sim, args, chunk, chunk * dt, trajectory, &step_size)) return false;
+			if (!isnan(*flip_time)) continue;
+		}
+
+		for (int j = 1; j <= chunk && isnan(*flip_time); ++j) {
+			const double *prev = trajectory + (j - 1) * state_len, *cur = prev + state_len;
+			for (size_t i = 0; i < state_len; i += 2) {
+				if (fabs(cur[i]) <= M_PI) continue;
+				// interpolate linearly to find when it crossed
+				double frac = (copysign(M_PI, cur[i]) - prev[i]) / (cur[i] - prev[i]);
+				double time = (step + j - 1 + frac) * dt;
+				if (isnan(*flip_time) || time < *flip_time) *flip_time = time;
+			}
+		}
+	}
+
+	if (precision == SIM_PRECISION_FLOAT)
+		for (size_t i = 0; i < state_len; ++i) state[i] = buffers->args_float[sim->internal_coordinates_start + i];
+	return true;
+}
+
+static bool sweep_point(struct sweep_worker *worker, size_t point, size_t row) {
+	struct sweep_context *ctx = worker->ctx;
+	const struct sim_simulation *sim = ctx->sim;
+	const struct sweep_spec *spec = ctx->spec;
+	size_t state_len = SIM_STATE_LEN(sim), column = 0;
+
+	memcpy(worker->args, ctx->base_args, sim->internal_args_len * sizeof(*worker->args));
+	for (size_t i = 0; i < spec->parameters_len; ++i) {
+		double value = sweep_value(ctx, point, i);
+		worker->args[ctx->param_args[i]] = value;
+		ctx->columns[column++][row] = value;
+	}
+
+	bool verify = ctx->verify_stride && point % ctx->verify_stride == 0;
+	if (verify) memcpy(worker->verify_args, worker->args, sim->internal_args_len * sizeof(*worker->args));
+
+	double energy_initial = total_energy(worker), flip_time;
+	const double *state = worker->args + sim->internal_coordinates_start;
+	if (!sweep_flip_time(sim, worker->args, &worker->buffers, spec->precision, spec->steps, spec->time_span, false, &flip_time)) return false;
+
+	for (size_t i = 0; i < state_len; ++i) ctx->columns[column++][row] = state[i];
+
+	double energy_final = total_energy(worker);
+	ctx->columns[column++][row] = energy_initial;
+	ctx->columns[column++][row] = energy_final;
+	ctx->columns[column++][row] = energy_final - energy_initial;
+	ctx->columns[column++][row] = flip_time;
+
+	if (verify) {
+		// run the same point in double precision, with the float results still in the columns
+		memcpy(worker->args, worker->verify_args, sim->internal_args_len * sizeof(*worker->args));
+		double flip_time_double;
+		if (!sweep_flip_time(sim, worker->args, &worker->buffers, SIM_PRECISION_DOUBLE, spec->steps, spec->time_span, false, &flip_time_double))
+			return false;
+
+		column -= state_len + 4;
+		for (size_t i = 0; i < state_len; ++i) {
+			double divergence = fabs(ctx->columns[column++][row] - state[i]);
+			if (!(divergence <= worker->max_divergence)) worker->max_divergence = divergence; // also catches NaN
+		}
+		double energy_difference = fabs(energy_final - total_energy(worker));
+		if (!(energy_difference <= worker->max_energy_difference)) worker->max_energy_difference = energy_difference;
+		if (isnan(flip_time) != isnan(flip_time_double)) ++worker->flip_mismatches;
+		++worker->verified;
+	}
+	return true;
+}
+
+static void *sweep_worker_func(void *data) {
+	struct sweep_worker *worker = data;
+	struct sweep_context *ctx = worker->ctx;
+	while (!atomic_load_explicit(&ctx->failed, memory_order_relaxed)) {
+		size_t row = atomic_fetch_add_explicit(&ctx->next, 1, memory_order_relaxed);
+		if (row >= ctx->batch_len) break;
+		if (!sweep_point(worker, ctx->batch_start + row, row)) atomic_store(&ctx->failed, true);
+	}
+	return NULL;
+}
+
+bool sweep_resolve_parameters(const struct sim_simulation *sim, const struct sweep_parameter *parameters, size_t parameters_len, size_t *param_args) {
+	for (size_t p = 0; p < parameters_len; ++p) {
+		const struct sweep_parameter *param = &parameters[p];
+		if (param->target == SWEEP_SIM_VARIABLE) {
+			if (param->index >= sim->variables_len) return false;
+			param_args[p] = param->index;
+			continue;
+		}
+
+		size_t variables_i = sim->variables_len, coordinates_i = sim->internal_coordinates_start, body_i = 0;
+		bool found = false;
+		LL_LOOP(struct sim_body *, body, sim->bodies) {
+			if (body_i++ == param->body) {
+				if (param->target == SWEEP_BODY_VARIABLE) {
+					if (param->index >= body->variables_len) return false;
+					param_args[p] = variables_i + param->index;
+				} else {
+					if (param->index >= body->coordinates_len) return false;
+					param_args[p] = coordinates_i + param->index * 2 + (param->target == SWEEP_VELOCITY);
+				}
+				found = true;
+				break;
+			}
+			variables_i += body->variables_len;
+			coordinates_i += body->coordinates_len * 2;
+		}
+		if (!found) return false;
+	}
+	return true;
+}
+
+bool sweep_run(const struct sim_simulation *sim, const struct sweep_spec *spec) {
+	bool res = false;
+	struct sweep_context ctx = {.sim = sim, .spec = spec};
+	struct sweep_worker *workers = NULL;
+	struct columnar_writer *writer = NULL;
+	char **names = NULL;
+	double *base_args = NULL;
+	unsigned threads = spec->threads ? spec->threads : 1;
+	size_t state_len = SIM_STATE_LEN(sim), batch_size = spec->batch_size ? spec->batch_size : 4096;
+
+	if (spec->steps < 1 || spec->time_span <= 0 || !sim->internal_model) return false;
+	if (spec->precision == SIM_PRECISION_FLOAT && sim->integrator != SIM_INTEGRATOR_RK4) {
+		fprintf(stderr, "Single precision sweeps only support the RK4 integrator\n");
+		return false;
+	}
+
+	// count points
+	size_t points = 1;
+	if (spec->sampling == SWEEP_LATIN_HYPERCUBE) {
+		points = spec->points;
+		if (points > UINT32_MAX) return false;
+	} else
+		for (size_t i = 0; i < spec->parameters_len; ++i) {
+			if (spec->parameters[i].count > SIZE_MAX / points) return false; // overflow
+			points *= spec->parameters[i].count;
+		}
+
+	if (spec->precision == SIM_PRECISION_FLOAT && spec->verify) ctx.verify_stride = points / spec->verify > 1 ? points / spec->verify : 1;
+
+	ASSERT(ctx.param_args = calloc(spec->parameters_len ? spec->parameters_len : 1, sizeof(*ctx.param_args)));
+	if (!sweep_resolve_parameters(sim, spec->parameters, spec->parameters_len, ctx.param_args)) {
+		fprintf(stderr, "Sweep parameter does not exist in the simulation\n");
+		goto fail;
+	}
+
+	ASSERT(ctx.base_args = base_args = calloc(sim->internal_args_len, sizeof(*base_args)));
+	sim_pack_args(sim, base_args);
+
+	if (spec->sampling == SWEEP_LATIN_HYPERCUBE) {
+		// shuffle the strata independently for each parameter
+		ASSERT(ctx.permutations = calloc(spec->parameters_len * points + 1, sizeof(*ctx.permutations)));
+		uint64_t state = spec->seed;
+		for (size_t p = 0; p < spec->parameters_len; ++p) {
+			uint32_t *perm = ctx.permutations + p * points;
+			for (size_t i = 0; i < points; ++i) perm[i] = i;
+			for (size_t i = points; i > 1; --i) SWAP(uint32_t, perm[i - 1], perm[splitmix64(&state) % i]);
+		}
+	}
+
+	// column names: parameters, final state, energies, flip time
+	ctx.columns_len = spec->parameters_len + state_len + 4;
+	ASSERT(names = calloc(ctx.columns_len, sizeof(*names)));
+	ASSERT(ctx.columns = calloc(ctx.columns_len, sizeof(*ctx.columns)));
+	size_t column = 0;
+	for (size_t i = 0; i < spec->parameters_len; ++i) ASSERT(names[column++] = strdup(spec->parameters[i].name));
+	size_t body_i = 0;
+	char name[64];
+	LL_LOOP(struct sim_body *, body, sim->bodies) {
+		for (size_t i = 0; i < body->coordinates_len; ++i) {
+			snprintf(name, sizeof(name), "pos%zu.%zu", body_i, i);
+			ASSERT(names[column++] = strdup(name));
+			snprintf(name, sizeof(name), "vel%zu.%zu", body_i, i);
+			ASSERT(names[column++] = strdup(name));
+		}
+		++body_i;
+	}
+	ASSERT(names[column++] = strdup("energy_initial"));
+	ASSERT(names[column++] = strdup("energy_final"));
+	ASSERT(names[column++] = strdup("energy_drift"));
+	ASSERT(names[column++] = strdup("flip_time"));
+	for (size_t i = 0; i < ctx.columns_len; ++i) ASSERT(ctx.columns[i] = calloc(batch_size, sizeof(**ctx.columns)));
+
+	ASSERT(writer = columnar_open(spec->output, ctx.columns_len, (const char *const *) names));
+
+	// per-thread buffers, allocated once and reused for every batch
+	ASSERT(workers = calloc(threads, sizeof(*workers)));
+	for (unsigned i = 0; i < threads; ++i) {
+		workers[i].ctx = &ctx;
+		ASSERT(workers[i].args = calloc(sim->internal_args_len, sizeof(*workers[i].args)));
+		ASSERT(workers[i].buffers.trajectory = calloc(state_len * (SWEEP_CHUNK_STEPS + 1), sizeof(*workers[i].buffers.trajectory)));
+		ASSERT(workers[i].energy = calloc(SIM_ENERGY_LEN(sim) + 1, sizeof(*workers[i].energy)));
+		if (spec->precision == SIM_PRECISION_FLOAT) {
+			ASSERT(workers[i].verify_args = calloc(sim->internal_args_len, sizeof(*workers[i].verify_args)));
+			ASSERT(workers[i].buffers.args_float = calloc(sim->internal_args_len, sizeof(*workers[i].buffers.args_float)));
+			ASSERT(workers[i].buffers.trajectory_float = calloc(state_len * (SWEEP_CHUNK_STEPS + 1), sizeof(*workers[i].buffers.trajectory_float)));
+		}
+	}
+
+	for (ctx.batch_start = 0; ctx.batch_start < points; ctx.batch_start += ctx.batch_len) {
+		ctx.batch_len = points - ctx.batch_start < batch_size ? points - ctx.batch_start : batch_size;
+		atomic_store(&ctx.next, 0);
+
+		unsigned started = 0;
+		for (; started < threads; ++started)
+			if (pthread_create(&workers[started].thread, NULL, sweep_worker_func, &workers[started])) break;
+		if (started == 0) sweep_worker_func(&workers[0]); // fall back to running on this thread
+		for (unsigned i = 0; i < started; ++i) pthread_join(workers[i].thread, NULL);
+		ASSERT(!atomic_load(&ctx.failed));
+
+		ASSERT(columnar_write_group(writer, ctx.batch_len, (const double *const *) ctx.columns));
+		fprintf(stderr, "\rSwept %zu/%zu points", ctx.batch_start + ctx.batch_len, points);
+	}
+	fprintf(stderr, "\n");
+
+	if (ctx.verify_stride) {
+		size_t verified = 0, flip_mismatches = 0;
+		double max_divergence = 0, max_energy_difference = 0;
+		for (unsigned i = 0; i < threads; ++i) {
+			verified += workers[i].verified;
+			flip_mismatches += workers[i].flip_mismatches;
+			if (!(workers[i].max_divergence <= max_divergence)) max_divergence = workers[i].max_divergence;
+			if (!(workers[i].max_energy_difference <= max_energy_difference)) max_energy_difference = workers[i].max_energy_difference;
+		}
+		fprintf(stderr, "Verified %zu points in double precision: max state divergence %g, max energy difference %g, %zu/%zu disagree on flipping\n",
+		        verified, max_divergence, max_energy_difference, flip_mismatches, verified);
+	}
+
+	res = true;
+fail:
+	if (!columnar_close(writer)) res = false;
+	if (workers)
+		for (unsigned i = 0; i < threads; ++i) {
+			free(workers[i].args);
+			free(workers[i].buffers.trajectory);
+			free(workers[i].energy);
+			free(workers[i].verify_args);
+			free(workers[i].buffers.args_float);
+			free(workers[i].buffers.trajectory_float);
+		}
+	free(workers);
+	if (names)
+		for (size_t i = 0; i < ctx.columns_len; ++i) free(names[i]);
+	if (ctx.columns)
+		for (size_t i = 0; i < ctx.columns_len; ++i) free(ctx.columns[i]);
+	free(names);
+	free(ctx.columns);
+	free(ctx.permutations);
+	free(ctx.param_args);
+	free(base_args);
+	return res;
+}
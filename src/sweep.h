@@ -0,0 +1,74 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+#include "sim.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SWEEP_CHUNK_STEPS 256 // steps integrated at once by sweep_flip_time, bounding its trajectory buffers
+
+enum sweep_target {
+	SWEEP_SIM_VARIABLE,  // sim.<variable>
+	SWEEP_BODY_VARIABLE, // body<body>.<variable>
+	SWEEP_POSITION,      // pos<body>.<coordinate>
+	SWEEP_VELOCITY,      // vel<body>.<coordinate>
+};
+
+struct sweep_parameter {
+	enum sweep_target target;
+	size_t body, index;
+	double min, max;
+	size_t count; // number of grid points, ignored for latin hypercube sampling
+	char name[32];
+};
+
+enum sweep_sampling {
+	SWEEP_GRID,
+	SWEEP_LATIN_HYPERCUBE,
+};
+
+struct sweep_spec {
+	enum sweep_sampling sampling;
+	size_t parameters_len;
+	struct sweep_parameter *parameters;
+
+	size_t points; // number of samples for latin hypercube sampling, the grid uses the product of the counts
+	uint64_t seed;
+
+	int steps;        // integration steps per point
+	double time_span; // simulated time per point
+
+	// SIM_PRECISION_FLOAT integrates in single precision, then re-runs about verify points in double and reports how far they diverged
+	enum sim_precision precision;
+	size_t verify;
+
+	size_t batch_size;
+	unsigned threads;
+	const char *output;
+};
+
+// parses "<target>=<min>:<max>[:<count>]", e.g. "sim.0=9:10:11" or "body1.0=0.5:2"
+bool sweep_parse_parameter(struct sweep_parameter *param, const char *str);
+// parses only the target, e.g. "pos0.1", leaving the range untouched
+bool sweep_parse_target(struct sweep_parameter *param, const char *name);
+// finds where each parameter is stored in the args array of the compiled simulation
+bool sweep_resolve_parameters(const struct sim_simulation *sim, const struct sweep_parameter *parameters, size_t parameters_len, size_t *param_args);
+// value of a parameter at a point of the grid, the last parameter varying fastest
+double sweep_grid_value(const struct sweep_spec *spec, size_t point, size_t param_i);
+
+// buffers of sweep_flip_time, the trajectories with room for SWEEP_CHUNK_STEPS + 1 states, the float ones only for SIM_PRECISION_FLOAT
+struct sweep_flip_buffers {
+	double *trajectory;
+	float *args_float, *trajectory_float;
+};
+
+// integrates args of the compiled simulation for steps over time_span in the given precision, setting flip_time to when an angle
+// coordinate first left [-π, π] (interpolated linearly between steps), or NAN if none did
+// args ends at the final state, or with stop_at_flip, somewhere after the flip, as it stops integrating at the end of that chunk
+bool sweep_flip_time(const struct sim_simulation *sim, double *args, const struct sweep_flip_buffers *buffers, enum sim_precision precision,
+                     int steps, double time_span, bool stop_at_flip, double *flip_time);
+
+// runs every point of the sweep against the compiled simulation, using its current state as the base for each point,
+// and writes the per-point results to spec->output as a columnar file
+bool sweep_run(const struct sim_simulation *sim, const struct sweep_spec *spec);
+#endif
@@ -0,0 +1,462 @@
+#include "trajectory.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <unistd.h>
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "trajectory files are written in native byte order, which is assumed to be little-endian"
+#endif
+
+#define WRITE(ptr, size) ASSERT(fwrite(ptr, 1, size, writer->file) == (size))
+#define READ(ptr, size) ASSERT(fread(ptr, 1, size, reader->file) == (size))
+
+#define TRAJECTORY_DEFAULT_BLOCK_RECORDS 4096
+
+struct bit_writer {
+	uint8_t *out;
+	size_t cap, len;
+	uint64_t acc;
+	unsigned bits; // bits in acc not yet written
+	bool overflow;
+};
+
+struct bit_reader {
+	const uint8_t *in;
+	size_t len, pos;
+	uint64_t acc;
+	unsigned bits;
+	bool overflow;
+};
+
+static void put_bits(struct bit_writer *writer, uint64_t value, unsigned n) {
+	if (n > 32) {
+		put_bits(writer, value >> 32, n - 32);
+		n = 32;
+	}
+	writer->acc = writer->acc << n | (value & ((1ULL << n) - 1));
+	writer->bits += n;
+	while (writer->bits >= 8) {
+		writer->bits -= 8;
+		if (writer->len < writer->cap)
+			writer->out[writer->len++] = writer->acc >> writer->bits;
+		else
+			writer->overflow = true;
+	}
+}
+
+static uint64_t get_bits(struct bit_reader *reader, unsigned n) {
+	if (n > 32) {
+		uint64_t high = get_bits(reader, n - 32);
+		return high << 32 | get_bits(reader, 32);
+	}
+	while (reader->bits < n) {
+		uint8_t byte = 0;
+		if (reader->pos < reader->len)
+			byte = reader->in[reader->pos++];
+		else
+			reader->overflow = true;
+		reader->acc = reader->acc << 8 | byte;
+		reader->bits += 8;
+	}
+	reader->bits -= n;
+	return reader->acc >> reader->bits & ((1ULL << n) - 1);
+}
+
+// the two latest values of a column, and the window of meaningful bits of its previous XOR
+struct xor_column {
+	double latest, previous;
+	unsigned leading, trailing;
+	bool window;
+};
+
+// linear extrapolation, so smoothly changing values share more leading bits with the prediction than with the previous value
+static uint64_t predict(const struct xor_column *column) {
+	double value = 2 * column->latest - column->previous;
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return bits;
+}
+
+static void push(struct xor_column *column, double value) {
+	column->previous = column->latest;
+	column->latest = value;
+}
+
+static void put_xor(struct bit_writer *writer, struct xor_column *column, double value) {
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	uint64_t x = bits ^ predict(column);
+	push(column, value);
+	if (!x) {
+		put_bits(writer, 0, 1);
+		return;
+	}
+
+	unsigned leading = __builtin_clzll(x), trailing = __builtin_ctzll(x);
+	if (column->window && leading >= column->leading && trailing >= column->trailing) {
+		// fits in the previous window, so only its bits are needed
+		put_bits(writer, 2, 2);
+		put_bits(writer, x >> column->trailing, 64 - column->leading - column->trailing);
+		return;
+	}
+	unsigned meaningful = 64 - leading - trailing;
+	put_bits(writer, 3, 2);
+	put_bits(writer, leading, 6);
+	put_bits(writer, meaningful - 1, 6);
+	put_bits(writer, x >> trailing, meaningful);
+	column->leading = leading, column->trailing = trailing, column->window = true;
+}
+
+static double get_xor(struct bit_reader *reader, struct xor_column *column) {
+	uint64_t x = 0;
+	if (get_bits(reader, 1)) {
+		if (get_bits(reader, 1)) {
+			column->leading = get_bits(reader, 6);
+			column->trailing = 64 - column->leading - (get_bits(reader, 6) + 1);
+			column->window = true;
+		}
+		unsigned meaningful = 64 - column->leading - column->trailing;
+		x = get_bits(reader, meaningful) << column->trailing;
+	}
+	uint64_t bits = predict(column) ^ x;
+	double value;
+	memcpy(&value, &bits, sizeof(value));
+	push(column, value);
+	return value;
+}
+
+// multiples of quantum, with differences wrapping in unsigned arithmetic so encoding and decoding agree even if they overflow
+// the residual of cubic extrapolation (the fourth difference) is stored, as the state is smooth over a few steps
+#define DELTA_ORDER 4
+struct delta_column {
+	uint64_t differences[DELTA_ORDER]; // latest value, then its successive backward differences
+};
+
+// zigzag encoding, so small negative numbers have few bits set
+static uint64_t zigzag(uint64_t x) { return x << 1 ^ -(x >> 63); }
+static uint64_t unzigzag(uint64_t x) { return x >> 1 ^ -(x & 1); }
+
+static const unsigned bucket_bits[] = {0, 4, 8, 16, 32, 64};
+#define BUCKETS_LEN LENGTHOF(bucket_bits)
+
+static void put_delta(struct bit_writer *writer, struct delta_column *column, uint64_t k) {
+	uint64_t difference = k;
+	for (size_t i = 0; i < DELTA_ORDER; ++i) {
+		uint64_t next = difference - column->differences[i];
+		column->differences[i] = difference;
+		difference = next;
+	}
+	uint64_t residual = zigzag(difference);
+	// unary prefix choosing the smallest bucket that fits the residual
+	unsigned bucket = 0;
+	while (bucket < BUCKETS_LEN - 1 && residual >= 1ULL << bucket_bits[bucket]) ++bucket;
+	put_bits(writer, (1ULL << bucket) - 1, bucket);       // ones for the bucket
+	if (bucket < BUCKETS_LEN - 1) put_bits(writer, 0, 1); // terminated by a zero unless it's the last
+	put_bits(writer, residual, bucket_bits[bucket]);
+}
+
+static uint64_t get_delta(struct bit_reader *reader, struct delta_column *column) {
+	unsigned bucket = 0;
+	while (bucket < BUCKETS_LEN - 1 && get_bits(reader, 1)) ++bucket;
+	uint64_t difference = unzigzag(get_bits(reader, bucket_bits[bucket]));
+	for (size_t i = DELTA_ORDER; i-- > 0;) difference = column->differences[i] += difference;
+	return difference;
+}
+
+size_t trajectory_encode_block(const double *rows, size_t records, size_t columns, double quantum, uint8_t *out, size_t cap) {
+	struct bit_writer writer = {.out = out, .cap = cap};
+	struct xor_column xor_columns[columns];
+	struct delta_column delta_columns[columns];
+	memset(xor_columns, 0, sizeof(xor_columns));
+	memset(delta_columns, 0, sizeof(delta_columns));
+
+	for (size_t row = 0; row < records; ++row)
+		for (size_t i = 0; i < columns; ++i) {
+			double value = rows[row * columns + i];
+			if (quantum <= 0 || i == 0) {
+				put_xor(&writer, &xor_columns[i], value);
+				continue;
+			}
+			double scaled = value / quantum;
+			if (!(fabs(scaled) < 0x1p62)) return 0; // also rejects NaN
+			put_delta(&writer, &delta_columns[i], (uint64_t) llround(scaled));
+		}
+	if (writer.bits) put_bits(&writer, 0, 8 - writer.bits);
+	return writer.overflow ? 0 : writer.len;
+}
+
+bool trajectory_decode_block(const uint8_t *in, size_t len, size_t records, size_t columns, double quantum, double *rows) {
+	struct bit_reader reader = {.in = in, .len = len};
+	struct xor_column xor_columns[columns];
+	struct delta_column delta_columns[columns];
+	memset(xor_columns, 0, sizeof(xor_columns));
+	memset(delta_columns, 0, sizeof(delta_columns));
+
+	for (size_t row = 0; row < records; ++row)
+		for (size_t i = 0; i < columns; ++i) {
+			if (quantum <= 0 || i == 0)
+				rows[row * columns + i] = get_xor(&reader, &xor_columns[i]);
+			else
+				rows[row * columns + i] = (int64_t) get_delta(&reader, &delta_columns[i]) * quantum;
+		}
+	return !reader.overflow;
+}
+
+struct trajectory_writer *trajectory_open(const char *path, size_t state_len, size_t block_records, double quantum) {
+	struct trajectory_writer *writer = calloc(1, sizeof(*writer));
+	if (!writer) return NULL;
+	writer->state_len = state_len;
+	writer->block_records = block_records ? block_records : TRAJECTORY_DEFAULT_BLOCK_RECORDS;
+	writer->quantum = quantum > 0 ? quantum : 0;
+	ASSERT(writer->state_len <= UINT32_MAX && writer->block_records <= UINT32_MAX);
+	// bounds the block size to fit in its u32 length
+	ASSERT(TRAJECTORY_BLOCK_BOUND(writer->block_records, state_len + 1) <= UINT32_MAX);
+
+	ASSERT(writer->rows = calloc(writer->block_records * (state_len + 1), sizeof(*writer->rows)));
+	ASSERT(writer->encoded = malloc(TRAJECTORY_BLOCK_BOUND(writer->block_records, state_len + 1)));
+	ASSERT(writer->file = fopen(path, "wb"));
+
+	WRITE(TRAJECTORY_MAGIC, 8);
+	uint32_t header[2] = {state_len, writer->block_records};
+	WRITE(header, sizeof(header));
+	WRITE(&writer->quantum, sizeof(writer->quantum));
+	return writer;
+fail:
+	if (writer->file) fclose(writer->file);
+	free(writer->rows);
+	free(writer->encoded);
+	free(writer);
+	return NULL;
+}
+
+static bool trajectory_write_block(struct trajectory_writer *writer) {
+	if (writer->rows_len == 0) return true;
+
+	// remember where the block starts for the footer
+	if (writer->blocks_len >= writer->blocks_size) {
+		size_t size = writer->blocks_size ? writer->blocks_size * 2 : 64;
+		uint64_t *offsets = realloc(writer->block_offsets, size * sizeof(*offsets));
+		ASSERT(offsets);
+		writer->block_offsets = offsets;
+		writer->blocks_size = size;
+	}
+	long offset = ftell(writer->file);
+	ASSERT(offset >= 0);
+
+	size_t columns = writer->state_len + 1;
+	size_t bytes = trajectory_encode_block(writer->rows, writer->rows_len, columns, writer->quantum,
+	                                       writer->encoded, TRAJECTORY_BLOCK_BOUND(writer->rows_len, columns));
+	ASSERT(bytes);
+	uint32_t header[2] = {writer->rows_len, bytes};
+	WRITE(header, sizeof(header));
+	WRITE(writer->encoded, bytes);
+
+	writer->block_offsets[writer->blocks_len++] = offset;
+	writer->rows_len = 0;
+	return true;
+fail:
+	return false;
+}
+
+bool trajectory_write(struct trajectory_writer *writer, double time, const double *state) {
+	double *row = writer->rows + writer->rows_len * (writer->state_len + 1);
+	row[0] = time;
+	memcpy(row + 1, state, writer->state_len * sizeof(*state));
+	++writer->rows_len;
+	++writer->records;
+	if (writer->rows_len < writer->block_records) return true;
+	return trajectory_write_block(writer);
+}
+
+bool trajectory_close(struct trajectory_writer *writer) {
+	if (!writer) return true;
+	bool res = false;
+
+	ASSERT(trajectory_write_block(writer));
+	WRITE(writer->block_offsets, writer->blocks_len * sizeof(*writer->block_offsets));
+	WRITE(&writer->blocks_len, sizeof(writer->blocks_len));
+	WRITE(&writer->records, sizeof(writer->records));
+	WRITE(TRAJECTORY_FOOTER_MAGIC, 8);
+
+	res = true;
+fail:
+	if (fclose(writer->file)) res = false;
+	free(writer->rows);
+	free(writer->encoded);
+	free(writer->block_offsets);
+	free(writer);
+	return res;
+}
+
+struct trajectory_reader *trajectory_reader_open(const char *path) {
+	struct trajectory_reader *reader = calloc(1, sizeof(*reader));
+	if (!reader) return NULL;
+	ASSERT(reader->file = fopen(path, "rb"));
+
+	char magic[8];
+	uint32_t header[2];
+	READ(magic, 8);
+	ASSERT(!memcmp(magic, TRAJECTORY_MAGIC, 8));
+	READ(header, sizeof(header));
+	READ(&reader->quantum, sizeof(reader->quantum));
+	reader->state_len = header[0], reader->block_records = header[1];
+	ASSERT(reader->block_records > 0);
+
+	// the footer ends with the block count, the record count and the magic
+	ASSERT(!fseek(reader->file, -24, SEEK_END));
+	READ(&reader->blocks_len, sizeof(reader->blocks_len));
+	READ(&reader->records, sizeof(reader->records));
+	READ(magic, 8);
+	ASSERT(!memcmp(magic, TRAJECTORY_FOOTER_MAGIC, 8));
+	ASSERT(reader->blocks_len <= SIZE_MAX / sizeof(*reader->block_offsets));
+	ASSERT(reader->block_offsets = malloc(reader->blocks_len * sizeof(*reader->block_offsets)));
+	ASSERT(!fseek(reader->file, -24 - (long) (reader->blocks_len * sizeof(*reader->block_offsets)), SEEK_END));
+	READ(reader->block_offsets, reader->blocks_len * sizeof(*reader->block_offsets));
+
+	size_t columns = reader->state_len + 1;
+	ASSERT(reader->rows = calloc(reader->block_records * columns, sizeof(*reader->rows)));
+	ASSERT(reader->encoded = malloc(TRAJECTORY_BLOCK_BOUND(reader->block_records, columns)));
+	reader->cached_block = UINT64_MAX;
+	return reader;
+fail:
+	trajectory_reader_close(reader);
+	return NULL;
+}
+
+bool trajectory_read(struct trajectory_reader *reader, uint64_t index, double *time, double *state) {
+	if (index >= reader->records) return false;
+	size_t columns = reader->state_len + 1;
+
+	// every block but the last is full, so the block holding a record is found without reading the others
+	uint64_t block = index / reader->block_records;
+	if (block != reader->cached_block) {
+		ASSERT(block < reader->blocks_len);
+		reader->cached_block = UINT64_MAX;
+		ASSERT(!fseek(reader->file, reader->block_offsets[block], SEEK_SET));
+		uint32_t header[2];
+		READ(header, sizeof(header));
+		ASSERT(header[0] <= reader->block_records && header[1] <= TRAJECTORY_BLOCK_BOUND(reader->block_records, columns));
+		READ(reader->encoded, header[1]);
+		ASSERT(trajectory_decode_block(reader->encoded, header[1], header[0], columns, reader->quantum, reader->rows));
+		reader->cached_block = block;
+		reader->cached_records = header[0];
+	}
+
+	size_t row = index % reader->block_records;
+	ASSERT(row < reader->cached_records);
+	if (time) *time = reader->rows[row * columns];
+	if (state) memcpy(state, reader->rows + row * columns + 1, reader->state_len * sizeof(*state));
+	return true;
+fail:
+	return false;
+}
+
+void trajectory_reader_close(struct trajectory_reader *reader) {
+	if (!reader) return;
+	if (reader->file) fclose(reader->file);
+	free(reader->block_offsets);
+	free(reader->rows);
+	free(reader->encoded);
+	free(reader);
+}
+
+// a smooth trajectory with a few awkward values, rows of 1 + state_len doubles
+// the values are integers only divided and added, never multiplied as doubles (which could be fused), so the rows
+// and so the encoded bytes are the same on every machine
+#define SELF_CHECK_STATE_LEN 4
+#define SELF_CHECK_RECORDS 1000
+#define SELF_CHECK_BLOCK_RECORDS 64 // so the records span many blocks, the last one partial
+
+static void self_check_rows(double *rows, bool lossy) {
+	for (int64_t row = 0; row < SELF_CHECK_RECORDS; ++row) {
+		double *r = rows + row * (SELF_CHECK_STATE_LEN + 1);
+		r[0] = row / 60.0;
+		r[1] = (row * row * row - 1500 * row * row + 250000 * row) / 7e6;
+		r[2] = (3 * row * row - 2000 * row) / 1024.0 + (row % 7 - 3) / 1e3;
+		r[3] = (row % 97 ? 1e9 : -1e9) / (row + 1); // a jump every so often
+		r[4] = lossy ? 0 : row % 3 == 0 ? -0.0 : row % 3 == 1 ? DBL_MIN / 3 : NAN; // bits only lossless mode keeps
+	}
+}
+
+// lossless values have to come back bit for bit, lossy ones (other than the time) within quantum / 2
+static bool self_check_row(FILE *log, const char *what, const double *expected, const double *actual, double quantum, size_t row) {
+	for (size_t i = 0; i <= SELF_CHECK_STATE_LEN; ++i) {
+		bool same = quantum <= 0 || i == 0 ? !memcmp(&expected[i], &actual[i], sizeof(*actual))
+		                                   : fabs(actual[i] - expected[i]) <= quantum / 2 + fabs(expected[i]) * DBL_EPSILON;
+		if (same) continue;
+		fprintf(log, "Trajectory self-check: %s, quantum %g, record %zu column %zu is %.17g instead of %.17g\n",
+		        what, quantum, row, i, actual[i], expected[i]);
+		return false;
+	}
+	return true;
+}
+
+static uint64_t fnv1a(const uint8_t *data, size_t len) {
+	uint64_t hash = 0xcbf29ce484222325;
+	for (size_t i = 0; i < len; ++i) hash = (hash ^ data[i]) * 0x100000001b3;
+	return hash;
+}
+
+// layout is the hash of the block's encoded bytes, which changes with any change to the format, even one that still round-trips
+static bool self_check_mode(FILE *log, double quantum, uint64_t layout) {
+	bool res = false;
+	size_t columns = SELF_CHECK_STATE_LEN + 1, bound = TRAJECTORY_BLOCK_BOUND(SELF_CHECK_RECORDS, columns);
+	double *rows = malloc(SELF_CHECK_RECORDS * columns * sizeof(*rows)), *decoded = malloc(SELF_CHECK_RECORDS * columns * sizeof(*decoded));
+	uint8_t *encoded = malloc(bound);
+	struct trajectory_writer *writer = NULL;
+	struct trajectory_reader *reader = NULL;
+	char path[] = "/tmp/dpend-trajectory-XXXXXX";
+	int fd = -1;
+	ASSERT(rows && decoded && encoded);
+	self_check_rows(rows, quantum > 0);
+
+	// a block on its own
+	size_t bytes = trajectory_encode_block(rows, SELF_CHECK_RECORDS, columns, quantum, encoded, bound);
+	if (!bytes) fprintf(log, "Trajectory self-check: encoding failed, quantum %g\n", quantum);
+	ASSERT(bytes && trajectory_decode_block(encoded, bytes, SELF_CHECK_RECORDS, columns, quantum, decoded));
+	if (fnv1a(encoded, bytes) != layout) {
+		fprintf(log, "Trajectory self-check: encoded block differs from the format, quantum %g\n", quantum);
+		goto fail;
+	}
+	for (size_t row = 0; row < SELF_CHECK_RECORDS; ++row)
+		ASSERT(self_check_row(log, "block", rows + row * columns, decoded + row * columns, quantum, row));
+
+	// and through a file, reading records out of order so most reads land in another block, including both sides of each boundary
+	ASSERT((fd = mkstemp(path)) >= 0);
+	ASSERT(writer = trajectory_open(path, SELF_CHECK_STATE_LEN, SELF_CHECK_BLOCK_RECORDS, quantum));
+	for (size_t row = 0; row < SELF_CHECK_RECORDS; ++row) ASSERT(trajectory_write(writer, rows[row * columns], rows + row * columns + 1));
+	bool closed = trajectory_close(writer);
+	writer = NULL;
+	ASSERT(closed && (reader = trajectory_reader_open(path)) && reader->records == SELF_CHECK_RECORDS);
+	for (size_t k = 0; k < SELF_CHECK_RECORDS + 2 * (SELF_CHECK_RECORDS / SELF_CHECK_BLOCK_RECORDS); ++k) {
+		size_t boundary = k - SELF_CHECK_RECORDS; // the last record of a block, then the first of the next
+		size_t row = k < SELF_CHECK_RECORDS ? k * 389 % SELF_CHECK_RECORDS : (boundary / 2 + 1) * SELF_CHECK_BLOCK_RECORDS - (boundary % 2 == 0);
+		double record[SELF_CHECK_STATE_LEN + 1];
+		ASSERT(trajectory_read(reader, row, &record[0], record + 1));
+		ASSERT(self_check_row(log, "file", rows + row * columns, record, quantum, row));
+	}
+	double time;
+	ASSERT(!trajectory_read(reader, SELF_CHECK_RECORDS, &time, NULL)); // past the end
+
+	res = true;
+fail:
+	if (!res) fprintf(log, "Trajectory self-check failed, quantum %g\n", quantum);
+	trajectory_close(writer);
+	trajectory_reader_close(reader);
+	if (fd >= 0) {
+		close(fd);
+		unlink(path);
+	}
+	free(rows);
+	free(decoded);
+	free(encoded);
+	return res;
+}
+
+bool trajectory_self_check(FILE *log) {
+	bool lossless = self_check_mode(log, 0, 0xfd5f63ba4d6b90a9);
+	return self_check_mode(log, 1e-9, 0x72e4babd06784c01) && self_check_mode(log, 0.25, 0x0e91c1009dde36ef) && lossless;
+}
@@ -0,0 +1,76 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// compressed log of (time, state) records, split into independently decodable blocks so any record can be read without the rest
+//
+// each record is a row of 1 + state_len doubles, time first, and each column is compressed against its value in the previous row:
+// - lossless (quantum == 0): the XOR with a linear extrapolation of the column, storing only its meaningful bits
+//   (as in Gorilla, Pelkonen et al. 2015, which XORs with the previous value)
+// - lossy (quantum > 0): the state is rounded to the nearest multiple of quantum, so within quantum / 2, and the fourth
+//   difference of the multiples (generalising Gorilla's delta-of-delta) is stored in a variable number of bits, the time still being lossless
+//
+// all integers and doubles are little-endian, bits are packed most significant first
+// header: "DPTRJ001", u32 state_len, u32 block_records, double quantum
+// block:  u32 records, u32 bytes, then bytes of packed bits, compressed from zeros so blocks don't depend on each other
+// footer: u64 offset of each block, u64 blocks, u64 total records, "DPTRJEND"
+
+#define TRAJECTORY_MAGIC "DPTRJ001"
+#define TRAJECTORY_FOOTER_MAGIC "DPTRJEND"
+
+// upper bound of the bytes needed to encode a block of records rows, each of columns values
+#define TRAJECTORY_BLOCK_BOUND(records, columns) ((records) * (columns) * 10 + 8)
+
+// encodes records rows of columns doubles into out, which has room for cap bytes, returning the bytes used or 0 on failure,
+// e.g. a value too large for quantum, so blocks can also be sent over a stream or through shared memory
+size_t trajectory_encode_block(const double *rows, size_t records, size_t columns, double quantum, uint8_t *out, size_t cap);
+// decodes the records rows of columns doubles encoded in the len bytes of in
+bool trajectory_decode_block(const uint8_t *in, size_t len, size_t records, size_t columns, double quantum, double *rows);
+
+struct trajectory_writer {
+	FILE *file;
+	size_t state_len, block_records;
+	double quantum;
+
+	double *rows; // records of the block not yet written
+	size_t rows_len;
+	uint8_t *encoded;
+
+	uint64_t records, blocks_len, blocks_size;
+	uint64_t *block_offsets;
+};
+
+// creates path, or overwrites it, as the footer is only written on closing so a file can't be appended to
+// block_records trades compression (larger) against the cost of seeking to a record (smaller), 0 for a default
+struct trajectory_writer *trajectory_open(const char *path, size_t state_len, size_t block_records, double quantum);
+bool trajectory_write(struct trajectory_writer *writer, double time, const double *state);
+// writes the last block and the footer and closes the file, frees writer even if it fails
+bool trajectory_close(struct trajectory_writer *writer);
+
+struct trajectory_reader {
+	FILE *file;
+	size_t state_len, block_records;
+	double quantum;
+	uint64_t records, blocks_len;
+	uint64_t *block_offsets;
+
+	// the last block decoded, so sequential reads only decode each block once
+	uint64_t cached_block;
+	size_t cached_records;
+	double *rows;
+	uint8_t *encoded;
+};
+
+struct trajectory_reader *trajectory_reader_open(const char *path);
+// reads record index, decoding only the block containing it
+bool trajectory_read(struct trajectory_reader *reader, uint64_t index, double *time, double *state);
+void trajectory_reader_close(struct trajectory_reader *reader);
+
+// encodes a synthetic trajectory as a block and through a temporary file in lossless and lossy modes, checking that lossless
+// values come back bit for bit, lossy ones within quantum / 2, and that records read out of order across blocks match,
+// printing any difference to log, so a change to the format can't silently corrupt recordings
+bool trajectory_self_check(FILE *log);
+#endif
@@ -37,3 +37,13 @@ struct rectf get_fit_rectf(struct posf inner_size, struct rectf frame_rect) {
 struct posf map_rectf(struct posf pos, struct rectf from, struct rectf to) {
 	return posf_add(posf_mul(posf_div(posf_sub(pos, from.pos), from.size), to.size), to.pos);
 }
+
+// https://prng.di.unimi.it/splitmix64.c
+uint64_t splitmix64(uint64_t *state) {
+	uint64_t z = (*state += 0x9e3779b97f4a7c15);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	return z ^ (z >> 31);
+}
+
+double random_unit(uint64_t *state) { return (splitmix64(state) >> 11) * 0x1.0p-53; }
@@ -2,6 +2,7 @@
 #define UTIL_H
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 struct posf {
 	float x, y;
@@ -50,6 +51,23 @@ struct rectf {
 #define RECTF(x_, y_, w_, h_) ((struct rectf) {.x = x_, .y = y_, .w = w_, .h = h_})
 #define RECTF2(pos_, size_) ((struct rectf) {.pos = pos_, .size = size_})
 
+struct rects {
+	union {
+		struct poss pos;
+		struct {
+			size_t x, y;
+		};
+	};
+	union {
+		struct poss size;
+		struct {
+			size_t w, h;
+		};
+	};
+};
+
+#define RECTS(x_, y_, w_, h_) ((struct rects) {.x = x_, .y = y_, .w = w_, .h = h_})
+
 #define SWAP(type, a, b)         \
 	{                            \
 		type temp##__LINE__ = b; \
@@ -64,6 +82,11 @@ struct rectf {
 struct rectf get_fit_rectf(struct posf inner_size, struct rectf frame_rect);
 struct posf map_rectf(struct posf pos, struct rectf from, struct rectf to);
 
+// splitmix64 pseudo-random numbers, seeded by setting state to anything
+uint64_t splitmix64(uint64_t *state);
+// uniform in [0, 1)
+double random_unit(uint64_t *state);
+
 #define ASSERT(x)            \
 	{                        \
 		if (!(x)) goto fail; \